@@ -0,0 +1,644 @@
+// SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
+/* Copyright (c) 2024 NFS Server Kernel Processing */
+/*
+ * nfs_bench: NFSv3/UDP load generator for nfs_server.
+ *
+ * Each thread keeps a window of calls in flight on its own socket and
+ * records the latency of every reply. Calls go out with a DSCP mark;
+ * the TC fast path builds its reply by reflecting the request headers
+ * and so keeps the mark, while replies from user space carry the
+ * socket default. That is how each reply is put down to the kernel or
+ * the user space path.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <argp.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include "nfs_server.h"
+#include "nfs_xdr.h"
+
+#define BENCH_MAX_THREADS 256
+#define BENCH_MAX_WINDOW 256        /* Slot number is the low byte of the XID */
+#define BENCH_MAX_FILES 65536
+#define BENCH_CALL_MAX 512
+#define BENCH_REPLY_MAX (NFS_MAX_IO_SIZE + 1024)
+#define BENCH_TIMEOUT_NS 1000000000ULL
+
+/* Latency histogram: 16 linear sub-buckets per power of two of ns,
+ * which keeps p999 within about 6% */
+#define HIST_SUB 16
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+enum bench_path {
+    PATH_KERNEL,
+    PATH_USER,
+    NPATHS
+};
+
+static const char *const path_names[NPATHS] = { "kernel", "user" };
+
+static const struct {
+    const char *name;
+    __u32 proc;
+} bench_procs[] = {
+    { "null", NFSPROC3_NULL },
+    { "getattr", NFSPROC3_GETATTR },
+    { "lookup", NFSPROC3_LOOKUP },
+    { "read", NFSPROC3_READ },
+};
+
+#define NBENCH_PROCS (sizeof(bench_procs) / sizeof(bench_procs[0]))
+
+static struct env {
+    const char *server;
+    int port;
+    int threads;
+    int window;
+    double rate;                /* Calls per second over all threads, 0 for open loop */
+    int duration;
+    unsigned int mix[NBENCH_PROCS];
+    unsigned int mix_total;
+    const char *file_fmt;
+    int nfiles;
+    __u32 read_size;
+    int tos;
+    struct nfs_fh root;
+} env = {
+    .server = "127.0.0.1",
+    .port = NFS_PORT,
+    .threads = 4,
+    .window = 8,
+    .duration = 10,
+    .mix = { 1, 4, 1, 4 },
+    .mix_total = 10,
+    .file_fmt = "test.txt",
+    .nfiles = 1,
+    .read_size = 4096,
+    .tos = 0x20,                /* DSCP CS1 */
+    .root = { .len = 8, .data = { 0, 0, 0, 0, 0xef, 0xbe, 0xad, 0xde } },
+};
+
+const char argp_program_doc[] =
+    "NFSv3 load generator and latency benchmark\n"
+    "\n"
+    "Sends NULL, GETATTR, LOOKUP and READ calls with AUTH_UNIX over UDP and\n"
+    "reports throughput and p50/p99/p999 latency per procedure, split by\n"
+    "whether the kernel fast path or user space answered.\n"
+    "\n"
+    "USAGE: ./nfs_bench [-s server] [-t threads] [-w window] [-r rate] [-d secs]\n"
+    "                   [-m mix] [-f name] [-n files] [-b bytes] [-R root_fh]\n"
+    "\n"
+    "The mix is a list of PROC:WEIGHT, e.g. -m null:1,getattr:4,lookup:1,read:4.\n"
+    "Files are looked up in the export root; with -n N the name is a printf\n"
+    "pattern, e.g. -f bench.%d -n 1000 for bench.0 ... bench.999.\n";
+
+static const struct argp_option opts[] = {
+    { "server", 's', "ADDR", 0, "Server IPv4 address (default: 127.0.0.1)" },
+    { "port", 'p', "PORT", 0, "Server port (default: 2049)" },
+    { "threads", 't', "N", 0, "Sending threads (default: 4)" },
+    { "window", 'w', "N", 0, "Calls in flight per thread (default: 8)" },
+    { "rate", 'r', "CPS", 0, "Total calls per second (default: as fast as replies come)" },
+    { "duration", 'd', "SECS", 0, "Run time (default: 10)" },
+    { "mix", 'm', "MIX", 0, "Procedure mix" },
+    { "file", 'f', "NAME", 0, "File name or pattern (default: test.txt)" },
+    { "files", 'n', "N", 0, "File set size (default: 1)" },
+    { "read-size", 'b', "BYTES", 0, "READ count (default: 4096)" },
+    { "tos", 'T', "TOS", 0, "IP TOS used to mark calls (default: 0x20)" },
+    { "root-fh", 'R', "HEX", 0, "Export root handle as printed by nfs_server" },
+    {},
+};
+
+static int parse_mix(const char *arg)
+{
+    char buf[256], *tok, *save;
+
+    snprintf(buf, sizeof(buf), "%s", arg);
+    memset(env.mix, 0, sizeof(env.mix));
+    env.mix_total = 0;
+    for (tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        char *colon = strchr(tok, ':');
+        unsigned int weight = colon ? atoi(colon + 1) : 1;
+        size_t i;
+
+        if (colon)
+            *colon = '\0';
+        for (i = 0; i < NBENCH_PROCS; i++) {
+            if (!strcasecmp(tok, bench_procs[i].name))
+                break;
+        }
+        if (i == NBENCH_PROCS)
+            return -1;
+        env.mix[i] = weight;
+        env.mix_total += weight;
+    }
+    return env.mix_total ? 0 : -1;
+}
+
+static int parse_fh(const char *hex, struct nfs_fh *fh)
+{
+    size_t len = strlen(hex);
+
+    if (len % 2 || len / 2 > sizeof(fh->data))
+        return -1;
+    fh->len = len / 2;
+    for (size_t i = 0; i < fh->len; i++) {
+        unsigned int byte;
+
+        if (sscanf(hex + 2 * i, "%2x", &byte) != 1)
+            return -1;
+        fh->data[i] = byte;
+    }
+    return 0;
+}
+
+static error_t parse_arg(int key, char *arg, struct argp_state *state)
+{
+    switch (key) {
+    case 's':
+        env.server = arg;
+        break;
+    case 'p':
+        env.port = atoi(arg);
+        break;
+    case 't':
+        env.threads = atoi(arg);
+        if (env.threads < 1 || env.threads > BENCH_MAX_THREADS)
+            argp_error(state, "threads must be 1..%d", BENCH_MAX_THREADS);
+        break;
+    case 'w':
+        env.window = atoi(arg);
+        if (env.window < 1 || env.window > BENCH_MAX_WINDOW)
+            argp_error(state, "window must be 1..%d", BENCH_MAX_WINDOW);
+        break;
+    case 'r':
+        env.rate = atof(arg);
+        break;
+    case 'd':
+        env.duration = atoi(arg);
+        break;
+    case 'm':
+        if (parse_mix(arg) < 0)
+            argp_error(state, "invalid mix: %s", arg);
+        break;
+    case 'f':
+        env.file_fmt = arg;
+        break;
+    case 'n':
+        env.nfiles = atoi(arg);
+        if (env.nfiles < 1 || env.nfiles > BENCH_MAX_FILES)
+            argp_error(state, "files must be 1..%d", BENCH_MAX_FILES);
+        break;
+    case 'b':
+        env.read_size = atoi(arg);
+        if (!env.read_size || env.read_size > NFS_MAX_IO_SIZE)
+            argp_error(state, "read size must be 1..%d", NFS_MAX_IO_SIZE);
+        break;
+    case 'T':
+        env.tos = strtol(arg, NULL, 0) & 0xfc;   /* Leave the ECN bits alone */
+        if (!env.tos)
+            argp_error(state, "the TOS mark must not be 0");
+        break;
+    case 'R':
+        if (parse_fh(arg, &env.root) < 0)
+            argp_error(state, "invalid file handle: %s", arg);
+        break;
+    case ARGP_KEY_ARG:
+        argp_usage(state);
+        break;
+    default:
+        return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static const struct argp argp = {
+    .options = opts,
+    .parser = parse_arg,
+    .doc = argp_program_doc,
+};
+
+struct bench_hist {
+    __u64 b[HIST_BUCKETS];
+};
+
+struct bench_slot {
+    __u32 xid;
+    __u32 proc_idx;
+    __u64 sent_ns;
+    bool busy;
+};
+
+struct bench_thread {
+    pthread_t tid;
+    int id;
+    int sock;
+    unsigned int seed;
+    __u64 sent;
+    __u64 received;
+    __u64 timeouts;
+    __u64 nfs_errors;           /* Replies with a status other than NFS3_OK */
+    __u64 rpc_errors;           /* Replies that were not accepted */
+    struct bench_slot slots[BENCH_MAX_WINDOW];
+    struct bench_hist hist[NBENCH_PROCS][NPATHS];
+};
+
+static struct nfs_fh *file_fhs;
+static volatile bool stop;
+
+static void sig_handler(int sig)
+{
+    stop = true;
+}
+
+static __u64 now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int hist_index(__u64 ns)
+{
+    int msb;
+
+    if (ns < HIST_SUB)
+        return ns;
+    msb = 63 - __builtin_clzll(ns);
+    return (msb - 3) * HIST_SUB + ((ns >> (msb - 4)) & (HIST_SUB - 1));
+}
+
+/* Lower bound in ns of bucket @idx */
+static __u64 hist_value(int idx)
+{
+    int msb;
+
+    if (idx < HIST_SUB)
+        return idx;
+    msb = idx / HIST_SUB + 3;
+    return (1ULL << msb) | ((__u64)(idx % HIST_SUB) << (msb - 4));
+}
+
+static __u64 hist_percentile(const struct bench_hist *h, __u64 n, double q)
+{
+    __u64 want = (__u64)(n * q), seen = 0;
+
+    if (want < 1)
+        want = 1;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->b[i];
+        if (seen >= want)
+            return hist_value(i);
+    }
+    return 0;
+}
+
+/* Encode an NFSv3 call with AUTH_UNIX credentials */
+static __u32 encode_call(__u8 *buf, __u32 xid, __u32 proc, const struct nfs_fh *fh,
+                         const char *name)
+{
+    static const char machine[] = "nfs_bench";
+    struct xdr_buf x;
+
+    xdr_enc_reserve(&x, buf, BENCH_CALL_MAX, 0);
+    xdr_encode_u32(&x, xid);
+    xdr_encode_u32(&x, RPC_CALL);
+    xdr_encode_u32(&x, 2);
+    xdr_encode_u32(&x, RPC_PROGRAM_NFS);
+    xdr_encode_u32(&x, NFS_VERSION_3);
+    xdr_encode_u32(&x, proc);
+
+    xdr_encode_u32(&x, RPC_AUTH_UNIX);
+    xdr_encode_u32(&x, 4 + 4 + XDR_PADLEN(sizeof(machine) - 1) + 4 + 4 + 4);
+    xdr_encode_u32(&x, 0);                      /* Stamp */
+    xdr_encode_string(&x, machine, sizeof(machine) - 1);
+    xdr_encode_u32(&x, getuid());
+    xdr_encode_u32(&x, getgid());
+    xdr_encode_u32(&x, 0);                      /* No auxiliary gids */
+    xdr_encode_u32(&x, RPC_AUTH_NULL);
+    xdr_encode_u32(&x, 0);
+
+    switch (proc) {
+    case NFSPROC3_GETATTR:
+        xdr_encode_fh3(&x, fh);
+        break;
+    case NFSPROC3_LOOKUP:
+        xdr_encode_fh3(&x, &env.root);
+        xdr_encode_string(&x, name, strlen(name));
+        break;
+    case NFSPROC3_READ:
+        xdr_encode_fh3(&x, fh);
+        xdr_encode_u64(&x, 0);
+        xdr_encode_u32(&x, env.read_size);
+        break;
+    }
+    return xdr_enc_len(&x, buf);
+}
+
+/* Decode a reply up to the NFS status. Returns the status, or -1 if the
+ * call was not accepted. A LOOKUP result handle goes to @fh_out. */
+static int decode_reply(const __u8 *buf, __u32 len, __u32 *xid, struct nfs_fh *fh_out)
+{
+    struct xdr_dec d;
+    __u32 verf_len, status;
+
+    xdr_dec_init(&d, buf, len);
+    *xid = xdr_decode_u32(&d);
+    if (xdr_decode_u32(&d) != RPC_REPLY || xdr_decode_u32(&d) != RPC_MSG_ACCEPTED)
+        return -1;
+    xdr_decode_u32(&d);                         /* Verifier flavor */
+    xdr_decode_opaque(&d, &verf_len, 400);
+    if (xdr_decode_u32(&d) != 0 || d.err)       /* accept_stat SUCCESS */
+        return -1;
+    if (d.p == d.end)                           /* NULL has no result */
+        return NFS3_OK;
+    status = xdr_decode_u32(&d);
+    if (fh_out && status == NFS3_OK) {
+        const __u8 *p = xdr_decode_opaque(&d, &fh_out->len, sizeof(fh_out->data));
+
+        if (!p)
+            return -1;
+        memcpy(fh_out->data, p, fh_out->len);
+    }
+    return d.err ? -1 : (int)status;
+}
+
+static int open_socket(void)
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(env.port) };
+    int sock, one = 1, rcvbuf = 4 << 20;
+
+    if (inet_pton(AF_INET, env.server, &addr.sin_addr) != 1)
+        return -1;
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0)
+        return -1;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    if (setsockopt(sock, IPPROTO_IP, IP_TOS, &env.tos, sizeof(env.tos)) < 0 ||
+        setsockopt(sock, IPPROTO_IP, IP_RECVTOS, &one, sizeof(one)) < 0 ||
+        connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/* One LOOKUP, retried a few times, for building the file set */
+static int lookup_file(int sock, const char *name, struct nfs_fh *fh)
+{
+    __u8 call[BENCH_CALL_MAX];
+    static __u8 reply[BENCH_REPLY_MAX];
+    __u32 xid = 0xb0000000 | (rand() & 0xffffff), len, rxid;
+
+    len = encode_call(call, xid, NFSPROC3_LOOKUP, NULL, name);
+    for (int attempt = 0; attempt < 3; attempt++) {
+        struct pollfd pfd = { .fd = sock, .events = POLLIN };
+
+        if (send(sock, call, len, 0) < 0)
+            return -1;
+        while (poll(&pfd, 1, 1000) > 0) {
+            ssize_t n = recv(sock, reply, sizeof(reply), 0);
+            int status = n > 0 ? decode_reply(reply, n, &rxid, fh) : -1;
+
+            if (n > 0 && rxid == xid)
+                return status == NFS3_OK ? 0 : -1;
+        }
+    }
+    return -1;
+}
+
+static __u32 pick_proc(struct bench_thread *t)
+{
+    unsigned int r = rand_r(&t->seed) % env.mix_total;
+
+    for (size_t i = 0; i < NBENCH_PROCS; i++) {
+        if (r < env.mix[i])
+            return i;
+        r -= env.mix[i];
+    }
+    return 0;
+}
+
+static void send_call(struct bench_thread *t, int slot, __u32 gen)
+{
+    struct bench_slot *s = &t->slots[slot];
+    __u8 call[BENCH_CALL_MAX];
+    char name[MAX_FILENAME_LEN];
+    int file = rand_r(&t->seed) % env.nfiles;
+    __u32 len;
+
+    s->proc_idx = pick_proc(t);
+    s->xid = (t->id << 24) | ((gen & 0xffff) << 8) | slot;
+    snprintf(name, sizeof(name), env.file_fmt, file);
+    len = encode_call(call, s->xid, bench_procs[s->proc_idx].proc, &file_fhs[file], name);
+    s->sent_ns = now_ns();
+    s->busy = true;
+    if (send(t->sock, call, len, 0) < 0)
+        s->busy = false;
+    else
+        t->sent++;
+}
+
+/* Read every reply that is ready and account it */
+static void recv_replies(struct bench_thread *t)
+{
+    static __thread __u8 reply[BENCH_REPLY_MAX];
+    char cbuf[CMSG_SPACE(sizeof(int))];
+
+    for (;;) {
+        struct iovec iov = { .iov_base = reply, .iov_len = sizeof(reply) };
+        struct msghdr msg = {
+            .msg_iov = &iov, .msg_iovlen = 1,
+            .msg_control = cbuf, .msg_controllen = sizeof(cbuf),
+        };
+        struct bench_slot *s;
+        struct cmsghdr *cm;
+        int tos = 0, status;
+        ssize_t n;
+        __u32 xid;
+
+        n = recvmsg(t->sock, &msg, MSG_DONTWAIT);
+        if (n <= 0)
+            return;
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (cm->cmsg_level == IPPROTO_IP && cm->cmsg_type == IP_TOS)
+                tos = *(__u8 *)CMSG_DATA(cm);
+        }
+
+        status = decode_reply(reply, n, &xid, NULL);
+        s = &t->slots[xid & 0xff];
+        if ((xid >> 24) != (__u32)t->id || (xid & 0xff) >= (__u32)env.window ||
+            !s->busy || s->xid != xid)
+            continue;           /* Late reply to a call that timed out */
+
+        s->busy = false;
+        t->received++;
+        if (status < 0)
+            t->rpc_errors++;
+        else if (status != NFS3_OK)
+            t->nfs_errors++;
+        t->hist[s->proc_idx][(tos & 0xfc) == env.tos ? PATH_KERNEL : PATH_USER]
+            .b[hist_index(now_ns() - s->sent_ns)]++;
+    }
+}
+
+static void *bench_thread_fn(void *arg)
+{
+    struct bench_thread *t = arg;
+    __u64 interval = env.rate > 0 ? (__u64)(env.threads * 1e9 / env.rate) : 0;
+    __u64 next_send = now_ns();
+    __u32 gen = 0;
+
+    while (!stop) {
+        struct pollfd pfd = { .fd = t->sock, .events = POLLIN };
+        __u64 now = now_ns();
+        int wait_ms = 10;
+
+        for (int i = 0; i < env.window; i++) {
+            struct bench_slot *s = &t->slots[i];
+
+            if (s->busy && now - s->sent_ns > BENCH_TIMEOUT_NS) {
+                s->busy = false;
+                t->timeouts++;
+            }
+            if (s->busy)
+                continue;
+            if (interval) {
+                if (now < next_send) {
+                    wait_ms = (next_send - now) / 1000000;
+                    break;
+                }
+                /* Don't make up for a long stall with a burst */
+                next_send = next_send + BENCH_TIMEOUT_NS < now ? now : next_send + interval;
+            }
+            send_call(t, i, gen++);
+        }
+
+        if (poll(&pfd, 1, wait_ms) > 0)
+            recv_replies(t);
+    }
+    return NULL;
+}
+
+static void print_report(struct bench_thread *threads, double secs)
+{
+    struct bench_hist *h = calloc(1, sizeof(*h));
+    __u64 sent = 0, received = 0, timeouts = 0, nfs_errors = 0, rpc_errors = 0;
+
+    if (!h)
+        return;
+    for (int i = 0; i < env.threads; i++) {
+        sent += threads[i].sent;
+        received += threads[i].received;
+        timeouts += threads[i].timeouts;
+        nfs_errors += threads[i].nfs_errors;
+        rpc_errors += threads[i].rpc_errors;
+    }
+
+    printf("\n=== nfs_bench: %d threads x %d in flight, %.1f s ===\n",
+           env.threads, env.window, secs);
+    printf("Sent:        %llu\n", (unsigned long long)sent);
+    printf("Replies:     %llu (%.0f calls/s)\n", (unsigned long long)received, received / secs);
+    printf("Timeouts:    %llu\n", (unsigned long long)timeouts);
+    printf("NFS errors:  %llu\n", (unsigned long long)nfs_errors);
+    printf("RPC errors:  %llu\n", (unsigned long long)rpc_errors);
+    printf("\n%-8s %-7s %10s %10s %10s %10s %10s\n", "Proc", "Path", "Replies", "Calls/s",
+           "p50 us", "p99 us", "p999 us");
+
+    for (size_t p = 0; p < NBENCH_PROCS; p++) {
+        for (int path = 0; path < NPATHS; path++) {
+            __u64 n = 0;
+
+            memset(h, 0, sizeof(*h));
+            for (int i = 0; i < env.threads; i++) {
+                for (int b = 0; b < HIST_BUCKETS; b++)
+                    h->b[b] += threads[i].hist[p][path].b[b];
+            }
+            for (int b = 0; b < HIST_BUCKETS; b++)
+                n += h->b[b];
+            if (!n)
+                continue;
+            printf("%-8s %-7s %10llu %10.0f %10.1f %10.1f %10.1f\n",
+                   bench_procs[p].name, path_names[path], (unsigned long long)n, n / secs,
+                   hist_percentile(h, n, 0.50) / 1e3, hist_percentile(h, n, 0.99) / 1e3,
+                   hist_percentile(h, n, 0.999) / 1e3);
+        }
+    }
+    free(h);
+}
+
+int main(int argc, char **argv)
+{
+    struct bench_thread *threads;
+    __u64 start;
+    int sock, err;
+
+    err = argp_parse(&argp, argc, argv, 0, NULL, NULL);
+    if (err)
+        return err;
+    if (!strchr(env.file_fmt, '%'))
+        env.nfiles = 1;
+
+    signal(SIGINT, sig_handler);
+    signal(SIGTERM, sig_handler);
+
+    /* Resolve the file set once, up front */
+    file_fhs = calloc(env.nfiles, sizeof(*file_fhs));
+    sock = open_socket();
+    if (!file_fhs || sock < 0) {
+        fprintf(stderr, "Failed to set up: %s\n", strerror(errno));
+        return 1;
+    }
+    for (int i = 0; i < env.nfiles; i++) {
+        char name[MAX_FILENAME_LEN];
+
+        snprintf(name, sizeof(name), env.file_fmt, i);
+        if (lookup_file(sock, name, &file_fhs[i]) < 0) {
+            fprintf(stderr, "LOOKUP %s failed; is the server up and the file exported?\n", name);
+            return 1;
+        }
+    }
+    close(sock);
+
+    threads = calloc(env.threads, sizeof(*threads));
+    if (!threads)
+        return 1;
+    start = now_ns();
+    for (int i = 0; i < env.threads; i++) {
+        threads[i].id = i;
+        threads[i].seed = start ^ (i * 2654435761U);
+        threads[i].sock = open_socket();
+        if (threads[i].sock < 0 ||
+            pthread_create(&threads[i].tid, NULL, bench_thread_fn, &threads[i])) {
+            fprintf(stderr, "Failed to start thread %d\n", i);
+            stop = true;
+            env.threads = i;
+            break;
+        }
+    }
+
+    for (int s = 0; s < env.duration * 10 && !stop; s++)
+        usleep(100000);
+    stop = true;
+    for (int i = 0; i < env.threads; i++) {
+        pthread_join(threads[i].tid, NULL);
+        close(threads[i].sock);
+    }
+
+    print_report(threads, (now_ns() - start) / 1e9);
+    free(threads);
+    free(file_fhs);
+    return 0;
+}
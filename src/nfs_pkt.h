@@ -0,0 +1,212 @@
+// SPDX-License-Identifier: GPL-2.0 OR BSD-3-Clause
+/* Copyright (c) 2024 NFS Server Kernel Processing */
+#ifndef __NFS_PKT_H
+#define __NFS_PKT_H
+
+/*
+ * Ethernet to UDP parser shared by the TC and XDP programs.
+ *
+ * Walks up to NFS_PKT_MAX_VLANS 802.1Q/802.1ad tags, IPv4 with options
+ * and IPv6 with up to NFS_PKT_MAX_EXTHDRS extension headers. Of a
+ * fragmented datagram only the first fragment has the UDP header; it is
+ * parsed and flagged, the rest are refused. Works on direct packet
+ * pointers, so the same code takes an __sk_buff's or an xdp_md's
+ * data/data_end; headers outside the linear part of an skb are not
+ * looked at.
+ *
+ * Addresses come out as struct nfs_addr, IPv4 ones v4-mapped, so every
+ * map keyed by client is the same for both families.
+ */
+
+#include "nfs_server.h"
+
+#ifndef ETH_P_IP
+#define ETH_P_IP 0x0800
+#endif
+
+#ifndef ETH_P_IPV6
+#define ETH_P_IPV6 0x86DD
+#endif
+
+#ifndef ETH_P_8021Q
+#define ETH_P_8021Q 0x8100
+#endif
+
+#ifndef ETH_P_8021AD
+#define ETH_P_8021AD 0x88A8
+#endif
+
+/* IPv6 extension header types (not in vmlinux.h) */
+#ifndef NEXTHDR_HOP
+#define NEXTHDR_HOP 0
+#define NEXTHDR_ROUTING 43
+#define NEXTHDR_FRAGMENT 44
+#define NEXTHDR_AUTH 51
+#define NEXTHDR_DEST 60
+#endif
+
+#define NFS_PKT_MAX_VLANS 2
+#define NFS_PKT_MAX_EXTHDRS 4
+
+/* Longest link-layer header the parser accepts: Ethernet and two tags */
+#define NFS_PKT_MAX_L2 (14 + NFS_PKT_MAX_VLANS * 4)
+
+/* Furthest UDP header accepted. Real clients come nowhere near it; the
+ * bound is what lets the verifier follow packet pointers past l4_off. */
+#define NFS_PKT_MAX_L4_OFF 256
+
+/* A parsed UDP datagram; offsets are from the start of the frame */
+struct nfs_pkt {
+    struct nfs_addr saddr;
+    struct nfs_addr daddr;
+    __u16 l3_off;        /* IP header */
+    __u16 l4_off;        /* UDP header; past l3_off + nfs_pkt_l3_base() with
+                          * IPv4 options or IPv6 extension headers */
+    __u16 sport;         /* Network byte order */
+    __u16 dport;         /* Network byte order */
+    __u8 ipv6;
+    __u8 first_frag;     /* More fragments follow; the call is incomplete */
+    __u8 pad[2];
+};
+
+/* Size of the fixed IP header of @pkt */
+static __always_inline __u32 nfs_pkt_l3_base(const struct nfs_pkt *pkt)
+{
+    return pkt->ipv6 ? sizeof(struct ipv6hdr) : sizeof(struct iphdr);
+}
+
+static __always_inline void nfs_addr_from_v4(struct nfs_addr *addr, __be32 v4)
+{
+    addr->a32[0] = 0;
+    addr->a32[1] = 0;
+    addr->a32[2] = bpf_htonl(0xffff);
+    addr->a32[3] = v4;
+}
+
+static __always_inline void nfs_addr_from_v6(struct nfs_addr *addr, const struct in6_addr *v6)
+{
+    addr->a32[0] = v6->in6_u.u6_addr32[0];
+    addr->a32[1] = v6->in6_u.u6_addr32[1];
+    addr->a32[2] = v6->in6_u.u6_addr32[2];
+    addr->a32[3] = v6->in6_u.u6_addr32[3];
+}
+
+/* Skip the IPv6 extension headers at @hdr. Returns the upper-layer
+ * header with its protocol in @nexthdr, or NULL for a fragment other
+ * than the first, a chain longer than NFS_PKT_MAX_EXTHDRS or a
+ * truncated packet. */
+static __always_inline void *nfs_pkt_skip_exthdrs(void *hdr, void *data_end, __u8 *nexthdr,
+                                                  __u8 *first_frag)
+{
+    struct ipv6_opt_hdr *opt;
+    struct frag_hdr *frag;
+
+    for (int i = 0; i < NFS_PKT_MAX_EXTHDRS; i++) {
+        switch (*nexthdr) {
+        case NEXTHDR_HOP:
+        case NEXTHDR_ROUTING:
+        case NEXTHDR_DEST:
+            opt = hdr;
+            if ((void *)(opt + 1) > data_end)
+                return NULL;
+            *nexthdr = opt->nexthdr;
+            hdr += (opt->hdrlen + 1) * 8;
+            break;
+        case NEXTHDR_AUTH:
+            opt = hdr;
+            if ((void *)(opt + 1) > data_end)
+                return NULL;
+            *nexthdr = opt->nexthdr;
+            hdr += (opt->hdrlen + 2) * 4;
+            break;
+        case NEXTHDR_FRAGMENT:
+            frag = hdr;
+            if ((void *)(frag + 1) > data_end || (frag->frag_off & bpf_htons(0xfff8)))
+                return NULL;
+            /* An atomic fragment (M clear) is the whole datagram */
+            *first_frag = !!(frag->frag_off & bpf_htons(1));
+            *nexthdr = frag->nexthdr;
+            hdr = frag + 1;
+            break;
+        default:
+            return hdr;
+        }
+    }
+
+    /* Out of budget; fine only if the chain ended right here */
+    switch (*nexthdr) {
+    case NEXTHDR_HOP:
+    case NEXTHDR_ROUTING:
+    case NEXTHDR_DEST:
+    case NEXTHDR_AUTH:
+    case NEXTHDR_FRAGMENT:
+        return NULL;
+    }
+    return hdr;
+}
+
+/* Parse the frame in [@data, @data_end) down to its UDP header. Returns
+ * 0 and fills @pkt for a UDP datagram, or the first fragment of one,
+ * over IPv4 or IPv6; -1 for anything else. */
+static __always_inline int nfs_parse_udp(void *data, void *data_end, struct nfs_pkt *pkt)
+{
+    struct ethhdr *eth = data;
+    struct vlan_hdr *vlan;
+    struct udphdr *udp;
+    void *l3;
+    __be16 proto;
+    __u8 nexthdr;
+
+    if ((void *)(eth + 1) > data_end)
+        return -1;
+    proto = eth->h_proto;
+    l3 = eth + 1;
+    pkt->first_frag = 0;
+
+    for (int i = 0; i < NFS_PKT_MAX_VLANS; i++) {
+        if (proto != bpf_htons(ETH_P_8021Q) && proto != bpf_htons(ETH_P_8021AD))
+            break;
+        vlan = l3;
+        if ((void *)(vlan + 1) > data_end)
+            return -1;
+        proto = vlan->h_vlan_encapsulated_proto;
+        l3 = vlan + 1;
+    }
+
+    if (proto == bpf_htons(ETH_P_IP)) {
+        struct iphdr *ip = l3;
+
+        if ((void *)(ip + 1) > data_end || ip->ihl < 5 ||
+            ip->protocol != IPPROTO_UDP || (ip->frag_off & bpf_htons(0x1fff)))
+            return -1;
+        pkt->first_frag = !!(ip->frag_off & bpf_htons(0x2000));
+        nfs_addr_from_v4(&pkt->saddr, ip->saddr);
+        nfs_addr_from_v4(&pkt->daddr, ip->daddr);
+        udp = l3 + ip->ihl * 4;
+        pkt->ipv6 = 0;
+    } else if (proto == bpf_htons(ETH_P_IPV6)) {
+        struct ipv6hdr *ip6 = l3;
+
+        if ((void *)(ip6 + 1) > data_end)
+            return -1;
+        nexthdr = ip6->nexthdr;
+        udp = nfs_pkt_skip_exthdrs(ip6 + 1, data_end, &nexthdr, &pkt->first_frag);
+        if (!udp || nexthdr != IPPROTO_UDP)
+            return -1;
+        nfs_addr_from_v6(&pkt->saddr, &ip6->saddr);
+        nfs_addr_from_v6(&pkt->daddr, &ip6->daddr);
+        pkt->ipv6 = 1;
+    } else {
+        return -1;
+    }
+
+    if ((void *)(udp + 1) > data_end || (void *)udp - data > NFS_PKT_MAX_L4_OFF)
+        return -1;
+    pkt->l3_off = l3 - data;
+    pkt->l4_off = (void *)udp - data;
+    pkt->sport = udp->source;
+    pkt->dport = udp->dest;
+    return 0;
+}
+
+#endif /* __NFS_PKT_H */
@@ -7,6 +7,8 @@
 #include <bpf/bpf_core_read.h>
 #include <bpf/bpf_endian.h>
 #include "nfs_server.h"
+#include "nfs_xdr.h"
+#include "nfs_pkt.h"
 
 /* TC action definitions */
 #ifndef TC_ACT_OK
@@ -17,17 +19,65 @@
 #define TC_ACT_SHOT 2
 #endif
 
-/* Network protocol definitions */
-#ifndef ETH_P_IP
-#define ETH_P_IP 0x0800
+#ifndef TC_ACT_REDIRECT
+#define TC_ACT_REDIRECT 7
 #endif
 
+/* Socket families, as seen in __sk_buff->family */
+#ifndef AF_INET
+#define AF_INET 2
+#define AF_INET6 10
+#endif
+
+#ifndef SK_PASS
+#define SK_DROP 0
+#define SK_PASS 1
+#endif
+
+#ifndef ETH_ALEN
+#define ETH_ALEN 6
+#endif
+
+#ifndef EMSGSIZE
+#define EMSGSIZE 90
+#endif
+
+/* bpf_csum_diff() sums at most this many bytes per call */
+#define NFS_CSUM_CHUNK 512
+
+/* Segments in one UDP_SEGMENT send (the kernel's UDP_MAX_SEGMENTS) */
+#define NFS_GSO_MAX_SEGS 64
+
+/* Kernel READ replies are limited to this window so the copy out of
+ * the arena stays within bounds the verifier can prove. */
+#define NFS_KERNEL_READ_WINDOW 4096
+
+/* Largest reply header the fast path builds (READ, without data) */
+#define NFS_FAST_REPLY_MAX (XDR_RPC_REPLY_HDR_SIZE + 4 + XDR_POST_OP_ATTR_SIZE + 12)
+
+/* One request's worth of token bucket credit */
+#define NFS_QOS_TOKEN 1000000000ULL
+
+/* Longest JUKEBOX reply: RPC header, status and up to four FALSE words */
+#define NFS_JUKEBOX_WORDS (XDR_RPC_REPLY_HDR_SIZE / 4 + 1 + 4)
+
+/* Pointers into the arena (needs clang 18 or later) */
+#define __arena __attribute__((address_space(1)))
+
 char LICENSE[] SEC("license") = "Dual BSD/GPL";
 
 /* Maps for storing data and communication */
-struct {
+struct nfs_event_rb {
     __uint(type, BPF_MAP_TYPE_RINGBUF);
-    __uint(max_entries, 256 * 1024);
+    __uint(max_entries, NFS_EVENT_RB_SIZE);
+};
+
+/* One event ring per CPU, created and inserted by user space */
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY_OF_MAPS);
+    __uint(max_entries, NFS_EVENT_MAX_CPUS);
+    __type(key, __u32);
+    __array(values, struct nfs_event_rb);
 } nfs_events SEC(".maps");
 
 /* NFS file cache map for frequently accessed files */
@@ -38,6 +88,29 @@ struct {
     __type(value, struct nfs_file_cache_entry);
 } nfs_file_cache SEC(".maps");
 
+/* Cached file data, allocated and written by user space through its
+ * mapping of the arena */
+struct {
+    __uint(type, BPF_MAP_TYPE_ARENA);
+    __uint(map_flags, BPF_F_MMAPABLE);
+    __uint(max_entries, NFS_ARENA_PAGES);
+    __ulong(map_extra, NFS_ARENA_ADDR);
+} nfs_arena SEC(".maps");
+
+/* Placed at offset 0 of nfs_arena; data offsets are relative to it */
+struct nfs_arena_hdr __arena nfs_arena_hdr;
+
+/* Per-CPU copy of the data a READ returns, at its offset in the file;
+ * helpers cannot read the arena */
+#define NFS_READ_SCRATCH_WORDS (NFS_KERNEL_READ_WINDOW * 2 / 8)
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, __u64[NFS_READ_SCRATCH_WORDS]);
+} nfs_read_scratch SEC(".maps");
+
 /* NFS file handle to filename mapping */
 struct {
     __uint(type, BPF_MAP_TYPE_HASH);
@@ -46,57 +119,265 @@ struct {
     __type(value, char[MAX_FILENAME_LEN]);
 } fh_to_name SEC(".maps");
 
-/* Client connection tracking */
+/* Client request accounting, per CPU so the counters are never shared
+ * between cores; least recently seen clients are evicted first */
 struct {
-    __uint(type, BPF_MAP_TYPE_HASH);
-    __uint(max_entries, 1024);
-    __type(key, __u32);  /* client IP */
+    __uint(type, BPF_MAP_TYPE_LRU_PERCPU_HASH);
+    __uint(max_entries, 65536);
+    __type(key, struct nfs_addr);
     __type(value, struct nfs_client_state);
 } client_track SEC(".maps");
 
-/* Statistics map */
+/* Accepted NFS/TCP sockets, used by the sk_skb fast path */
+struct {
+    __uint(type, BPF_MAP_TYPE_SOCKHASH);
+    __uint(max_entries, 1024);
+    __type(key, struct nfs_sock_key);
+    __type(value, __u32);
+} nfs_sock_hash SEC(".maps");
+
+/* Socket cookie of an accepted NFS/TCP connection to its slot in
+ * nfs_tcp_order, kept by user space */
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(max_entries, NFS_TCP_MAX_CONNS);
+    __type(key, __u64);
+    __type(value, __u32);
+} nfs_tcp_slots SEC(".maps");
+
+/* Reply order per TCP connection slot, mmapped by user space */
 struct {
     __uint(type, BPF_MAP_TYPE_ARRAY);
-    __uint(max_entries, 16);
+    __uint(max_entries, NFS_TCP_MAX_CONNS);
+    __uint(map_flags, BPF_F_MMAPABLE);
+    __type(key, __u32);
+    __type(value, struct nfs_tcp_order);
+} nfs_tcp_order SEC(".maps");
+
+/* Reply header built by the fast path; record mark first so TCP and
+ * UDP can share the same encoding */
+struct nfs_reply_buf {
+    __u32 mark;
+    __u8 data[NFS_FAST_REPLY_MAX];
+};
+
+/* Per-CPU scratch space for building fast-path replies */
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, 1);
     __type(key, __u32);
-    __type(value, __u64);
+    __type(value, struct nfs_reply_buf);
+} nfs_reply_scratch SEC(".maps");
+
+/* Duplicate request cache for UDP calls sent to user space: dropped
+ * while in progress, replayed once user space stored the reply */
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __uint(max_entries, 4096);
+    __type(key, struct nfs_drc_key);
+    __type(value, struct nfs_drc_entry);
+} nfs_drc SEC(".maps");
+
+/* Per-CPU staging for new DRC entries, too large for the BPF stack */
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct nfs_drc_entry);
+} nfs_drc_scratch SEC(".maps");
+
+/* Forwarded calls waiting for their reply on egress (latency tracing) */
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __uint(max_entries, 16384);
+    __type(key, struct nfs_drc_key);
+    __type(value, struct nfs_xid_stamp);
+} nfs_xid_trace SEC(".maps");
+
+/* QoS rules by client prefix, written by user space */
+struct {
+    __uint(type, BPF_MAP_TYPE_LPM_TRIE);
+    __uint(max_entries, 256);
+    __uint(map_flags, BPF_F_NO_PREALLOC);
+    __type(key, struct nfs_qos_key);
+    __type(value, struct nfs_qos_rule);
+} nfs_qos_rules SEC(".maps");
+
+/* Per-client token buckets */
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __uint(max_entries, 65536);
+    __type(key, struct nfs_addr);
+    __type(value, struct nfs_qos_client);
+} nfs_qos_clients SEC(".maps");
+
+/* AF_XDP sockets by RX queue (--xsk): calls the kernel will not answer
+ * go to user space past the UDP stack */
+struct {
+    __uint(type, BPF_MAP_TYPE_XSKMAP);
+    __uint(max_entries, NFS_XSK_MAX_QUEUES);
+    __type(key, __u32);
+    __type(value, __u32);
+} nfs_xsks SEC(".maps");
+
+/* Cores NFS packets are steered to (-R), by slot */
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, NFS_STEER_MAX_CPUS);
+    __type(key, __u32);
+    __type(value, __u32);
+} nfs_steer_cpus SEC(".maps");
+
+/* Queue and kthread per steering target, by CPU id; sized to the
+ * possible CPUs by user space */
+struct {
+    __uint(type, BPF_MAP_TYPE_CPUMAP);
+    __uint(max_entries, 256);
+    __type(key, __u32);
+    __type(value, struct bpf_cpumap_val);
+} nfs_cpumap SEC(".maps");
+
+/* Statistics map: per-procedure outcomes and processing time, one
+ * entry per CPU (sized by user space, which mmaps it) */
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(map_flags, BPF_F_MMAPABLE);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct nfs_stats);
 } nfs_stats SEC(".maps");
 
-/* Configuration - can be set from user space */
-const volatile unsigned int enable_kernel_processing = 1;
-const volatile unsigned int max_cached_file_size = 4096;
-const volatile unsigned int cache_ttl_seconds = 300;
+/* Fixed at load time: the egress program is only attached with it */
+const volatile unsigned int enable_xid_trace = 0;
+
+/* Runtime configuration, a single-entry mmap'able array (.data) that
+ * user space writes while the programs run */
+volatile struct nfs_config nfs_config = {
+    .kernel_procs = NFS_KERNEL_PROCS_ALL,
+    .cache_ttl_seconds = 300,
+    .max_cached_file_size = MAX_NFS_DATA_SIZE,
+    .event_sample_rate = 1,
+    .events_enabled = 1,
+};
 
-/* Helper function to extract 32-bit big-endian value */
-static inline __u32 extract_be32(void *data, void *data_end, int offset)
+/* Whether the fast path may answer @proc */
+static __always_inline int kernel_proc_enabled(__u32 proc)
 {
-    if ((char *)data + offset + 4 > (char *)data_end)
-        return 0;
-    return bpf_ntohl(*(__u32 *)((char *)data + offset));
+    return proc < NFS3_NPROCS && (nfs_config.kernel_procs & (1U << proc));
 }
 
-/* Helper function to parse RPC header */
-static inline int parse_rpc_header(void *data, void *data_end, int payload_len, 
-                                   struct rpc_header *rpc)
+/* Decoded NFS call: RPC header, caller credentials and the arguments
+ * the fast path needs */
+struct nfs_call {
+    struct rpc_header rpc;
+    __u32 uid;           /* AUTH_UNIX uid, nobody otherwise */
+    __u32 gid;
+    struct nfs_fh fh;    /* Leading nfs_fh3 argument */
+    __u64 offset;        /* READ offset */
+    __u32 count;         /* READ count */
+    __u32 access;        /* ACCESS requested bits */
+};
+
+/* bpf_skb_load_bytes(), or bpf_xdp_load_bytes() with @xdp. Always
+ * inlined with a constant @xdp, so each program sees one helper. */
+static __always_inline long ctx_load_bytes(void *ctx, int xdp, __u32 off, void *to, __u32 len)
 {
-    if (payload_len < sizeof(struct rpc_header))
+    if (xdp)
+        return bpf_xdp_load_bytes(ctx, off, to, len);
+    return bpf_skb_load_bytes(ctx, off, to, len);
+}
+
+static __always_inline int ctx_load_be32(void *ctx, int xdp, __u32 off, __u32 *val)
+{
+    if (ctx_load_bytes(ctx, xdp, off, val, sizeof(*val)) < 0)
         return -1;
-    
-    if ((char *)data + sizeof(struct rpc_header) > (char *)data_end)
+    *val = bpf_ntohl(*val);
+    return 0;
+}
+
+static __always_inline int load_be32(struct __sk_buff *skb, __u32 off, __u32 *val)
+{
+    return ctx_load_be32(skb, 0, off, val);
+}
+
+/* Parse an RPC call starting at @off: header, credentials, verifier and
+ * the file handle plus the fixed arguments of READ and ACCESS. @ctx is
+ * an __sk_buff, so TC and sk_skb share it, or with @xdp an xdp_md. */
+static __always_inline int parse_rpc_call(void *ctx, int xdp, __u32 off, struct nfs_call *call)
+{
+    __u32 hdr[8];
+    __u32 verf_len, fh_len, name_len;
+    __u32 args;
+
+    if (ctx_load_bytes(ctx, xdp, off, hdr, sizeof(hdr)) < 0)
         return -1;
-    
-    rpc->xid = extract_be32(data, data_end, 0);
-    rpc->msg_type = extract_be32(data, data_end, 4);
-    rpc->rpc_version = extract_be32(data, data_end, 8);
-    rpc->program = extract_be32(data, data_end, 12);
-    rpc->version = extract_be32(data, data_end, 16);
-    rpc->procedure = extract_be32(data, data_end, 20);
-    rpc->auth_flavor = extract_be32(data, data_end, 24);
-    rpc->auth_len = extract_be32(data, data_end, 28);
-    
+
+    call->rpc.xid = bpf_ntohl(hdr[0]);
+    call->rpc.msg_type = bpf_ntohl(hdr[1]);
+    call->rpc.rpc_version = bpf_ntohl(hdr[2]);
+    call->rpc.program = bpf_ntohl(hdr[3]);
+    call->rpc.version = bpf_ntohl(hdr[4]);
+    call->rpc.procedure = bpf_ntohl(hdr[5]);
+    call->rpc.auth_flavor = bpf_ntohl(hdr[6]);
+    call->rpc.auth_len = bpf_ntohl(hdr[7]);
+    call->uid = 65534;
+    call->gid = 65534;
+
+    if (call->rpc.auth_len > 400)
+        return -1;
+
+    /* AUTH_UNIX body: stamp, machinename<255>, uid, gid, gids<16> */
+    if (call->rpc.auth_flavor == RPC_AUTH_UNIX) {
+        if (ctx_load_be32(ctx, xdp, off + 36, &name_len) < 0 || name_len > 255)
+            return -1;
+        if (ctx_load_be32(ctx, xdp, off + 40 + XDR_PADLEN(name_len), &call->uid) < 0 ||
+            ctx_load_be32(ctx, xdp, off + 44 + XDR_PADLEN(name_len), &call->gid) < 0)
+            return -1;
+    }
+
+    /* Verifier: flavor and length follow the credential body */
+    args = off + 32 + XDR_PADLEN(call->rpc.auth_len);
+    if (ctx_load_be32(ctx, xdp, args + 4, &verf_len) < 0 || verf_len > 400)
+        return -1;
+    args += 8 + XDR_PADLEN(verf_len);
+
+    /* NULL carries no arguments */
+    if (call->rpc.procedure == NFSPROC3_NULL)
+        return 0;
+
+    /* nfs_fh3: length-prefixed opaque, zero-padded to the map key size */
+    __builtin_memset(&call->fh, 0, sizeof(call->fh));
+    if (ctx_load_be32(ctx, xdp, args, &fh_len) < 0)
+        return -1;
+    if (fh_len == 0 || fh_len > sizeof(call->fh.data))
+        return -1;
+    if (ctx_load_bytes(ctx, xdp, args + 4, call->fh.data, fh_len) < 0)
+        return -1;
+    call->fh.len = fh_len;
+    args += 4 + XDR_PADLEN(fh_len);
+
+    if (call->rpc.procedure == NFSPROC3_READ) {
+        __u32 hi, lo;
+
+        if (ctx_load_be32(ctx, xdp, args, &hi) < 0 ||
+            ctx_load_be32(ctx, xdp, args + 4, &lo) < 0 ||
+            ctx_load_be32(ctx, xdp, args + 8, &call->count) < 0)
+            return -1;
+        call->offset = ((__u64)hi << 32) | lo;
+    } else if (call->rpc.procedure == NFSPROC3_ACCESS) {
+        if (ctx_load_be32(ctx, xdp, args, &call->access) < 0)
+            return -1;
+    }
+
     return 0;
 }
 
+static __always_inline int parse_nfs_call(struct __sk_buff *skb, __u32 off,
+                                          struct nfs_call *call)
+{
+    return parse_rpc_call(skb, 0, off, call);
+}
+
 /* Helper function to check if file exists in cache */
 static inline struct nfs_file_cache_entry *
 lookup_file_cache(const char *filename)
@@ -120,324 +401,1285 @@ static inline void generate_file_handle(const char *filename, struct nfs_fh *fh)
     *(__u32 *)&fh->data[4] = hash ^ 0xdeadbeef;
 }
 
-/* Update statistics */
-static inline void update_nfs_stats(__u32 stat_type, __u64 value)
+static __always_inline struct nfs_stats *nfs_stats_get(void)
+{
+    __u32 cpu = bpf_get_smp_processor_id();
+
+    return bpf_map_lookup_elem(&nfs_stats, &cpu);
+}
+
+/* Account a call's outcome; each CPU has its own slot so no atomics
+ * needed */
+static __always_inline void nfs_stats_count(__u32 proc, __u32 outcome)
+{
+    struct nfs_stats *stats = nfs_stats_get();
+
+    if (stats && proc < NFS3_NPROCS && outcome < NFS_NOUTCOMES)
+        stats->calls[proc][outcome]++;
+}
+
+/* Ring buffer full: the call goes to user space without its events */
+static __always_inline void nfs_stats_event_drop(void)
 {
-    __u64 *counter = bpf_map_lookup_elem(&nfs_stats, &stat_type);
-    if (counter) {
-        __sync_fetch_and_add(counter, value);
+    struct nfs_stats *stats = nfs_stats_get();
+
+    if (stats)
+        stats->event_drops++;
+}
+
+/* Send a sampled call's event to this CPU's ring. The reader is only
+ * woken once the ring has filled up a bit; until then it picks events
+ * up on its own periodic drain. */
+static __always_inline void nfs_event_call(const struct nfs_call *call,
+                                           const struct nfs_addr *client_addr,
+                                           __u16 client_port, __u32 outcome, __u32 file_size)
+{
+    __u32 cpu = bpf_get_smp_processor_id();
+    __u32 rate = nfs_config.event_sample_rate;
+    struct nfs_event *ev;
+    void *rb;
+
+    if (!rate || !nfs_config.events_enabled ||
+        (rate > 1 && bpf_get_prandom_u32() % rate))
+        return;
+
+    rb = bpf_map_lookup_elem(&nfs_events, &cpu);
+    if (!rb)
+        return;
+    ev = bpf_ringbuf_reserve(rb, sizeof(*ev), 0);
+    if (!ev) {
+        nfs_stats_event_drop();
+        return;
     }
+
+    ev->type = NFS_EV_CALL;
+    ev->outcome = outcome;
+    ev->procedure = call->rpc.procedure;
+    ev->client_port = client_port;
+    ev->client_addr = *client_addr;
+    ev->xid = call->rpc.xid;
+    ev->offset = call->offset;
+    ev->count = call->count;
+    ev->file_size = file_size;
+    ev->timestamp = bpf_ktime_get_ns();
+    bpf_ringbuf_submit(ev, bpf_ringbuf_query(rb, BPF_RB_AVAIL_DATA) >= NFS_EVENT_WAKEUP_BYTES ?
+                           BPF_RB_FORCE_WAKEUP : BPF_RB_NO_WAKEUP);
+}
+
+static __always_inline __u32 log2_u64(__u64 v)
+{
+    __u32 r = 0, shift;
+
+    shift = (v > 0xffffffffULL) << 5; v >>= shift; r |= shift;
+    shift = (v > 0xffff) << 4; v >>= shift; r |= shift;
+    shift = (v > 0xff) << 3; v >>= shift; r |= shift;
+    shift = (v > 0xf) << 2; v >>= shift; r |= shift;
+    shift = (v > 0x3) << 1; v >>= shift; r |= shift;
+    r |= (v >> 1);
+    return r;
+}
+
+/* Add the time spent on a call since @start to its histogram */
+static __always_inline void nfs_stats_time(__u32 proc, __u64 start)
+{
+    struct nfs_stats *stats = nfs_stats_get();
+    __u32 bucket = log2_u64(bpf_ktime_get_ns() - start);
+
+    if (bucket >= NFS_LAT_BUCKETS)
+        bucket = NFS_LAT_BUCKETS - 1;
+    if (stats && proc < NFS3_NPROCS)
+        stats->kernel_ns[proc][bucket]++;
 }
 
-/* Handle NFS GETATTR procedure in kernel */
-static inline int handle_nfs_getattr(struct nfs_request *req, 
-                                     struct nfs_event *event)
+/* Add a call's time from ingress until its reply left to @path's
+ * end-to-end histogram */
+static __always_inline void nfs_stats_e2e(__u32 path, __u32 proc, __u64 start)
+{
+    struct nfs_stats *stats = nfs_stats_get();
+    __u32 bucket = log2_u64(bpf_ktime_get_ns() - start);
+
+    if (bucket >= NFS_LAT_BUCKETS)
+        bucket = NFS_LAT_BUCKETS - 1;
+    if (stats && path < NFS_NPATHS && proc < NFS3_NPROCS)
+        stats->e2e_ns[path][proc][bucket]++;
+}
+
+/* Resolve a file handle to a valid, unexpired cache entry. On a miss
+ * @outcome says why. */
+static __always_inline struct nfs_file_cache_entry *
+lookup_cached_fh(const struct nfs_fh *fh, char **name, __u32 *outcome)
 {
     struct nfs_file_cache_entry *cache_entry;
-    char filename[MAX_FILENAME_LEN];
-    
+    char *cached_name;
+
     /* Look up filename from file handle */
-    char *cached_name = bpf_map_lookup_elem(&fh_to_name, &req->fh);
-    if (!cached_name) {
-        event->result = NFS_OP_FORWARD_TO_USER;
-        event->forwarded_to_user = 1;
+    cached_name = bpf_map_lookup_elem(&fh_to_name, fh);
+    *name = cached_name;
+    *outcome = NFS_OUT_MISS_NO_HANDLE;
+    if (!cached_name)
+        return NULL;
+
+    cache_entry = lookup_file_cache(cached_name);
+    *outcome = NFS_OUT_MISS_NOT_CACHED;
+    if (!cache_entry || !cache_entry->valid ||
+        cache_entry->attr.size > nfs_config.max_cached_file_size)
+        return NULL;
+
+    /* Check cache TTL */
+    *outcome = NFS_OUT_MISS_EXPIRED;
+    if (bpf_ktime_get_ns() - cache_entry->cache_time >
+        nfs_config.cache_ttl_seconds * 1000000000ULL)
+        return NULL;
+
+    *outcome = NFS_OUT_KERNEL_HIT;
+    return cache_entry;
+}
+
+/* Check whether a call can be answered from the cache entry alone */
+static __always_inline int can_serve_in_kernel(const struct nfs_call *call,
+                                               const struct nfs_file_cache_entry *cache_entry)
+{
+    switch (call->rpc.procedure) {
+    case NFSPROC3_GETATTR:
+    case NFSPROC3_ACCESS:
+        return 1;
+    case NFSPROC3_READ:
+        /* Check if read request is within cached data bounds */
+        if (!cache_entry->data_valid ||
+            call->offset >= NFS_KERNEL_READ_WINDOW ||
+            call->count > NFS_KERNEL_READ_WINDOW)
+            return 0;
+        if (call->offset >= cache_entry->data_size)
+            return call->offset == cache_entry->data_size;
+        return 1;
+    default:
         return 0;
     }
-    
-    /* Copy filename with bounds checking */
-    for (int i = 0; i < MAX_FILENAME_LEN - 1; i++) {
-        filename[i] = cached_name[i];
-        if (cached_name[i] == '\0')
-            break;
-    }
-    filename[MAX_FILENAME_LEN - 1] = '\0';
-    
-    /* Check cache for file attributes */
-    cache_entry = lookup_file_cache(filename);
-    if (!cache_entry || !cache_entry->valid) {
-        event->result = NFS_OP_FORWARD_TO_USER;
-        event->forwarded_to_user = 1;
-        __builtin_memcpy(event->filename, filename, MAX_FILENAME_LEN);
+}
+
+/* Build the reply header for a fast-path call into @buf. Returns the
+ * header length in bytes; READ data is appended separately by the
+ * caller and its length is returned in @data_len. */
+static __always_inline __u32 encode_fast_reply(const struct nfs_call *call,
+                                               struct nfs_file_cache_entry *cache_entry,
+                                               struct nfs_reply_buf *buf,
+                                               __u32 *data_len)
+{
+    __u32 proc = call->rpc.procedure;
+    struct xdr_buf x;
+    __u32 count;
+
+    *data_len = 0;
+    if (proc != NFSPROC3_NULL && !cache_entry)
         return 0;
-    }
-    
-    /* Check cache TTL */
-    __u64 current_time = bpf_ktime_get_ns();
-    if (current_time - cache_entry->cache_time > (cache_ttl_seconds * 1000000000ULL)) {
-        event->result = NFS_OP_FORWARD_TO_USER;
-        event->forwarded_to_user = 1;
-        __builtin_memcpy(event->filename, filename, MAX_FILENAME_LEN);
+    if (xdr_enc_reserve(&x, buf->data, sizeof(buf->data), nfs3_reply_size(proc, 0)) < 0)
+        return 0;
+
+    xdr_encode_reply_hdr(&x, call->rpc.xid, RPC_SUCCESS);
+    switch (proc) {
+    case NFSPROC3_NULL:
+        /* NULL returns void */
+        break;
+    case NFSPROC3_GETATTR:
+        xdr_encode_u32(&x, NFS3_OK);
+        xdr_encode_fattr3(&x, &cache_entry->attr);
+        break;
+    case NFSPROC3_ACCESS:
+        xdr_encode_u32(&x, NFS3_OK);
+        xdr_encode_post_op_attr(&x, &cache_entry->attr);
+        xdr_encode_u32(&x, nfs3_access_granted(call->uid, call->gid,
+                                               &cache_entry->attr, call->access));
+        break;
+    case NFSPROC3_READ:
+        count = 0;
+        if (call->offset < cache_entry->data_size) {
+            count = cache_entry->data_size - call->offset;
+            if (count > call->count)
+                count = call->count;
+        }
+        xdr_encode_u32(&x, NFS3_OK);
+        xdr_encode_post_op_attr(&x, &cache_entry->attr);
+        xdr_encode_u32(&x, count);
+        xdr_encode_bool(&x, call->offset + count >= cache_entry->data_size);
+        xdr_encode_u32(&x, count);      /* opaque data<> length */
+        *data_len = count;
+        break;
+    default:
         return 0;
     }
-    
-    /* Cache hit - attributes available in kernel */
-    cache_entry->cache_hits++;
-    event->result = NFS_OP_SUCCESS;
-    event->forwarded_to_user = 0;
-    event->from_cache = 1;
-    event->file_size = cache_entry->attr.size;
-    __builtin_memcpy(event->filename, filename, MAX_FILENAME_LEN);
-    
-    update_nfs_stats(1, 1); /* Kernel processed */
-    return 1; /* Handled in kernel */
+
+    return xdr_enc_len(&x, buf->data);
 }
 
-/* Handle NFS READ procedure in kernel */
-static inline int handle_nfs_read(struct nfs_request *req, 
-                                 struct nfs_event *event)
+/* Copy bytes [@off, @off + @len) of a cached file out of the arena into
+ * the same place in @dst, in whole words; chunks are NFS_ARENA_MIN_CHUNK
+ * aligned and sized so the rounding never leaves the file's chunk */
+static __always_inline int copy_from_arena(__u64 *dst,
+                                           const struct nfs_file_cache_entry *cache_entry,
+                                           __u32 off, __u32 len)
 {
-    struct nfs_file_cache_entry *cache_entry;
-    char filename[MAX_FILENAME_LEN];
-    
-    /* Look up filename from file handle */
-    char *cached_name = bpf_map_lookup_elem(&fh_to_name, &req->fh);
-    if (!cached_name) {
-        event->result = NFS_OP_FORWARD_TO_USER;
-        event->forwarded_to_user = 1;
-        return 0;
+    __u32 data_off = cache_entry->data_off;
+    __u32 last = (off + len + 7) / 8;
+    __u64 __arena *src;
+
+    /* A stale offset must not walk past what user space handed out */
+    if (data_off < sizeof(nfs_arena_hdr) || (data_off & 7) ||
+        data_off + off + len > nfs_arena_hdr.top)
+        return -1;
+    src = (__u64 __arena *)((__u8 __arena *)&nfs_arena_hdr + data_off);
+    for (__u32 i = off / 8; i < last && i < NFS_READ_SCRATCH_WORDS; i++)
+        dst[i] = src[i];
+    return 0;
+}
+
+/* Add @len bytes at @p, which has room for @max, to the running
+ * checksum @sum; bpf_csum_diff() takes whole words only, so a ragged
+ * end is summed as if zero padded. Returns the new sum, or a negative
+ * error. */
+static __always_inline __s64 csum_add_bytes(const __u8 *p, __u32 len, const __u32 max,
+                                            __s64 sum)
+{
+    const __u32 chunk = max < NFS_CSUM_CHUNK ? max : NFS_CSUM_CHUNK;
+    __u32 words = len & ~3U, off = 0, n;
+    __u8 tail[4] = {};
+
+    if (len > max)
+        return -1;
+    for (int i = 0; i < (max + chunk - 1) / chunk; i++) {
+        if (off >= words)
+            break;
+        n = words - off;
+        if (n > chunk)
+            n = chunk;
+        sum = bpf_csum_diff(NULL, 0, (__be32 *)(p + off), n, sum);
+        if (sum < 0)
+            return sum;
+        off += n;
     }
-    
-    /* Copy filename */
-    for (int i = 0; i < MAX_FILENAME_LEN - 1; i++) {
-        filename[i] = cached_name[i];
-        if (cached_name[i] == '\0')
+    if (!(len & 3))
+        return sum;
+
+    for (int i = 0; i < 3; i++) {
+        __u32 j = words + i;
+
+        if (j >= len || j >= max)
             break;
+        tail[i] = p[j];
     }
-    filename[MAX_FILENAME_LEN - 1] = '\0';
-    
-    /* Check if file is cached and small enough for kernel processing */
-    cache_entry = lookup_file_cache(filename);
-    if (!cache_entry || !cache_entry->valid || !cache_entry->data_valid) {
-        event->result = NFS_OP_FORWARD_TO_USER;
-        event->forwarded_to_user = 1;
-        __builtin_memcpy(event->filename, filename, MAX_FILENAME_LEN);
+    return bpf_csum_diff(NULL, 0, (__be32 *)tail, sizeof(tail), sum);
+}
+
+/* Sum of the IPv6 pseudo-header and the UDP header of the reply to
+ * @pkt, @udp_len bytes long, to be completed with the payload */
+static __always_inline __s64 udp6_reply_csum_start(const struct nfs_pkt *pkt, __u32 udp_len)
+{
+    struct {
+        struct nfs_addr saddr;
+        struct nfs_addr daddr;
+        __be32 len;
+        __be32 nexthdr;
+        struct udphdr udp;
+    } hdr = {
+        .saddr = pkt->daddr,
+        .daddr = pkt->saddr,
+        .len = bpf_htonl(udp_len),
+        .nexthdr = bpf_htonl(IPPROTO_UDP),
+        .udp = {
+            .source = pkt->dport,
+            .dest = pkt->sport,
+            .len = bpf_htons(udp_len),
+        },
+    };
+
+    return bpf_csum_diff(NULL, 0, (__be32 *)&hdr, sizeof(hdr), 0);
+}
+
+/* Fold a running checksum into the UDP check field; a computed zero is
+ * sent as all ones, zero meaning none */
+static __always_inline __u16 udp_csum_fold(__u64 sum)
+{
+    for (int i = 0; i < 4; i++)
+        sum = (sum & 0xffff) + (sum >> 16);
+    sum = ~sum & 0xffff;
+    return sum ? sum : 0xffff;
+}
+
+/* Write an encoded reply plus any READ data into @skb at @off. The skb
+ * must already have been resized to hold it. With @csum, the bytes
+ * written are added to it. */
+static __always_inline int store_fast_reply(struct __sk_buff *skb, __u32 off,
+                                            const struct nfs_reply_buf *buf, __u32 hdr_len,
+                                            const struct nfs_call *call,
+                                            const struct nfs_file_cache_entry *cache_entry,
+                                            __u32 data_len, __s64 *csum)
+{
+    __u32 zero = 0;
+    __u32 data_off;
+    __u64 *window;
+
+    if (hdr_len > sizeof(buf->data))
+        return -1;
+    if (bpf_skb_store_bytes(skb, off, buf->data, hdr_len, 0) < 0)
+        return -1;
+    if (csum && (*csum = csum_add_bytes(buf->data, hdr_len, sizeof(buf->data), *csum)) < 0)
+        return -1;
+    if (!data_len || !cache_entry)
         return 0;
+
+    /* Both bounded by NFS_KERNEL_READ_WINDOW, so the copy stays inside
+     * the scratch window */
+    data_off = call->offset & (NFS_KERNEL_READ_WINDOW - 1);
+    data_len &= (NFS_KERNEL_READ_WINDOW * 2 - 1);
+    if (data_len > NFS_KERNEL_READ_WINDOW)
+        return -1;
+    window = bpf_map_lookup_elem(&nfs_read_scratch, &zero);
+    if (!window || copy_from_arena(window, cache_entry, data_off, data_len) < 0)
+        return -1;
+    if (bpf_skb_store_bytes(skb, off + hdr_len, (__u8 *)window + data_off, data_len, 0) < 0)
+        return -1;
+    if (csum && (*csum = csum_add_bytes((__u8 *)window + data_off, data_len,
+                                        NFS_KERNEL_READ_WINDOW, *csum)) < 0)
+        return -1;
+    if (data_len & 3)
+        return bpf_skb_store_bytes(skb, off + hdr_len + data_len, &zero, 4 - (data_len & 3), 0);
+    return 0;
+}
+
+/* Compute the checksum of an option-less IPv4 header whose check field
+ * is zero */
+static __always_inline __u16 ipv4_csum(const void *iph)
+{
+    const __u16 *p = iph;
+    __u32 sum = 0;
+
+    for (int i = 0; i < sizeof(struct iphdr) / 2; i++)
+        sum += p[i];
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return ~sum;
+}
+
+/* Turn an NFS/UDP request into the headers of a reply to its sender
+ * with room for @payload_len bytes after the UDP header, which the
+ * caller fills. IPv4 options and IPv6 extension headers are not sent
+ * back: they are cut out first and @pkt's l4_off moves up. Returns 0 on
+ * success, -1 if the packet was left untouched, or TC_ACT_SHOT if it
+ * was modified and must be dropped. */
+static __always_inline int tc_reflect_udp(struct __sk_buff *skb, struct nfs_pkt *pkt,
+                                          __u32 payload_len)
+{
+    union {
+        struct iphdr ip;
+        struct ipv6hdr ip6;
+    } l3;
+    struct ethhdr eth;
+    struct udphdr udp;
+    struct nfs_addr addr;
+    unsigned char mac[ETH_ALEN];
+    __u32 l3_off = pkt->l3_off, l3_len, l4_off, extra, mtu_len = 0;
+    __be16 port;
+
+    if (l3_off > NFS_PKT_MAX_L2)
+        return -1;
+    l3_len = nfs_pkt_l3_base(pkt);
+    l4_off = l3_off + l3_len;
+    if (pkt->l4_off < l4_off)
+        return -1;
+    extra = pkt->l4_off - l4_off;
+
+    if (bpf_check_mtu(skb, 0, &mtu_len,
+                      (__s32)(l4_off + sizeof(udp) + payload_len) - (__s32)skb->len, 0))
+        return -1;
+    if (bpf_skb_load_bytes(skb, 0, &eth, sizeof(eth)) < 0 ||
+        bpf_skb_load_bytes(skb, pkt->l4_off, &udp, sizeof(udp)) < 0)
+        return -1;
+    if (pkt->ipv6 ? bpf_skb_load_bytes(skb, l3_off, &l3.ip6, sizeof(l3.ip6)) :
+                    bpf_skb_load_bytes(skb, l3_off, &l3.ip, sizeof(l3.ip)))
+        return -1;
+    /* Cuts right behind the fixed IP header; refused (-ENOTSUPP) for a
+     * tag still in the packet, and then user space answers */
+    if (extra && bpf_skb_adjust_room(skb, -(__s32)extra, BPF_ADJ_ROOM_NET, 0) < 0)
+        return -1;
+
+    __builtin_memcpy(mac, eth.h_source, ETH_ALEN);
+    __builtin_memcpy(eth.h_source, eth.h_dest, ETH_ALEN);
+    __builtin_memcpy(eth.h_dest, mac, ETH_ALEN);
+
+    if (pkt->ipv6) {
+        addr = *(struct nfs_addr *)&l3.ip6.saddr;
+        *(struct nfs_addr *)&l3.ip6.saddr = *(struct nfs_addr *)&l3.ip6.daddr;
+        *(struct nfs_addr *)&l3.ip6.daddr = addr;
+        l3.ip6.payload_len = bpf_htons(sizeof(udp) + payload_len);
+        l3.ip6.nexthdr = IPPROTO_UDP;
+        l3.ip6.hop_limit = 64;
+    } else {
+        addr.a32[0] = l3.ip.saddr;
+        l3.ip.saddr = l3.ip.daddr;
+        l3.ip.daddr = addr.a32[0];
+        l3.ip.ihl = 5;
+        l3.ip.tot_len = bpf_htons(sizeof(l3.ip) + sizeof(udp) + payload_len);
+        l3.ip.frag_off = 0;
+        l3.ip.ttl = 64;
+        l3.ip.check = 0;
+        l3.ip.check = ipv4_csum(&l3.ip);
+    }
+
+    port = udp.source;
+    udp.source = udp.dest;
+    udp.dest = port;
+    udp.len = bpf_htons(sizeof(udp) + payload_len);
+    udp.check = 0;                      /* Optional over IPv4; filled in later over IPv6 */
+
+    if (bpf_skb_change_tail(skb, l4_off + sizeof(udp) + payload_len, 0) < 0)
+        return TC_ACT_SHOT;
+    if (bpf_skb_store_bytes(skb, 0, &eth, sizeof(eth), 0) < 0 ||
+        bpf_skb_store_bytes(skb, l4_off, &udp, sizeof(udp), 0) < 0)
+        return TC_ACT_SHOT;
+    if (pkt->ipv6 ? bpf_skb_store_bytes(skb, l3_off, &l3.ip6, sizeof(l3.ip6), 0) :
+                    bpf_skb_store_bytes(skb, l3_off, &l3.ip, sizeof(l3.ip), 0))
+        return TC_ACT_SHOT;
+    pkt->l4_off = l4_off;
+    return 0;
+}
+
+/* Fill in the UDP checksum of a reflected IPv6 reply from the running
+ * sum of its headers and payload */
+static __always_inline int tc_store_udp6_csum(struct __sk_buff *skb, const struct nfs_pkt *pkt,
+                                              __s64 sum)
+{
+    __u16 check;
+
+    if (sum < 0)
+        return -1;
+    check = udp_csum_fold(sum);
+    return bpf_skb_store_bytes(skb, pkt->l4_off + __builtin_offsetof(struct udphdr, check),
+                               &check, sizeof(check), 0);
+}
+
+/* Turn an NFS/UDP request into the reply for it and send it back out
+ * of the interface it arrived on. Returns the TC verdict, or -1 if the
+ * packet was left untouched and should go to user space instead. */
+static __always_inline int tc_send_fast_reply(struct __sk_buff *skb, struct nfs_pkt *pkt,
+                                              const struct nfs_call *call,
+                                              struct nfs_file_cache_entry *cache_entry)
+{
+    struct nfs_reply_buf *buf;
+    __u32 key = 0, hdr_len, data_len, payload_len;
+    __s64 csum;
+    int ret;
+
+    buf = bpf_map_lookup_elem(&nfs_reply_scratch, &key);
+    if (!buf)
+        return -1;
+
+    hdr_len = encode_fast_reply(call, cache_entry, buf, &data_len);
+    if (!hdr_len)
+        return -1;
+    payload_len = hdr_len + XDR_PADLEN(data_len);
+
+    ret = tc_reflect_udp(skb, pkt, payload_len);
+    if (ret)
+        return ret;
+    csum = pkt->ipv6 ? udp6_reply_csum_start(pkt, sizeof(struct udphdr) + payload_len) : 0;
+    ret = store_fast_reply(skb, pkt->l4_off + sizeof(struct udphdr), buf, hdr_len,
+                           call, cache_entry, data_len, pkt->ipv6 ? &csum : NULL);
+    if (!ret && pkt->ipv6)
+        ret = tc_store_udp6_csum(skb, pkt, csum);
+    if (ret < 0)
+        return TC_ACT_SHOT;
+
+    return bpf_redirect(skb->ifindex, 0);
+}
+
+/* Send a reply stored in the duplicate request cache. Same return
+ * convention as tc_send_fast_reply(). */
+static __always_inline int tc_send_drc_reply(struct __sk_buff *skb, struct nfs_pkt *pkt,
+                                             const struct nfs_drc_entry *drc)
+{
+    __u32 len = drc->reply_len;
+    __s64 csum;
+    int ret;
+
+    if (len == 0 || len > NFS_DRC_MAX_REPLY)
+        return -1;
+
+    ret = tc_reflect_udp(skb, pkt, len);
+    if (ret)
+        return ret;
+    if (bpf_skb_store_bytes(skb, pkt->l4_off + sizeof(struct udphdr), drc->reply, len, 0) < 0)
+        return TC_ACT_SHOT;
+    if (pkt->ipv6) {
+        csum = udp6_reply_csum_start(pkt, sizeof(struct udphdr) + len);
+        if (csum >= 0)
+            csum = csum_add_bytes(drc->reply, len, NFS_DRC_MAX_REPLY, csum);
+        if (tc_store_udp6_csum(skb, pkt, csum) < 0)
+            return TC_ACT_SHOT;
+    }
+
+    return bpf_redirect(skb->ifindex, 0);
+}
+
+/* Look a call up in the duplicate request cache. Returns a TC verdict
+ * for a retransmit -- dropped while the original is in progress,
+ * answered from the stored reply once done -- or -1 for a new call. */
+static __always_inline int drc_check(struct __sk_buff *skb, struct nfs_pkt *pkt,
+                                     const struct nfs_drc_key *key, __u32 proc)
+{
+    struct nfs_drc_entry *drc;
+    int verdict;
+
+    drc = bpf_map_lookup_elem(&nfs_drc, key);
+    if (!drc || drc->procedure != proc)
+        return -1;
+
+    if (drc->state == NFS_DRC_IN_PROGRESS) {
+        /* Past the timeout user space is assumed to have lost it */
+        if (bpf_ktime_get_ns() - drc->timestamp > NFS_DRC_IN_PROGRESS_NS)
+            return -1;
+        nfs_stats_count(proc, NFS_OUT_DRC_DROP);
+        return TC_ACT_SHOT;
+    }
+
+    verdict = tc_send_drc_reply(skb, pkt, drc);
+    if (verdict >= 0)
+        nfs_stats_count(proc, NFS_OUT_DRC_REPLAY);
+    return verdict;
+}
+
+/* Note that a call went to user space so its retransmits are dropped */
+static __always_inline void drc_mark_in_progress(const struct nfs_drc_key *key, __u32 proc)
+{
+    struct nfs_drc_entry *drc;
+    __u32 zero = 0;
+
+    drc = bpf_map_lookup_elem(&nfs_drc_scratch, &zero);
+    if (!drc)
+        return;
+    drc->state = NFS_DRC_IN_PROGRESS;
+    drc->procedure = proc;
+    drc->timestamp = bpf_ktime_get_ns();
+    drc->reply_len = 0;
+    bpf_map_update_elem(&nfs_drc, key, drc, BPF_ANY);
+}
+
+/* Call state handed from nfs_server_tc to the procedure handlers
+ * across the tail call */
+struct nfs_tc_state {
+    struct nfs_call call;
+    struct nfs_pkt pkt;
+    struct nfs_drc_key drc_key;
+    __u64 start;
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct nfs_tc_state);
+} nfs_tc_state SEC(".maps");
+
+/* Account a UDP call once its outcome is known: statistics, client
+ * counters, DRC and latency stamps for forwarded calls, and its event */
+static __always_inline void tc_finish(const struct nfs_call *call,
+                                      const struct nfs_drc_key *drc_key, __u64 start,
+                                      __u32 outcome, struct nfs_file_cache_entry *cache_entry,
+                                      int handled_in_kernel)
+{
+    struct nfs_client_state *client_state;
+
+    client_state = bpf_map_lookup_elem(&client_track, &drc_key->client_addr);
+    nfs_stats_count(call->rpc.procedure, outcome);
+    nfs_stats_time(call->rpc.procedure, start);
+    if (handled_in_kernel) {
+        if (cache_entry)
+            cache_entry->cache_hits++;
+        if (client_state)
+            client_state->kernel_processed++;
+        if (enable_xid_trace && outcome == NFS_OUT_KERNEL_HIT)
+            nfs_stats_e2e(NFS_PATH_KERNEL, call->rpc.procedure, start);
+    } else {
+        if (client_state)
+            client_state->user_forwarded++;
+        /* Idempotent calls are simply recomputed; marking them would
+         * only push finished replies out of the LRU */
+        if (nfs3_proc_needs_drc(call->rpc.procedure))
+            drc_mark_in_progress(drc_key, call->rpc.procedure);
+        if (enable_xid_trace) {
+            struct nfs_xid_stamp stamp = {
+                .start_ns = start,
+                .procedure = call->rpc.procedure,
+            };
+            
+            bpf_map_update_elem(&nfs_xid_trace, drc_key, &stamp, BPF_ANY);
+        }
     }
     
-    /* Check if read request is within cached data bounds */
-    if (req->offset >= cache_entry->data_size || 
-        req->count > MAX_NFS_DATA_SIZE ||
-        req->offset + req->count > cache_entry->data_size) {
-        event->result = NFS_OP_FORWARD_TO_USER;
-        event->forwarded_to_user = 1;
-        __builtin_memcpy(event->filename, filename, MAX_FILENAME_LEN);
-        return 0;
+    nfs_event_call(call, &drc_key->client_addr, drc_key->client_port, outcome,
+                   cache_entry ? cache_entry->attr.size : 0);
+}
+
+/* Body of a procedure handler. @proc is a constant in each program, so
+ * the verifier only sees that procedure's reply encoding. */
+static __always_inline int tc_proc_handler(struct __sk_buff *skb, const __u32 proc)
+{
+    struct nfs_file_cache_entry *cache_entry = NULL;
+    struct nfs_tc_state *state;
+    char *cached_name;
+    __u32 zero = 0, outcome = NFS_OUT_KERNEL_HIT;
+    int handled_in_kernel = 0;
+    int verdict = TC_ACT_OK;
+    
+    state = bpf_map_lookup_elem(&nfs_tc_state, &zero);
+    if (!state || state->call.rpc.procedure != proc)
+        return TC_ACT_OK;
+    
+    if (proc != NFSPROC3_NULL) {
+        cache_entry = lookup_cached_fh(&state->call.fh, &cached_name, &outcome);
+        if (cache_entry && !can_serve_in_kernel(&state->call, cache_entry))
+            outcome = NFS_OUT_MISS_RANGE;
     }
     
-    /* Can handle in kernel - data is cached */
-    cache_entry->cache_hits++;
-    event->result = NFS_OP_SUCCESS;
-    event->forwarded_to_user = 0;
-    event->from_cache = 1;
-    event->file_size = req->count;
-    __builtin_memcpy(event->filename, filename, MAX_FILENAME_LEN);
+    /* Answer from the cache; fall back to user space if the reply
+     * cannot be built for this packet */
+    if (outcome == NFS_OUT_KERNEL_HIT) {
+        verdict = tc_send_fast_reply(skb, &state->pkt, &state->call, cache_entry);
+        if (verdict < 0) {
+            outcome = NFS_OUT_MISS_REPLY;
+            verdict = TC_ACT_OK;
+        } else {
+            handled_in_kernel = 1;
+            if (verdict == TC_ACT_SHOT)
+                outcome = NFS_OUT_ERROR;
+        }
+    }
     
-    update_nfs_stats(1, 1); /* Kernel processed */
-    return 1; /* Handled in kernel */
+    tc_finish(&state->call, &state->drc_key, state->start, outcome, cache_entry,
+              handled_in_kernel);
+    return verdict;
+}
+
+/* One program per procedure the fast path answers, each verified (and
+ * replaceable in nfs_proc_progs) on its own */
+SEC("tcx/ingress")
+int nfs_proc_null(struct __sk_buff *skb)
+{
+    return tc_proc_handler(skb, NFSPROC3_NULL);
 }
 
+SEC("tcx/ingress")
+int nfs_proc_getattr(struct __sk_buff *skb)
+{
+    return tc_proc_handler(skb, NFSPROC3_GETATTR);
+}
+
+SEC("tcx/ingress")
+int nfs_proc_access(struct __sk_buff *skb)
+{
+    return tc_proc_handler(skb, NFSPROC3_ACCESS);
+}
+
+SEC("tcx/ingress")
+int nfs_proc_read(struct __sk_buff *skb)
+{
+    return tc_proc_handler(skb, NFSPROC3_READ);
+}
+
+/* Procedure handlers by procedure number, filled by libbpf at load; an
+ * empty slot sends that procedure to user space */
+struct {
+    __uint(type, BPF_MAP_TYPE_PROG_ARRAY);
+    __uint(max_entries, NFS3_NPROCS);
+    __type(key, __u32);
+    __array(values, int (struct __sk_buff *));
+} nfs_proc_progs SEC(".maps") = {
+    .values = {
+        [NFSPROC3_NULL] = (void *)&nfs_proc_null,
+        [NFSPROC3_GETATTR] = (void *)&nfs_proc_getattr,
+        [NFSPROC3_ACCESS] = (void *)&nfs_proc_access,
+        [NFSPROC3_READ] = (void *)&nfs_proc_read,
+    },
+};
+
 /* Main TC handler for NFS packets */
-SEC("tc")
+SEC("tcx/ingress")
 int nfs_server_tc(struct __sk_buff *skb)
 {
     void *data = (void *)(long)skb->data;
     void *data_end = (void *)(long)skb->data_end;
-    struct ethhdr *eth;
-    struct iphdr *ip;
-    struct udphdr *udp;
-    void *nfs_payload;
-    __u16 payload_len;
-    struct rpc_header rpc;
-    struct nfs_request *req_event;
-    struct nfs_event *nfs_event;
-    __u32 client_ip;
-    __u16 client_port;
+    struct nfs_pkt pkt;
+    struct nfs_call call;
+    struct nfs_drc_key drc_key = {};
     struct nfs_client_state *client_state;
-    int handled_in_kernel = 0;
-    
-    /* Basic packet validation */
-    eth = data;
-    if ((void *)(eth + 1) > data_end)
-        return TC_ACT_OK;
-    
-    if (eth->h_proto != bpf_htons(ETH_P_IP))
-        return TC_ACT_OK;
-    
-    ip = (void *)(eth + 1);
-    if ((void *)(ip + 1) > data_end)
-        return TC_ACT_OK;
-    
-    if (ip->protocol != IPPROTO_UDP)
-        return TC_ACT_OK;
-    
-    udp = (void *)ip + (ip->ihl * 4);
-    if ((void *)(udp + 1) > data_end)
-        return TC_ACT_OK;
+    __u32 zero = 0;
+    __u64 start;
+    int verdict;
     
-    /* Check if this is NFS traffic (port 2049) */
-    if (udp->dest != bpf_htons(NFS_PORT))
+    /* Ethernet, VLAN tags, IPv4 or IPv6 down to UDP; whole NFS calls
+     * only, fragmented ones are reassembled by the stack. A GRO train
+     * of calls (-G, UDP_GRO on the server socket) goes to user space as a
+     * whole; answering its first call here would drop the rest. */
+    if (skb->gso_segs > 1 || nfs_parse_udp(data, data_end, &pkt) < 0 || pkt.first_frag ||
+        pkt.dport != bpf_htons(NFS_PORT))
         return TC_ACT_OK;
+    start = bpf_ktime_get_ns();
     
-    /* Extract NFS payload */
-    nfs_payload = (void *)udp + sizeof(struct udphdr);
-    if (nfs_payload >= data_end)
-        return TC_ACT_OK;
-    
-    payload_len = data_end - nfs_payload;
-    if (payload_len < sizeof(struct rpc_header))
-        return TC_ACT_OK;
-    
-    /* Parse RPC header */
-    if (parse_rpc_header(nfs_payload, data_end, payload_len, &rpc) < 0)
+    /* Parse RPC call and NFS arguments */
+    if (parse_nfs_call(skb, pkt.l4_off + sizeof(struct udphdr), &call) < 0)
         return TC_ACT_OK;
     
     /* Validate this is an NFS call */
-    if (rpc.msg_type != RPC_CALL || 
-        rpc.rpc_version != 2 ||
-        rpc.program != RPC_PROGRAM_NFS ||
-        rpc.version != NFS_VERSION_3)
+    if (call.rpc.msg_type != RPC_CALL || 
+        call.rpc.rpc_version != 2 ||
+        call.rpc.program != RPC_PROGRAM_NFS ||
+        call.rpc.version != NFS_VERSION_3)
         return TC_ACT_OK;
     
-    client_ip = ip->saddr;
-    client_port = udp->source;
+    /* Retransmits are settled here, before they count as new requests */
+    drc_key.client_addr = pkt.saddr;
+    drc_key.client_port = pkt.sport;
+    drc_key.xid = call.rpc.xid;
+    verdict = drc_check(skb, &pkt, &drc_key, call.rpc.procedure);
+    if (verdict >= 0)
+        return verdict;
     
-    /* Update client tracking */
-    client_state = bpf_map_lookup_elem(&client_track, &client_ip);
+    /* Update client tracking; the value is this CPU's copy */
+    client_state = bpf_map_lookup_elem(&client_track, &pkt.saddr);
     if (!client_state) {
-        struct nfs_client_state new_state = {
-            .client_addr = client_ip,
-            .last_request_time = bpf_ktime_get_ns(),
-            .request_count = 1,
-            .kernel_processed = 0,
-            .user_forwarded = 0
-        };
-        bpf_map_update_elem(&client_track, &client_ip, &new_state, BPF_ANY);
-        client_state = &new_state;
-    } else {
+        struct nfs_client_state new_state = { .client_addr = pkt.saddr };
+        
+        bpf_map_update_elem(&client_track, &pkt.saddr, &new_state, BPF_NOEXIST);
+        client_state = bpf_map_lookup_elem(&client_track, &pkt.saddr);
+    }
+    if (client_state) {
         client_state->last_request_time = bpf_ktime_get_ns();
         client_state->request_count++;
     }
     
-    /* Create NFS request event */
-    req_event = bpf_ringbuf_reserve(&nfs_events, sizeof(*req_event), 0);
-    if (!req_event)
-        return TC_ACT_OK;
+    /* Hand the call to its procedure's handler; the state it needs
+     * travels in per-CPU scratch. Without one, user space answers. */
+    if (kernel_proc_enabled(call.rpc.procedure)) {
+        struct nfs_tc_state *state = bpf_map_lookup_elem(&nfs_tc_state, &zero);
+        
+        if (state) {
+            state->call = call;
+            state->pkt = pkt;
+            state->drc_key = drc_key;
+            state->start = start;
+            bpf_tail_call(skb, &nfs_proc_progs, call.rpc.procedure);
+        }
+    }
     
-    req_event->client_addr = client_ip;
-    req_event->client_port = client_port;
-    req_event->xid = rpc.xid;
-    req_event->procedure = rpc.procedure;
-    req_event->processed_in_kernel = 0;
-    req_event->filename[0] = '\0';
-    req_event->offset = 0;
-    req_event->count = 0;
-    __builtin_memset(&req_event->fh, 0, sizeof(req_event->fh));
+    tc_finish(&call, &drc_key, start, NFS_OUT_FORWARDED, NULL, 0);
+    return TC_ACT_OK;
+}
+
+/* TC egress, attached only when tracing latency: match replies from
+ * user space to the calls stamped on ingress */
+SEC("tcx/egress")
+int nfs_server_tc_egress(struct __sk_buff *skb)
+{
+    void *data = (void *)(long)skb->data;
+    void *data_end = (void *)(long)skb->data_end;
+    struct nfs_drc_key key = {};
+    struct nfs_xid_stamp *stamp;
+    struct nfs_pkt pkt;
+    __u32 payload_off, msg_type, segs = 1;
     
-    /* Create NFS operation event */
-    nfs_event = bpf_ringbuf_reserve(&nfs_events, sizeof(*nfs_event), 0);
-    if (!nfs_event) {
-        bpf_ringbuf_discard(req_event, 0);
+    /* A large READ reply leaves in fragments; the first has the xid */
+    if (nfs_parse_udp(data, data_end, &pkt) < 0 || pkt.sport != bpf_htons(NFS_PORT))
         return TC_ACT_OK;
-    }
     
-    nfs_event->client_addr = client_ip;
-    nfs_event->client_port = client_port;
-    nfs_event->xid = rpc.xid;
-    nfs_event->procedure = rpc.procedure;
-    nfs_event->result = NFS_OP_FORWARD_TO_USER;
-    nfs_event->filename[0] = '\0';
-    nfs_event->file_size = 0;
-    nfs_event->timestamp = bpf_ktime_get_ns();
-    nfs_event->forwarded_to_user = 1;
-    nfs_event->from_cache = 0;
+    /* A UDP_SEGMENT send is still whole here, one reply per gso_size
+     * bytes of payload */
+    if (skb->gso_segs > 1 && skb->gso_size)
+        segs = skb->gso_segs;
     
-    /* Handle specific NFS procedures in kernel if enabled */
-    if (enable_kernel_processing) {
-        switch (rpc.procedure) {
-            case NFSPROC3_NULL:
-                /* NULL operation can be handled immediately */
-                nfs_event->result = NFS_OP_SUCCESS;
-                nfs_event->forwarded_to_user = 0;
-                nfs_event->from_cache = 0;
-                handled_in_kernel = 1;
-                update_nfs_stats(1, 1); /* Kernel processed */
-                break;
-            case NFSPROC3_GETATTR:
-                handled_in_kernel = handle_nfs_getattr(req_event, nfs_event);
-                break;
-            case NFSPROC3_READ:
-                handled_in_kernel = handle_nfs_read(req_event, nfs_event);
-                break;
-            default:
-                /* Forward complex operations to user space */
-                nfs_event->result = NFS_OP_FORWARD_TO_USER;
-                nfs_event->forwarded_to_user = 1;
-                break;
+    key.client_addr = pkt.daddr;
+    key.client_port = pkt.dport;
+    payload_off = pkt.l4_off + sizeof(struct udphdr);
+    for (__u32 i = 0; i < NFS_GSO_MAX_SEGS && i < segs; i++) {
+        if (load_be32(skb, payload_off, &key.xid) < 0 ||
+            load_be32(skb, payload_off + 4, &msg_type) < 0 || msg_type != RPC_REPLY)
+            break;
+        payload_off += skb->gso_size;
+        
+        stamp = bpf_map_lookup_elem(&nfs_xid_trace, &key);
+        if (!stamp)
+            continue;
+        nfs_stats_e2e(NFS_PATH_USER, stamp->procedure, stamp->start_ns);
+        bpf_map_delete_elem(&nfs_xid_trace, &key);
+    }
+    return TC_ACT_OK;
+}
+
+/* Stream parser for NFS over TCP: one RPC record fragment per message.
+ * A fragment user space would refuse aborts the stream here rather than
+ * being buffered first. */
+SEC("sk_skb/stream_parser")
+int nfs_stream_parser(struct __sk_buff *skb)
+{
+    __u32 mark, frag_len;
+
+    if (load_be32(skb, 0, &mark) < 0)
+        return 0;   /* Need more data */
+
+    frag_len = mark & RPC_FRAG_LEN_MASK;
+    if (frag_len > NFS_MAX_RECORD_SIZE)
+        return -EMSGSIZE;
+    return frag_len + 4;
+}
+
+/* Hand a record fragment to user space, which now owes its reply */
+static __always_inline int tcp_pass(struct nfs_tcp_order *order)
+{
+    if (order)
+        order->to_user++;
+    return SK_PASS;
+}
+
+/* Stream verdict for NFS over TCP: answer cached GETATTR/READ/ACCESS
+ * and NULL on the same socket, pass everything else to user space.
+ * Calls behind one user space still has to answer go there too, so
+ * replies leave in the order of the calls (see struct nfs_tcp_order). */
+SEC("sk_skb/stream_verdict")
+int nfs_stream_verdict(struct __sk_buff *skb)
+{
+    struct nfs_sock_key sock_key = {};
+    struct nfs_file_cache_entry *cache_entry = NULL;
+    struct nfs_tcp_order *order = NULL;
+    struct nfs_reply_buf *buf;
+    struct nfs_call call;
+    char *cached_name;
+    __u32 key = 0, mark, hdr_len, data_len, *slot;
+    __u32 outcome = NFS_OUT_FORWARDED;
+    __u64 start, cookie;
+    int verdict;
+
+    start = bpf_ktime_get_ns();
+
+    /* Strparser runs one socket's records one at a time, so the verdict
+     * is the only writer of to_user and kernel_bytes */
+    cookie = bpf_get_socket_cookie(skb);
+    slot = bpf_map_lookup_elem(&nfs_tcp_slots, &cookie);
+    if (slot)
+        order = bpf_map_lookup_elem(&nfs_tcp_order, slot);
+
+    /* Only single-fragment records; multi-fragment ones are reassembled
+     * by user space */
+    if (load_be32(skb, 0, &mark) < 0 || !(mark & RPC_LAST_FRAG))
+        return tcp_pass(order);
+
+    if (parse_nfs_call(skb, 4, &call) < 0)
+        return tcp_pass(order);
+
+    if (call.rpc.msg_type != RPC_CALL ||
+        call.rpc.rpc_version != 2 ||
+        call.rpc.program != RPC_PROGRAM_NFS ||
+        call.rpc.version != NFS_VERSION_3)
+        return tcp_pass(order);
+
+    if (!order || *(volatile __u32 *)&order->user_done != order->to_user ||
+        !kernel_proc_enabled(call.rpc.procedure))
+        goto forward;
+    if (call.rpc.procedure != NFSPROC3_NULL) {
+        if (call.rpc.procedure != NFSPROC3_GETATTR &&
+            call.rpc.procedure != NFSPROC3_ACCESS &&
+            call.rpc.procedure != NFSPROC3_READ)
+            goto forward;
+        cache_entry = lookup_cached_fh(&call.fh, &cached_name, &outcome);
+        if (!cache_entry)
+            goto forward;
+        if (!can_serve_in_kernel(&call, cache_entry)) {
+            outcome = NFS_OUT_MISS_RANGE;
+            goto forward;
         }
     }
-    
-    /* Update statistics */
-    update_nfs_stats(0, 1); /* Total requests */
-    if (handled_in_kernel) {
-        req_event->processed_in_kernel = 1;
-        client_state->kernel_processed++;
+
+    outcome = NFS_OUT_MISS_REPLY;
+    buf = bpf_map_lookup_elem(&nfs_reply_scratch, &key);
+    if (!buf)
+        goto forward;
+    hdr_len = encode_fast_reply(&call, cache_entry, buf, &data_len);
+    if (!hdr_len)
+        goto forward;
+    buf->mark = bpf_htonl(RPC_LAST_FRAG | (hdr_len + XDR_PADLEN(data_len)));
+
+    /* From here on the request is consumed; a failure drops it and the
+     * client retransmits */
+    if (bpf_skb_change_tail(skb, 4 + hdr_len + XDR_PADLEN(data_len), 0) < 0 ||
+        bpf_skb_store_bytes(skb, 0, &buf->mark, 4, 0) < 0 ||
+        store_fast_reply(skb, 4, buf, hdr_len, &call, cache_entry, data_len, NULL) < 0) {
+        nfs_stats_count(call.rpc.procedure, NFS_OUT_ERROR);
+        nfs_stats_time(call.rpc.procedure, start);
+        return SK_DROP;
+    }
+
+    if (cache_entry)
+        cache_entry->cache_hits++;
+    nfs_stats_count(call.rpc.procedure, NFS_OUT_KERNEL_HIT);
+    nfs_stats_time(call.rpc.procedure, start);
+
+    if (skb->family == AF_INET) {
+        nfs_addr_from_v4(&sock_key.remote_addr, skb->remote_ip4);
     } else {
-        client_state->user_forwarded++;
-        update_nfs_stats(2, 1); /* Forwarded to user space */
+        sock_key.remote_addr.a32[0] = skb->remote_ip6[0];
+        sock_key.remote_addr.a32[1] = skb->remote_ip6[1];
+        sock_key.remote_addr.a32[2] = skb->remote_ip6[2];
+        sock_key.remote_addr.a32[3] = skb->remote_ip6[3];
     }
-    
-    /* Submit events */
-    bpf_ringbuf_submit(req_event, 0);
-    bpf_ringbuf_submit(nfs_event, 0);
-    
-    return TC_ACT_OK;
+    sock_key.remote_port = bpf_ntohl(skb->remote_port);
+    sock_key.local_port = skb->local_port;
+    verdict = bpf_sk_redirect_hash(skb, &nfs_sock_hash, &sock_key, 0);
+    if (verdict == SK_PASS)
+        order->kernel_bytes += 4 + hdr_len + XDR_PADLEN(data_len);
+    return verdict;
+
+forward:
+    nfs_stats_count(call.rpc.procedure, outcome);
+    nfs_stats_time(call.rpc.procedure, start);
+    return tcp_pass(order);
 }
 
 /* Tracepoint for VFS operations to track file access */
 SEC("tp/syscalls/sys_enter_openat")
 int trace_openat(struct trace_event_raw_sys_enter *ctx)
 {
-    if (!enable_kernel_processing)
-        return 0;
-    
+    struct nfs_stats *stats;
+
     /* This could be used to track file opens and pre-cache frequently accessed files */
-    update_nfs_stats(3, 1); /* File system operations */
+    stats = nfs_stats_get();
+    if (stats)
+        stats->fs_events++;
     return 0;
 }
 
-/* XDP program for early packet filtering */
-SEC("xdp")
-int nfs_server_xdp(struct xdp_md *ctx)
+static __always_inline __u64 token_bucket_cap(const struct nfs_qos_limit *limit)
 {
-    void *data = (void *)(long)ctx->data;
-    void *data_end = (void *)(long)ctx->data_end;
+    return (__u64)(limit->burst ? limit->burst : limit->rate) * NFS_QOS_TOKEN;
+}
+
+/* Refill @bucket for the time since it was last used and take one
+ * request's worth from it. Returns 0 when it is empty. Updates from
+ * different CPUs may race; a lost update only skews the rate a little. */
+static __always_inline int token_bucket_take(struct nfs_token_bucket *bucket,
+                                             const struct nfs_qos_limit *limit, __u64 now)
+{
+    __u64 elapsed, tokens, cap;
+
+    if (!limit->rate)
+        return 1;
+
+    /* Capped at a second so elapsed * rate cannot overflow */
+    elapsed = now - bucket->last_ns;
+    if (elapsed > 1000000000ULL)
+        elapsed = 1000000000ULL;
+    cap = token_bucket_cap(limit);
+    tokens = bucket->tokens + elapsed * limit->rate;
+    if (tokens > cap)
+        tokens = cap;
+    bucket->last_ns = now;
+
+    if (tokens < NFS_QOS_TOKEN) {
+        bucket->tokens = tokens;
+        return 0;
+    }
+    bucket->tokens = tokens - NFS_QOS_TOKEN;
+    return 1;
+}
+
+/* Charge a request of @class from @addr to its client and subnet
+ * buckets. Returns 1 to admit it; otherwise @action says what to do. */
+static __always_inline int qos_admit(const struct nfs_addr *addr, int class, __u32 *action)
+{
+    struct nfs_qos_key key = { .prefixlen = 128, .addr = *addr };
+    struct nfs_qos_client *client;
+    struct nfs_qos_rule *rule;
+    __u64 now;
+
+    rule = bpf_map_lookup_elem(&nfs_qos_rules, &key);
+    if (!rule)
+        return 1;
+    *action = rule->action;
+    now = bpf_ktime_get_ns();
+    class &= 1;
+
+    if (rule->client[class].rate) {
+        client = bpf_map_lookup_elem(&nfs_qos_clients, addr);
+        if (!client) {
+            /* A new client starts with full buckets */
+            struct nfs_qos_client fresh = {};
+
+            for (int i = 0; i < NFS_QOS_NCLASSES; i++) {
+                fresh.bucket[i].tokens = token_bucket_cap(&rule->client[i]);
+                fresh.bucket[i].last_ns = now;
+            }
+            bpf_map_update_elem(&nfs_qos_clients, addr, &fresh, BPF_NOEXIST);
+            client = bpf_map_lookup_elem(&nfs_qos_clients, addr);
+            if (!client)
+                return 1;
+        }
+        if (!token_bucket_take(&client->bucket[class], &rule->client[class], now))
+            return 0;
+    }
+
+    return token_bucket_take(&rule->subnet_bucket[class], &rule->subnet[class], now);
+}
+
+/* Rewrite an NFS/UDP call into an NFS3ERR_JUKEBOX reply to its sender
+ * for XDP_TX. The request's headers are reused in place, so it must be
+ * whole and carry no IPv4 options or IPv6 extension headers. Returns 0
+ * on success, -1 if the packet cannot be used. */
+static __always_inline int xdp_send_jukebox(struct xdp_md *ctx, const struct nfs_pkt *pkt,
+                                            __u32 xid, __u32 proc)
+{
+    void *data, *data_end;
     struct ethhdr *eth;
-    struct iphdr *ip;
     struct udphdr *udp;
-    
-    /* Basic validation for NFS packets */
+    struct nfs_addr addr;
+    __u32 *words;
+    __u32 nwords, payload_len, l3_off = pkt->l3_off, l4_off;
+    unsigned char mac[ETH_ALEN];
+    __s64 seed = 0;
+    __u64 sum = 0;
+    __be16 port;
+
+    if (proc >= NFS3_NPROCS || pkt->first_frag || l3_off > NFS_PKT_MAX_L2)
+        return -1;
+    l4_off = l3_off + nfs_pkt_l3_base(pkt);
+    if (pkt->l4_off != l4_off)
+        return -1;
+    nwords = XDR_RPC_REPLY_HDR_SIZE / 4 + 1 + nfs3_resfail_bools[proc];
+    payload_len = nwords * 4;
+    if (pkt->ipv6) {
+        seed = udp6_reply_csum_start(pkt, sizeof(*udp) + payload_len);
+        if (seed < 0)
+            return -1;
+    }
+
+    data = (void *)(long)ctx->data;
+    data_end = (void *)(long)ctx->data_end;
+    if (bpf_xdp_adjust_tail(ctx, (int)(l4_off + sizeof(*udp) + payload_len) -
+                                 (int)(data_end - data)))
+        return -1;
+
+    data = (void *)(long)ctx->data;
+    data_end = (void *)(long)ctx->data_end;
     eth = data;
     if ((void *)(eth + 1) > data_end)
+        return -1;
+    __builtin_memcpy(mac, eth->h_source, ETH_ALEN);
+    __builtin_memcpy(eth->h_source, eth->h_dest, ETH_ALEN);
+    __builtin_memcpy(eth->h_dest, mac, ETH_ALEN);
+
+    if (pkt->ipv6) {
+        struct ipv6hdr *ip6 = data + l3_off;
+
+        if ((void *)(ip6 + 1) > data_end)
+            return -1;
+        addr = *(struct nfs_addr *)&ip6->saddr;
+        *(struct nfs_addr *)&ip6->saddr = *(struct nfs_addr *)&ip6->daddr;
+        *(struct nfs_addr *)&ip6->daddr = addr;
+        ip6->payload_len = bpf_htons(sizeof(*udp) + payload_len);
+        ip6->hop_limit = 64;
+        udp = (void *)(ip6 + 1);
+    } else {
+        struct iphdr *ip = data + l3_off;
+
+        if ((void *)(ip + 1) > data_end)
+            return -1;
+        addr.a32[0] = ip->saddr;
+        ip->saddr = ip->daddr;
+        ip->daddr = addr.a32[0];
+        ip->tot_len = bpf_htons(sizeof(*ip) + sizeof(*udp) + payload_len);
+        ip->frag_off = 0;
+        ip->ttl = 64;
+        ip->check = 0;
+        ip->check = ipv4_csum(ip);
+        udp = (void *)(ip + 1);
+    }
+
+    words = (void *)(udp + 1);
+    if ((void *)words > data_end)
+        return -1;
+    port = udp->source;
+    udp->source = udp->dest;
+    udp->dest = port;
+    udp->len = bpf_htons(sizeof(*udp) + payload_len);
+    udp->check = 0;
+
+    /* xid, REPLY, MSG_ACCEPTED, AUTH_NULL verifier, SUCCESS, JUKEBOX and
+     * attributes_follow = FALSE for each optional attribute */
+    for (int i = 0; i < NFS_JUKEBOX_WORDS; i++) {
+        __u32 val = 0;
+
+        if (i >= nwords)
+            break;
+        if ((void *)(words + i + 1) > data_end)
+            return -1;
+        if (i == 0)
+            val = xid;
+        else if (i == 1)
+            val = bpf_htonl(RPC_REPLY);
+        else if (i == 6)
+            val = bpf_htonl(NFS3ERR_JUKEBOX);
+        words[i] = val;
+        sum += val;
+    }
+
+    /* Mandatory over IPv6; the payload was summed as it was written */
+    if (pkt->ipv6)
+        udp->check = udp_csum_fold(sum + seed);
+    return 0;
+}
+
+/* What the TC fast path will make of this call: NFS_OUT_KERNEL_HIT if
+ * it answers from the cache, otherwise why not. The same checks as
+ * tc_proc_handler(), ahead of it. */
+static __always_inline __u32 xdp_call_outcome(struct xdp_md *ctx, __u32 rpc_off, __u32 proc)
+{
+    struct nfs_file_cache_entry *cache_entry;
+    struct nfs_call call;
+    char *cached_name;
+    __u32 outcome;
+
+    if (!kernel_proc_enabled(proc) || !(NFS_KERNEL_PROCS_ALL & (1U << proc)))
+        return NFS_OUT_FORWARDED;
+    if (proc == NFSPROC3_NULL)
+        return NFS_OUT_KERNEL_HIT;
+    if (parse_rpc_call(ctx, 1, rpc_off, &call) < 0)
+        return NFS_OUT_FORWARDED;
+    cache_entry = lookup_cached_fh(&call.fh, &cached_name, &outcome);
+    if (cache_entry && !can_serve_in_kernel(&call, cache_entry))
+        outcome = NFS_OUT_MISS_RANGE;
+    return outcome;
+}
+
+/* Redirect a call to the AF_XDP socket on its RX queue, with the parse
+ * results in front of it as metadata. Without a socket on the queue or
+ * room for the metadata it goes up the stack as before. */
+static __always_inline int xdp_to_xsk(struct xdp_md *ctx, const struct nfs_pkt *pkt, __u32 proc,
+                                      __u32 outcome)
+{
+    struct nfs_xsk_meta *meta;
+    int action;
+
+    if (bpf_xdp_adjust_meta(ctx, -(int)sizeof(*meta)))
         return XDP_PASS;
-    
-    if (eth->h_proto != bpf_htons(ETH_P_IP))
+    meta = (void *)(long)ctx->data_meta;
+    if ((void *)(meta + 1) > (void *)(long)ctx->data)
         return XDP_PASS;
-    
-    ip = (void *)(eth + 1);
-    if ((void *)(ip + 1) > data_end)
+    meta->l3_off = pkt->l3_off;
+    meta->l4_off = pkt->l4_off;
+    meta->ipv6 = pkt->ipv6;
+
+    action = bpf_redirect_map(&nfs_xsks, ctx->rx_queue_index, XDP_PASS);
+    if (action == XDP_REDIRECT)
+        nfs_stats_count(proc, outcome);
+    return action;
+}
+
+/* Redirect the packet to its client's core among nfs_steer_cpus, so
+ * every call from one client is handled, in order, on one core */
+static __always_inline int xdp_steer(const struct nfs_addr *client)
+{
+    __u32 n = nfs_config.steer_cpus, hash = 0, slot, *cpu;
+
+    for (int i = 0; i < 4; i++)
+        hash = (hash ^ client->a32[i]) * 0x9e3779b1;
+    if (n > NFS_STEER_MAX_CPUS)
         return XDP_PASS;
-    
-    if (ip->protocol != IPPROTO_UDP)
+    slot = ((__u64)hash * n) >> 32;
+    cpu = bpf_map_lookup_elem(&nfs_steer_cpus, &slot);
+    if (!cpu)
+        return XDP_PASS;
+    return bpf_redirect_map(&nfs_cpumap, *cpu, XDP_PASS);
+}
+
+/* Let the packet up the stack: here, or on its steering core when
+ * this is the first stage */
+static __always_inline int xdp_pass(const struct nfs_pkt *pkt, int remote)
+{
+    if (remote || !nfs_config.steer_cpus)
         return XDP_PASS;
+    return xdp_steer(&pkt->saddr);
+}
+
+/* Early NFS packet accounting, per-client QoS and AF_XDP steering. Only
+ * the fixed RPC call header is read before the verdict. With AF_XDP,
+ * calls that pass and that the kernel will not answer leave for user
+ * space here; fragmented ones still take the stack for reassembly.
+ *
+ * With CPU steering the packet moves to its client's core, where cpumap
+ * builds the skb and TC runs the cache fast path. With @remote this runs
+ * on that core as the cpumap program, and the RX core only parses. */
+static __always_inline int nfs_xdp(struct xdp_md *ctx, int remote)
+{
+    void *data = (void *)(long)ctx->data;
+    void *data_end = (void *)(long)ctx->data_end;
+    struct nfs_stats *stats;
+    struct nfs_pkt pkt;
+    __u32 *rpc;
+    __u32 proc, l4_off, outcome, action = NFS_QOS_DROP;
     
-    udp = (void *)ip + (ip->ihl * 4);
-    if ((void *)(udp + 1) > data_end)
+    /* Ethernet, VLAN tags, IPv4 or IPv6 down to UDP. The first fragment
+     * of a large WRITE is charged too; dropping it sinks the rest. */
+    if (nfs_parse_udp(data, data_end, &pkt) < 0 || pkt.dport != bpf_htons(NFS_PORT))
         return XDP_PASS;
     
+    if (!remote && nfs_config.steer_cpus && nfs_config.steer_remote)
+        return xdp_steer(&pkt.saddr);
+    
     /* Count NFS packets */
-    if (udp->dest == bpf_htons(NFS_PORT)) {
-        update_nfs_stats(4, 1); /* NFS packets received */
+    stats = nfs_stats_get();
+    if (stats)
+        stats->xdp_packets++;
+    
+    /* xid, msg_type, rpcvers, prog, vers, proc; the parser checked the
+     * bound, but the verifier only sees it checked here */
+    l4_off = pkt.l4_off;
+    if (l4_off > NFS_PKT_MAX_L4_OFF)
+        return xdp_pass(&pkt, remote);
+    rpc = data + l4_off + sizeof(struct udphdr);
+    if ((void *)(rpc + 6) > data_end)
+        return xdp_pass(&pkt, remote);
+    if (rpc[1] != bpf_htonl(RPC_CALL) || rpc[3] != bpf_htonl(RPC_PROGRAM_NFS) ||
+        rpc[4] != bpf_htonl(NFS_VERSION_3))
+        return xdp_pass(&pkt, remote);
+    
+    /* NULL pings are never limited */
+    proc = bpf_ntohl(rpc[5]);
+    if (proc == NFSPROC3_NULL || proc >= NFS3_NPROCS)
+        return xdp_pass(&pkt, remote);
+    
+    if (qos_admit(&pkt.saddr, nfs3_proc_qos_class(proc), &action)) {
+        if (!nfs_config.xsk_enabled || pkt.first_frag)
+            return xdp_pass(&pkt, remote);
+        outcome = xdp_call_outcome(ctx, l4_off + sizeof(struct udphdr), proc);
+        if (outcome == NFS_OUT_KERNEL_HIT)
+            return xdp_pass(&pkt, remote);
+        return xdp_to_xsk(ctx, &pkt, proc, outcome);
     }
     
-    return XDP_PASS;
+    /* A cpumap program cannot XDP_TX; the reply leaves by the device
+     * it came in on instead */
+    if (action == NFS_QOS_JUKEBOX && xdp_send_jukebox(ctx, &pkt, rpc[0], proc) == 0) {
+        nfs_stats_count(proc, NFS_OUT_QOS_JUKEBOX);
+        return remote ? bpf_redirect(ctx->ingress_ifindex, 0) : XDP_TX;
+    }
+    
+    nfs_stats_count(proc, NFS_OUT_QOS_DROP);
+    return XDP_DROP;
+}
+
+SEC("xdp")
+int nfs_server_xdp(struct xdp_md *ctx)
+{
+    return nfs_xdp(ctx, 0);
+}
+
+/* Second stage of CPU steering, run by nfs_cpumap on the target core */
+SEC("xdp/cpumap")
+int nfs_server_xdp_cpu(struct xdp_md *ctx)
+{
+    return nfs_xdp(ctx, 1);
 }
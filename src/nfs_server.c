@@ -1,15 +1,24 @@
 // SPDX-License-Identifier: (LGPL-2.1 OR BSD-2-Clause)
 /* Copyright (c) 2024 NFS Server Kernel Processing */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <signal.h>
 #include <unistd.h>
 #include <errno.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/select.h>
+#include <poll.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/statvfs.h>
+#include <sys/sysmacros.h>
+#include <dirent.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
@@ -19,22 +28,56 @@
 #include <bpf/libbpf.h>
 #include <bpf/bpf.h>
 #include <linux/if_link.h>
+#include <limits.h>
+#include <stdint.h>
 #include <net/if.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <sys/ioctl.h>
+#include <linux/if_xdp.h>
+#include <linux/ethtool.h>
+#include <linux/sockios.h>
 #include "nfs_server.h"
+#include "nfs_xdr.h"
 #include "nfs_server.skel.h"
 
+/* bpffs directory holding one subdirectory of pinned maps per export */
+#define NFS_PIN_ROOT "/sys/fs/bpf/nfs_server"
+
+/* QoS rules accepted on the command line */
+#define MAX_QOS_RULES 32
+
 static struct env {
     bool verbose;
     const char *interface;
     const char *export_root;
     bool enable_kernel_cache;
     int nfs_port;
+    int stats_interval;
+    bool trace_latency;
+    int event_sample_rate;
+    bool aggregate_only;
+    int metrics_port;
+    const char *www_root;
+    bool pin_maps;
+    const char *snapshot;
+    const char *control_path;
+    bool xsk;
+    bool udp_gro;
+    int n_steer;
+    __u32 steer_cpus[NFS_STEER_MAX_CPUS];
+    int n_qos;
+    struct nfs_qos_key qos_keys[MAX_QOS_RULES];
+    struct nfs_qos_rule qos_rules[MAX_QOS_RULES];
 } env = {
     .verbose = false,
     .interface = "lo",
     .export_root = "./nfs_exports",
     .enable_kernel_cache = true,
     .nfs_port = NFS_PORT,
+    .event_sample_rate = 1,
 };
 
 const char argp_program_doc[] =
@@ -43,7 +86,27 @@ const char argp_program_doc[] =
     "This program demonstrates an NFS server that processes simple requests\n"
     "in kernel space and forwards complex operations to user space.\n"
     "\n"
-    "USAGE: ./nfs_server [-v] [-i interface] [-e export_root] [-p port]\n";
+    "USAGE: ./nfs_server [-v] [-i interface] [-e export_root] [-p port] [-s secs] [-S n] [-A] [-t] [-m port [-w dir]] [-P] [-C file] [-c socket] [-G] [-X | -R cpus] [-q rule]...\n"
+    "\n"
+    "A QoS rule is CIDR,META,DATA[,SUBNET_META,SUBNET_DATA][,drop|jukebox],\n"
+    "with an IPv4 or IPv6 CIDR.\n"
+    "Each limit is RATE[/BURST] in requests per second, 0 for unlimited.\n"
+    "META and DATA apply to every client in CIDR, the SUBNET limits to all\n"
+    "of them together. DATA covers READ, WRITE and COMMIT.\n"
+    "Example: -q 10.0.0.0/8,500/1000,200,5000,2000,jukebox\n"
+    "\n"
+    "With -P the file cache and its arena, handle table, client and statistics maps are\n"
+    "pinned under " NFS_PIN_ROOT "/<export> and reused by the next start.\n"
+    "With -C the cached set is also saved to a file every minute and at\n"
+    "exit, and loaded back (after revalidation) when the cache starts cold.\n"
+    "With -G the UDP socket takes GRO trains of calls in one receive. A\n"
+    "train bypasses the TC fast path (cache, DRC, client counters), so\n"
+    "it only pays off when most calls go to user space anyway.\n"
+    "With -X calls the kernel does not answer reach user space over AF_XDP\n"
+    "sockets, one per RX queue, zero-copy where the driver supports it.\n"
+    "With -R NFS packets are spread over the listed cores (e.g. 2-5,8) by\n"
+    "client address through a cpumap, for NICs with fewer RX queues than\n"
+    "cores; -R and -X do not combine.\n";
 
 static const struct argp_option opts[] = {
     { "verbose", 'v', NULL, 0, "Verbose debug output" },
@@ -51,9 +114,108 @@ static const struct argp_option opts[] = {
     { "export-root", 'e', "PATH", 0, "NFS export root directory" },
     { "port", 'p', "PORT", 0, "NFS server port (default: 2049)" },
     { "no-kernel-cache", 'n', NULL, 0, "Disable kernel-space caching" },
+    { "qos", 'q', "RULE", 0, "Rate limit a client prefix at XDP (repeatable)" },
+    { "stats-interval", 's', "SECS", 0, "Print kernel statistics every SECS seconds" },
+    { "sample", 'S', "N", 0, "Send an event for 1 in N calls, 0 for none (default: 1)" },
+    { "aggregate-only", 'A', NULL, 0, "Start with events off, counters only (SIGUSR1 toggles)" },
+    { "trace-latency", 't', NULL, 0, "Trace UDP calls from ingress to reply by XID" },
+    { "metrics-port", 'm', "PORT", 0, "Serve OpenMetrics on http://127.0.0.1:PORT/metrics" },
+    { "www-root", 'w', "DIR", 0, "Also serve static files from DIR on the metrics port" },
+    { "pin-maps", 'P', NULL, 0, "Keep the cache and counters in bpffs across restarts" },
+    { "cache-snapshot", 'C', "FILE", 0, "Save the kernel cache to FILE, restore it on start" },
+    { "control", 'c', "SOCKET", 0, "Accept runtime tuning commands on a UNIX socket" },
+    { "udp-gro", 'G', NULL, 0, "Receive coalesced UDP calls (bypasses the TC fast path)" },
+    { "xsk", 'X', NULL, 0, "Take calls the kernel does not answer over AF_XDP" },
+    { "steer-cpus", 'R', "CPUS", 0, "Steer NFS packets to these cores by client" },
     {},
 };
 
+/* Parse a QoS rule as described in argp_program_doc */
+static int parse_qos_rule(const char *arg, struct nfs_qos_key *key, struct nfs_qos_rule *rule)
+{
+    struct nfs_qos_limit *limits[] = {
+        &rule->client[NFS_QOS_META], &rule->client[NFS_QOS_DATA],
+        &rule->subnet[NFS_QOS_META], &rule->subnet[NFS_QOS_DATA],
+    };
+    char buf[256], *tok, *save, *slash, *end;
+    struct in6_addr addr;
+    long prefix;
+    int bits, n = 0;
+
+    snprintf(buf, sizeof(buf), "%s", arg);
+    memset(rule, 0, sizeof(*rule));
+    rule->action = NFS_QOS_DROP;
+
+    tok = strtok_r(buf, ",", &save);
+    if (!tok)
+        return -1;
+    slash = strchr(tok, '/');
+    if (slash)
+        *slash = '\0';
+    /* IPv4 prefixes live under ::ffff:0:0/96, as the kernel keys IPv4
+     * clients */
+    if (inet_pton(AF_INET, tok, &addr.s6_addr[12]) == 1) {
+        memset(addr.s6_addr, 0, 10);
+        addr.s6_addr[10] = addr.s6_addr[11] = 0xff;
+        bits = 32;
+    } else if (inet_pton(AF_INET6, tok, &addr) == 1) {
+        bits = 128;
+    } else {
+        return -1;
+    }
+    prefix = bits;
+    if (slash) {
+        errno = 0;
+        prefix = strtol(slash + 1, &end, 10);
+        if (errno || end == slash + 1 || *end)
+            return -1;
+    }
+    if (prefix < 0 || prefix > bits)
+        return -1;
+    key->prefixlen = 128 - bits + prefix;
+    for (__u32 i = key->prefixlen; i < 128; i++)
+        addr.s6_addr[i / 8] &= ~(0x80 >> (i % 8));
+    memcpy(&key->addr, &addr, sizeof(key->addr));
+
+    while ((tok = strtok_r(NULL, ",", &save))) {
+        if (!strcmp(tok, "drop"))
+            rule->action = NFS_QOS_DROP;
+        else if (!strcmp(tok, "jukebox"))
+            rule->action = NFS_QOS_JUKEBOX;
+        else if (n < 4 && sscanf(tok, "%u/%u", &limits[n]->rate, &limits[n]->burst) >= 1)
+            n++;
+        else
+            return -1;
+    }
+    return n >= 2 ? 0 : -1;
+}
+
+/* Parse a CPU list such as "2-5,8" into @cpus; returns the count, or -1 */
+static int parse_cpu_list(const char *arg, __u32 *cpus, int max)
+{
+    char buf[256], *tok, *save;
+    unsigned int lo, hi;
+    int n = 0;
+
+    snprintf(buf, sizeof(buf), "%s", arg);
+    for (tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        int fields = sscanf(tok, "%u-%u", &lo, &hi);
+
+        if (fields < 1)
+            return -1;
+        if (fields == 1)
+            hi = lo;
+        if (hi < lo)
+            return -1;
+        for (unsigned int cpu = lo; cpu <= hi; cpu++) {
+            if (n == max)
+                return -1;
+            cpus[n++] = cpu;
+        }
+    }
+    return n > 0 ? n : -1;
+}
+
 static error_t parse_arg(int key, char *arg, struct argp_state *state)
 {
     switch (key) {
@@ -72,9 +234,65 @@ static error_t parse_arg(int key, char *arg, struct argp_state *state)
     case 'n':
         env.enable_kernel_cache = false;
         break;
+    case 's':
+        env.stats_interval = atoi(arg);
+        if (env.stats_interval <= 0)
+            argp_error(state, "invalid stats interval: %s", arg);
+        break;
+    case 'S':
+        env.event_sample_rate = atoi(arg);
+        if (env.event_sample_rate < 0)
+            argp_error(state, "invalid sample rate: %s", arg);
+        break;
+    case 'A':
+        env.aggregate_only = true;
+        break;
+    case 't':
+        env.trace_latency = true;
+        break;
+    case 'm':
+        env.metrics_port = atoi(arg);
+        if (env.metrics_port <= 0 || env.metrics_port > 65535)
+            argp_error(state, "invalid metrics port: %s", arg);
+        break;
+    case 'w':
+        env.www_root = arg;
+        break;
+    case 'P':
+        env.pin_maps = true;
+        break;
+    case 'C':
+        env.snapshot = arg;
+        break;
+    case 'c':
+        env.control_path = arg;
+        break;
+    case 'G':
+        env.udp_gro = true;
+        break;
+    case 'X':
+        env.xsk = true;
+        break;
+    case 'R':
+        env.n_steer = parse_cpu_list(arg, env.steer_cpus, NFS_STEER_MAX_CPUS);
+        if (env.n_steer < 0)
+            argp_error(state, "invalid CPU list (at most %d cores): %s", NFS_STEER_MAX_CPUS, arg);
+        break;
+    case 'q':
+        if (env.n_qos == MAX_QOS_RULES)
+            argp_error(state, "at most %d QoS rules", MAX_QOS_RULES);
+        if (parse_qos_rule(arg, &env.qos_keys[env.n_qos], &env.qos_rules[env.n_qos]) < 0)
+            argp_error(state, "invalid QoS rule: %s", arg);
+        env.n_qos++;
+        break;
     case ARGP_KEY_ARG:
         argp_usage(state);
         break;
+    case ARGP_KEY_END:
+        /* AF_XDP sockets are bound to the RX queue a packet came in on */
+        if (env.xsk && env.n_steer)
+            argp_error(state, "-X and -R cannot be combined");
+        break;
     default:
         return ARGP_ERR_UNKNOWN;
     }
@@ -87,13 +305,86 @@ static const struct argp argp = {
     .doc = argp_program_doc,
 };
 
+#define MAX_TCP_CONNS NFS_TCP_MAX_CONNS
+
+/* Link-layer header of an AF_XDP call: Ethernet and up to two VLAN
+ * tags, as far as nfs_pkt.h parses */
+#define XSK_MAX_L2 (14 + 2 * 4)
+
+struct nfs_xsk;
+struct nfs_tcp_conn;
+
+/* Headers an AF_XDP reply goes out with, taken from its call */
+struct nfs_xsk_route {
+    __u8 l2[XSK_MAX_L2];        /* MAC addresses already swapped */
+    __u16 l2_len;
+    bool ipv6;
+    __u16 local_port;           /* Network byte order */
+    struct in6_addr local;      /* Where the call was sent; v4-mapped for IPv4 */
+};
+
+/* Where a reply goes: a UDP peer, an accepted TCP connection, or a peer
+ * whose call came in over AF_XDP */
+struct nfs_xprt {
+    int sock;
+    bool is_tcp;
+    struct sockaddr_in6 addr;   /* IPv4 peers v4-mapped (dual-stack sockets) */
+    struct nfs_xsk *xsk;        /* With AF_XDP, sock is the UDP socket for
+                                 * replies that do not fit a frame */
+    struct nfs_xsk_route route;
+    struct nfs_tcp_conn *conn;  /* TCP: the connection the call came on */
+};
+
+/* Accepted NFS/TCP connection and its record reassembly state */
+struct nfs_tcp_conn {
+    int fd;
+    struct sockaddr_in6 addr;
+    char *buf;          /* Stream bytes not yet split into fragments */
+    size_t buf_len;
+    char *rec;          /* Fragments of the record being reassembled */
+    size_t rec_len;
+    /* Reply ordering against the stream verdict, see nfs_tcp_order */
+    bool fastpath;      /* In the sockhash */
+    __u64 cookie;
+    __u64 tcp_base;     /* Send position when it was accepted */
+    __u64 user_bytes;   /* Reply bytes written here */
+    __u32 frags;        /* Fragments read */
+    __u32 frags_done;   /* Of those, the ones whose records are answered */
+};
+
+static struct nfs_tcp_conn tcp_conns[MAX_TCP_CONNS];
+static struct nfs_tcp_order *tcp_order;    /* mmapped nfs_tcp_order */
+
+/* How long a user space reply waits for the verdict's replies ahead of
+ * it to reach TCP before the connection is given up */
+#define TCP_ORDER_WAIT_NS 1000000000ULL
+
+/* Text form of a client address (an in6_addr or nfs_addr), v4-mapped
+ * ones as plain IPv4. Like inet_ntoa() it returns a static buffer. */
+static const char *addr_ntoa(const void *addr)
+{
+    static char buf[INET6_ADDRSTRLEN];
+    const struct in6_addr *a6 = addr;
+
+    if (IN6_IS_ADDR_V4MAPPED(a6))
+        return inet_ntop(AF_INET, &a6->s6_addr[12], buf, sizeof(buf));
+    return inet_ntop(AF_INET6, a6, buf, sizeof(buf));
+}
+
 static volatile bool exiting = false;
 
+static volatile bool toggle_events = false;
+
 static void sig_handler(int sig)
 {
     exiting = true;
 }
 
+static void sigusr1_handler(int sig)
+{
+    toggle_events = true;
+}
+
 static int libbpf_print_fn(enum libbpf_print_level level, const char *format, va_list args)
 {
     if (level == LIBBPF_DEBUG && !env.verbose)
@@ -104,40 +395,181 @@ static int libbpf_print_fn(enum libbpf_print_level level, const char *format, va
 /* NFS server statistics */
 struct nfs_server_stats {
     uint64_t total_requests;
-    uint64_t kernel_processed;
     uint64_t user_processed;
-    uint64_t cache_hits;
-    uint64_t cache_misses;
     uint64_t file_not_found;
     uint64_t access_denied;
     uint64_t errors;
+    uint64_t bytes_written;
+    uint64_t sync_waiters;      /* Stable WRITEs and COMMITs that waited on a sync */
+    uint64_t syncs;             /* fdatasync/fsync calls that served them */
+    uint64_t drc_replays;       /* Retransmits answered from the user space DRC */
+    uint64_t gso_sends;         /* UDP_SEGMENT sends ... */
+    uint64_t gso_replies;       /* ... and the replies they carried */
+    uint64_t gro_trains;        /* Coalesced UDP_GRO receives ... */
+    uint64_t gro_calls;         /* ... and the calls in them */
+    uint64_t xsk_calls;         /* Calls taken off AF_XDP RX rings */
+    uint64_t xsk_replies;       /* Replies sent from UMEM frames */
+    uint64_t xsk_fallbacks;     /* AF_XDP calls answered over the UDP socket */
 } stats = {0};
 
-/* Simple XDR encoding helpers */
-static inline void xdr_encode_u32(char **p, uint32_t val)
-{
-    *((uint32_t *)*p) = htonl(val);
-    *p += 4;
-}
+/* Largest reply we encode: READ data plus headers */
+#define NFS_MAX_REPLY_SIZE (NFS_MAX_IO_SIZE + 1024)
 
-static inline void xdr_encode_u64(char **p, uint64_t val)
-{
-    *((uint32_t *)*p) = htonl((uint32_t)(val >> 32));
-    *p += 4;
-    *((uint32_t *)*p) = htonl((uint32_t)(val & 0xFFFFFFFF));
-    *p += 4;
-}
+/* Largest call we take over UDP: WRITE data plus headers */
+#define NFS_MAX_CALL_SIZE (NFS_MAX_IO_SIZE + 1024)
+
+/* Datagrams read per wakeup before replies waiting on a sync are sent */
+#define UDP_BATCH 64
+
+/* One UDP receive: a call of up to NFS_MAX_CALL_SIZE, or a GRO train
+ * of small ones up to 64KB */
+#define UDP_RECV_SIZE 65536
 
-static inline uint32_t xdr_decode_u32(char **p)
+/* UDP replies held until the end of a round, so that runs to one client
+ * leave in a single UDP_SEGMENT send */
+#define UDP_TX_QUEUE 256
+#define UDP_TX_BUF_SIZE (1 << 20)
+
+/* Kernel limits on one GSO send: UDP_MAX_SEGMENTS segments, and a
+ * payload that fits an IPv4 total length */
+#define UDP_GSO_MAX_SEGS 64
+#define UDP_GSO_MAX_BYTES (65535 - 20 - 8)
+
+/* Files kept open for WRITE, each with its unsynced ranges */
+#define MAX_OPEN_FILES 64
+#define MAX_DIRTY_RANGES 16
+
+/* Stable WRITE and COMMIT replies that can wait on one group sync */
+#define MAX_PENDING_SYNCS 256
+
+/* Directories whose READDIR snapshot is kept between calls */
+#define DIR_SNAP_CACHE_SIZE 16
+
+/* User space duplicate request cache: DRC_SETS sets of DRC_WAYS replies,
+ * least recently used replaced first */
+#define DRC_SETS 128
+#define DRC_WAYS 8
+
+/* Number of file handles user space can resolve back to paths */
+#define FH_TABLE_SIZE 16384
+
+/* Per-procedure reply encoding cost */
+struct nfs_proc_stats {
+    uint64_t calls;
+    uint64_t encode_ns;
+    uint64_t encode_bytes;
+};
+
+static struct nfs_proc_stats proc_stats[NFS3_NPROCS];
+
+/* Handle given to a client and the export-relative path it names */
+struct nfs_fh_entry {
+    struct nfs_fh fh;
+    char path[MAX_FILENAME_LEN];
+    bool used;
+};
+
+static struct nfs_fh_entry fh_table[FH_TABLE_SIZE];
+
+/* A decoded call being served in user space */
+struct nfs_call_ctx {
+    struct nfs_xprt *xprt;
+    uint32_t xid;
+    uint32_t proc;
+    uint32_t uid;
+    uint32_t gid;
+    struct xdr_dec args;
+    uint64_t encode_start;
+    __u8 *reply;            /* reply_buf, or the AF_XDP frame it goes out in */
+};
+
+/* Replies are encoded here; the server handles one call at a time */
+static __u8 reply_buf[NFS_MAX_REPLY_SIZE];
+static __u8 read_buf[NFS_MAX_IO_SIZE];
+
+/* Byte range [start, end) written but not yet on stable storage */
+struct nfs_dirty_range {
+    uint64_t start;
+    uint64_t end;
+};
+
+/* A file open for WRITE and what a COMMIT of it still has to flush */
+struct nfs_open_file {
+    int fd;                     /* -1 when the slot is free */
+    struct nfs_fh fh;
+    uint64_t last_used;
+    int ndirty;
+    struct nfs_dirty_range dirty[MAX_DIRTY_RANGES];
+    bool sync_queued;           /* A held-back reply waits on this file */
+    bool file_sync;             /* ...and one of them asked for FILE_SYNC */
+    int sync_err;               /* errno of the last group sync */
+};
+
+/* A stable WRITE or COMMIT reply held back until its file is synced */
+struct nfs_pending_sync {
+    struct nfs_xprt xprt;
+    uint32_t xid;
+    uint32_t proc;
+    struct nfs_open_file *file;
+    struct nfs_wcc_attr before;
+    uint32_t count;             /* WRITE only */
+    uint32_t committed;         /* WRITE only */
+};
+
+static struct nfs_open_file open_files[MAX_OPEN_FILES];
+static struct nfs_pending_sync pending_syncs[MAX_PENDING_SYNCS];
+static int n_pending_syncs;
+
+/* Set at startup and again whenever writeback fails. A client that
+ * sees it change knows its UNSTABLE writes may be lost and sends them
+ * again. */
+static __u8 write_verf[NFS3_WRITEVERFSIZE];
+
+/* One directory entry of a READDIR snapshot; its cookie is index + 1 */
+struct nfs_dirent {
+    uint64_t fileid;
+    uint32_t name_off;          /* Offset into the snapshot's name pool */
+    uint32_t name_len;
+};
+
+/* A directory listed once and served page by page. Cookies stay valid
+ * while the directory's change time matches @verf. */
+struct nfs_dir_snapshot {
+    struct nfs_fh fh;
+    uint64_t verf;
+    uint64_t last_used;
+    uint32_t count;
+    struct nfs_dirent *ents;
+    char *names;
+};
+
+static struct nfs_dir_snapshot dir_snaps[DIR_SNAP_CACHE_SIZE];
+
+/* A non-idempotent reply kept for retransmits; any transport */
+struct nfs_drc_slot {
+    struct nfs_drc_key key;
+    uint32_t proc;
+    uint32_t len;               /* 0 when the slot is free */
+    uint64_t last_used;
+    __u8 reply[NFS_DRC_MAX_REPLY];
+};
+
+static struct nfs_drc_slot drc_cache[DRC_SETS][DRC_WAYS];
+
+static struct nfs_server_bpf *skel;
+
+static uint64_t now_ns(void)
 {
-    uint32_t val = ntohl(*((uint32_t *)*p));
-    *p += 4;
-    return val;
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
 /* Generate NFS file handle from filename */
 static void generate_nfs_file_handle(const char *filename, struct nfs_fh *fh)
 {
+    memset(fh, 0, sizeof(*fh));
     fh->len = 8;
     
     /* Simple hash-based file handle */
@@ -150,308 +582,3835 @@ static void generate_nfs_file_handle(const char *filename, struct nfs_fh *fh)
     *((uint32_t *)&fh->data[4]) = hash ^ 0xdeadbeef;
 }
 
-/* Cache file in kernel space */
-static int cache_file_in_kernel(struct nfs_server_bpf *skel, const char *filename)
+static struct nfs_fh_entry *fh_table_slot(const struct nfs_fh *fh, bool insert)
+{
+    uint32_t hash;
+
+    memcpy(&hash, fh->data, sizeof(hash));
+    for (uint32_t i = 0; i < FH_TABLE_SIZE; i++) {
+        struct nfs_fh_entry *e = &fh_table[(hash + i) & (FH_TABLE_SIZE - 1)];
+
+        if (!e->used)
+            return insert ? e : NULL;
+        if (e->fh.len == fh->len && !memcmp(e->fh.data, fh->data, fh->len))
+            return e;
+    }
+    return NULL;
+}
+
+/* Remember which path a handle names so later calls can resolve it */
+static void fh_table_insert(const struct nfs_fh *fh, const char *path)
+{
+    struct nfs_fh_entry *e = fh_table_slot(fh, true);
+
+    if (!e)
+        return;
+    e->fh = *fh;
+    snprintf(e->path, sizeof(e->path), "%s", path);
+    e->used = true;
+}
+
+static const char *fh_table_lookup(const struct nfs_fh *fh)
+{
+    struct nfs_fh_entry *e = fh_table_slot(fh, false);
+
+    return e ? e->path : NULL;
+}
+
+/* Fill NFS attributes from stat(2) results */
+static void stat_to_fattr(const struct stat *st, struct nfs_fattr *attr)
+{
+    if (S_ISDIR(st->st_mode))
+        attr->type = NF3DIR;
+    else if (S_ISLNK(st->st_mode))
+        attr->type = NF3LNK;
+    else if (S_ISBLK(st->st_mode))
+        attr->type = NF3BLK;
+    else if (S_ISCHR(st->st_mode))
+        attr->type = NF3CHR;
+    else if (S_ISSOCK(st->st_mode))
+        attr->type = NF3SOCK;
+    else if (S_ISFIFO(st->st_mode))
+        attr->type = NF3FIFO;
+    else
+        attr->type = NF3REG;
+    attr->mode = st->st_mode;
+    attr->nlink = st->st_nlink;
+    attr->uid = st->st_uid;
+    attr->gid = st->st_gid;
+    attr->size = st->st_size;
+    attr->used = st->st_blocks * 512;
+    attr->fsid = st->st_dev;
+    attr->fileid = st->st_ino;
+    attr->atime_sec = st->st_atim.tv_sec;
+    attr->atime_nsec = st->st_atim.tv_nsec;
+    attr->mtime_sec = st->st_mtim.tv_sec;
+    attr->mtime_nsec = st->st_mtim.tv_nsec;
+    attr->ctime_sec = st->st_ctim.tv_sec;
+    attr->ctime_nsec = st->st_ctim.tv_nsec;
+}
+
+/* Fill NFS attributes from statx(2) results */
+static void statx_to_fattr(const struct statx *stx, struct nfs_fattr *attr)
+{
+    struct stat st = {
+        .st_mode = stx->stx_mode,
+        .st_nlink = stx->stx_nlink,
+        .st_uid = stx->stx_uid,
+        .st_gid = stx->stx_gid,
+        .st_size = stx->stx_size,
+        .st_blocks = stx->stx_blocks,
+        .st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor),
+        .st_ino = stx->stx_ino,
+        .st_atim = { stx->stx_atime.tv_sec, stx->stx_atime.tv_nsec },
+        .st_mtim = { stx->stx_mtime.tv_sec, stx->stx_mtime.tv_nsec },
+        .st_ctim = { stx->stx_ctime.tv_sec, stx->stx_ctime.tv_nsec },
+    };
+
+    stat_to_fattr(&st, attr);
+}
+
+/* Fill the wcc_attr subset a modifying call reports as its pre-op state */
+static void stat_to_wcc_attr(const struct stat *st, struct nfs_wcc_attr *attr)
+{
+    attr->size = st->st_size;
+    attr->mtime_sec = st->st_mtim.tv_sec;
+    attr->mtime_nsec = st->st_mtim.tv_nsec;
+    attr->ctime_sec = st->st_ctim.tv_sec;
+    attr->ctime_nsec = st->st_ctim.tv_nsec;
+}
+
+/* Map errno to nfsstat3 */
+static uint32_t nfs3_errno_stat(int err)
+{
+    switch (err) {
+    case 0:             return NFS3_OK;
+    case EPERM:         return NFS3ERR_PERM;
+    case ENOENT:        return NFS3ERR_NOENT;
+    case EACCES:        return NFS3ERR_ACCES;
+    case EEXIST:        return NFS3ERR_EXIST;
+    case EXDEV:         return NFS3ERR_XDEV;
+    case ENODEV:        return NFS3ERR_NODEV;
+    case ENOTDIR:       return NFS3ERR_NOTDIR;
+    case EISDIR:        return NFS3ERR_ISDIR;
+    case EINVAL:        return NFS3ERR_INVAL;
+    case EFBIG:         return NFS3ERR_FBIG;
+    case ENOSPC:        return NFS3ERR_NOSPC;
+    case EROFS:         return NFS3ERR_ROFS;
+    case EMLINK:        return NFS3ERR_MLINK;
+    case ENAMETOOLONG:  return NFS3ERR_NAMETOOLONG;
+    case ENOTEMPTY:     return NFS3ERR_NOTEMPTY;
+    case EDQUOT:        return NFS3ERR_DQUOT;
+    case ESTALE:        return NFS3ERR_STALE;
+    default:            return NFS3ERR_IO;
+    }
+}
+
+/* Build the on-disk path of an export-relative path */
+static void nfs_full_path(const char *rel, char *out, size_t len)
+{
+    if (rel[0])
+        snprintf(out, len, "%s/%s", env.export_root, rel);
+    else
+        snprintf(out, len, "%s", env.export_root);
+}
+
+/* Resolve a handle to its relative and full path and stat it.
+ * Returns an nfsstat3. */
+static uint32_t nfs_resolve_fh(const struct nfs_fh *fh, const char **rel,
+                               char *path, size_t len, struct stat *st)
+{
+    *rel = fh_table_lookup(fh);
+    if (!*rel)
+        return NFS3ERR_STALE;
+
+    nfs_full_path(*rel, path, len);
+    if (lstat(path, st) != 0)
+        return errno == ENOENT ? NFS3ERR_STALE : nfs3_errno_stat(errno);
+    return NFS3_OK;
+}
+
+/* User space view of nfs_arena (see struct nfs_arena_hdr) */
+static __u8 *arena_base;
+static size_t arena_size;
+
+/* Freed chunks wait this long before reuse, so a BPF program still
+ * copying out of one never sees it rewritten */
+#define ARENA_GRACE_NS 1000000000ULL
+#define ARENA_QUARANTINE 1024
+
+static struct arena_freed {
+    __u32 off;
+    __u32 size;
+    uint64_t time;
+} arena_quarantine[ARENA_QUARANTINE];
+static unsigned int arena_q_head, arena_q_tail;
+
+/* Map the arena. libbpf maps it when it creates it; a pinned one that
+ * was reused has to be mapped at its fixed address by hand. */
+static int arena_open(struct nfs_server_bpf *skel)
+{
+    struct nfs_arena_hdr *hdr;
+    size_t sz;
+
+    arena_size = (size_t)NFS_ARENA_PAGES * sysconf(_SC_PAGE_SIZE);
+    arena_base = bpf_map__initial_value(skel->maps.nfs_arena, &sz);
+    if (!arena_base) {
+        arena_base = mmap((void *)NFS_ARENA_ADDR, arena_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_FIXED_NOREPLACE,
+                          bpf_map__fd(skel->maps.nfs_arena), 0);
+        if (arena_base == MAP_FAILED) {
+            arena_base = NULL;
+            return -errno;
+        }
+    }
+    hdr = (struct nfs_arena_hdr *)arena_base;
+    if (!hdr->top)
+        hdr->top = (sizeof(*hdr) + NFS_ARENA_MIN_CHUNK - 1) & ~(NFS_ARENA_MIN_CHUNK - 1);
+    return 0;
+}
+
+static int arena_class(__u32 size)
+{
+    int c = 0;
+
+    while ((NFS_ARENA_MIN_CHUNK << c) < size)
+        c++;
+    return c;
+}
+
+/* Allocate room for @size bytes of file data. Returns its offset, or 0
+ * when the arena is full. */
+static __u32 arena_alloc(__u32 size)
+{
+    struct nfs_arena_hdr *hdr = (struct nfs_arena_hdr *)arena_base;
+    int c = arena_class(size);
+    __u32 off;
+
+    if (c >= NFS_ARENA_NCLASSES)
+        return 0;
+    off = hdr->free[c];
+    if (off) {
+        memcpy(&hdr->free[c], arena_base + off, sizeof(off));
+        return off;
+    }
+    if (hdr->top + (NFS_ARENA_MIN_CHUNK << c) > arena_size)
+        return 0;
+    off = hdr->top;
+    hdr->top += NFS_ARENA_MIN_CHUNK << c;
+    return off;
+}
+
+static void arena_release(__u32 off, __u32 size)
+{
+    struct nfs_arena_hdr *hdr = (struct nfs_arena_hdr *)arena_base;
+    int c = arena_class(size);
+
+    memcpy(arena_base + off, &hdr->free[c], sizeof(off));
+    hdr->free[c] = off;
+}
+
+/* Put chunks freed at least ARENA_GRACE_NS ago back on the free lists;
+ * with @all, everything (nothing can be reading them) */
+static void arena_reclaim(bool all)
+{
+    uint64_t now = now_ns();
+
+    while (arena_q_tail != arena_q_head) {
+        struct arena_freed *f = &arena_quarantine[arena_q_tail % ARENA_QUARANTINE];
+
+        if (!all && now - f->time < ARENA_GRACE_NS)
+            break;
+        arena_release(f->off, f->size);
+        arena_q_tail++;
+    }
+}
+
+/* Free the data of a cache entry that was just replaced or deleted */
+static void arena_free(__u32 off, __u32 size)
+{
+    struct arena_freed *f;
+
+    if (!off)
+        return;
+    /* Out of room: the oldest has waited longest */
+    if (arena_q_head - arena_q_tail == ARENA_QUARANTINE) {
+        f = &arena_quarantine[arena_q_tail++ % ARENA_QUARANTINE];
+        arena_release(f->off, f->size);
+    }
+    f = &arena_quarantine[arena_q_head++ % ARENA_QUARANTINE];
+    f->off = off;
+    f->size = size;
+    f->time = now_ns();
+}
+
+/* Build the kernel cache entry for @filename from the export, reading
+ * its data into @data (at most @cap bytes, normally an arena chunk).
+ * Touches no shared state, so snapshot restore runs it from several
+ * threads. */
+static int cache_entry_build(const char *filename, struct nfs_file_cache_entry *e,
+                             __u8 *data, __u32 cap)
 {
     char filepath[512];
     struct stat st;
     int fd;
-    struct nfs_file_cache_entry cache_entry = {0};
-    
-    if (!env.enable_kernel_cache)
-        return 0;
     
+    memset(e, 0, sizeof(*e));
     snprintf(filepath, sizeof(filepath), "%s/%s", env.export_root, filename);
     
     if (stat(filepath, &st) != 0 || !S_ISREG(st.st_mode))
         return -1;
     
     /* Only cache small files in kernel */
-    if (st.st_size > MAX_NFS_DATA_SIZE)
+    if (st.st_size > MAX_NFS_DATA_SIZE || st.st_size > cap)
         return -1;
     
     fd = open(filepath, O_RDONLY);
     if (fd < 0)
         return -1;
     
-    ssize_t bytes_read = read(fd, cache_entry.data, st.st_size);
+    ssize_t bytes_read = read(fd, data, st.st_size);
     close(fd);
     
     if (bytes_read != st.st_size)
         return -1;
     
     /* Fill cache entry */
-    strncpy(cache_entry.filename, filename, MAX_FILENAME_LEN - 1);
-    generate_nfs_file_handle(filename, &cache_entry.fh);
+    strncpy(e->filename, filename, MAX_FILENAME_LEN - 1);
+    generate_nfs_file_handle(filename, &e->fh);
     
     /* Fill file attributes */
-    cache_entry.attr.type = S_ISDIR(st.st_mode) ? 2 : 1; /* 1=REG, 2=DIR */
-    cache_entry.attr.mode = st.st_mode;
-    cache_entry.attr.nlink = st.st_nlink;
-    cache_entry.attr.uid = st.st_uid;
-    cache_entry.attr.gid = st.st_gid;
-    cache_entry.attr.size = st.st_size;
-    cache_entry.attr.used = st.st_blocks * 512;
-    cache_entry.attr.fsid = 1; /* Simple filesystem ID */
-    cache_entry.attr.fileid = st.st_ino;
-    cache_entry.attr.atime_sec = st.st_atime;
-    cache_entry.attr.mtime_sec = st.st_mtime;
-    cache_entry.attr.ctime_sec = st.st_ctime;
-    
-    cache_entry.data_size = st.st_size;
-    cache_entry.cache_time = time(NULL) * 1000000000ULL; /* nanoseconds */
-    cache_entry.valid = 1;
-    cache_entry.data_valid = 1;
-    cache_entry.cache_hits = 0;
+    stat_to_fattr(&st, &e->attr);
+    
+    e->data_size = st.st_size;
+    /* Same clock as bpf_ktime_get_ns() so the kernel TTL check works */
+    e->cache_time = now_ns();
+    e->valid = 1;
+    e->data_valid = 1;
+    e->cache_hits = 0;
+    return 0;
+}
+
+/* Drop @key (a zero-padded name) from the kernel cache, freeing its data */
+static void cache_evict(const char *key)
+{
+    int cache_map_fd = bpf_map__fd(skel->maps.nfs_file_cache);
+    struct nfs_file_cache_entry old;
+
+    if (bpf_map_lookup_elem(cache_map_fd, key, &old))
+        return;
+    if (!bpf_map_delete_elem(cache_map_fd, key))
+        arena_free(old.data_off, old.data_size);
+}
+
+/* Cache file in kernel space */
+static int cache_file_in_kernel(struct nfs_server_bpf *skel, const char *filename)
+{
+    struct nfs_file_cache_entry cache_entry, old;
+    char filepath[512];
+    struct stat st;
+    bool replaced;
+    __u32 off;
+    
+    if (!env.enable_kernel_cache)
+        return 0;
+    
+    /* The data goes straight into an arena chunk sized for it */
+    nfs_full_path(filename, filepath, sizeof(filepath));
+    if (stat(filepath, &st) != 0 || st.st_size > MAX_NFS_DATA_SIZE ||
+        st.st_size > skel->data->nfs_config.max_cached_file_size)
+        return -1;
+    off = arena_alloc(st.st_size);
+    if (!off)
+        return -1;
+    if (cache_entry_build(filename, &cache_entry, arena_base + off, st.st_size)) {
+        arena_release(off, st.st_size);
+        return -1;
+    }
+    cache_entry.data_off = off;
+    fh_table_insert(&cache_entry.fh, filename);
     
     /* Update kernel cache map */
     int cache_map_fd = bpf_map__fd(skel->maps.nfs_file_cache);
     int fh_map_fd = bpf_map__fd(skel->maps.fh_to_name);
     
-    if (bpf_map_update_elem(cache_map_fd, filename, &cache_entry, BPF_ANY) != 0)
+    /* Keys are full MAX_FILENAME_LEN buffers, so use the zero-padded copy */
+    replaced = !bpf_map_lookup_elem(cache_map_fd, cache_entry.filename, &old);
+    if (bpf_map_update_elem(cache_map_fd, cache_entry.filename, &cache_entry, BPF_ANY) != 0) {
+        arena_release(off, st.st_size);
         return -1;
+    }
+    if (replaced)
+        arena_free(old.data_off, old.data_size);
     
     /* Update file handle to name mapping */
-    if (bpf_map_update_elem(fh_map_fd, &cache_entry.fh, filename, BPF_ANY) != 0)
+    if (bpf_map_update_elem(fh_map_fd, &cache_entry.fh, cache_entry.filename, BPF_ANY) != 0)
         return -1;
     
     return 0;
 }
 
-/* Handle NFS NULL request (ping operation) */
-static void handle_nfs_null(int client_sock, struct sockaddr_in *client_addr, uint32_t xid)
+/* Drop a file from the kernel cache before user space changes it */
+static void uncache_file_in_kernel(const char *filename)
 {
-    char response[64];
-    char *p = response;
-    
-    /* Encode RPC reply header for NULL operation */
-    xdr_encode_u32(&p, xid);                    /* XID */
-    xdr_encode_u32(&p, 1);                      /* REPLY */
-    xdr_encode_u32(&p, 0);                      /* MSG_ACCEPTED */
-    xdr_encode_u32(&p, 0);                      /* AUTH_NULL */
-    xdr_encode_u32(&p, 0);                      /* Auth length */
-    xdr_encode_u32(&p, 0);                      /* ACCEPT_STAT = SUCCESS */
-    
-    /* NULL operation has no data, just success status */
-    xdr_encode_u32(&p, 0);                      /* NFS3_OK */
-    
-    /* Send response */
-    sendto(client_sock, response, p - response, 0,
-           (struct sockaddr *)client_addr, sizeof(*client_addr));
-    
-    stats.user_processed++;
-    
-    if (env.verbose) {
-        printf("NULL operation processed for client %s:%u\n",
-               inet_ntoa(client_addr->sin_addr), ntohs(client_addr->sin_port));
-    }
+    char key[MAX_FILENAME_LEN] = {0};
+
+    if (!env.enable_kernel_cache)
+        return;
+
+    strncpy(key, filename, MAX_FILENAME_LEN - 1);
+    cache_evict(key);
 }
 
-/* Handle NFS GETATTR request */
-static void handle_nfs_getattr(int client_sock, struct sockaddr_in *client_addr,
-                              char *request, int req_len, uint32_t xid)
+/* bpffs directory for this export: its real path with '/' as '_' */
+static int pin_dir_path(char *out, size_t len)
 {
-    char response[1024];
-    char *p = response;
-    char filename[MAX_FILENAME_LEN];
-    char filepath[512];
-    struct stat st;
-    
-    /* For demonstration, extract filename from request - in real NFS this would be file handle */
-    /* This is a simplified implementation */
-    strcpy(filename, "test.txt"); /* Default file for demo */
-    
-    snprintf(filepath, sizeof(filepath), "%s/%s", env.export_root, filename);
-    
-    /* Encode RPC reply header */
-    xdr_encode_u32(&p, xid);                    /* XID */
-    xdr_encode_u32(&p, 1);                      /* REPLY */
-    xdr_encode_u32(&p, 0);                      /* MSG_ACCEPTED */
-    xdr_encode_u32(&p, 0);                      /* AUTH_NULL */
-    xdr_encode_u32(&p, 0);                      /* Auth length */
-    xdr_encode_u32(&p, 0);                      /* ACCEPT_STAT = SUCCESS */
-    
-    /* Check if file exists */
-    if (stat(filepath, &st) != 0) {
-        xdr_encode_u32(&p, 2);                  /* NFS3ERR_NOENT */
-    } else {
-        xdr_encode_u32(&p, 0);                  /* NFS3_OK */
-        
-        /* Encode file attributes */
-        xdr_encode_u32(&p, S_ISDIR(st.st_mode) ? 2 : 1); /* file type */
-        xdr_encode_u32(&p, st.st_mode);         /* mode */
-        xdr_encode_u32(&p, st.st_nlink);        /* nlink */
-        xdr_encode_u32(&p, st.st_uid);          /* uid */
-        xdr_encode_u32(&p, st.st_gid);          /* gid */
-        xdr_encode_u64(&p, st.st_size);         /* size */
-        xdr_encode_u64(&p, st.st_blocks * 512); /* used */
-        xdr_encode_u64(&p, 1);                  /* fsid */
-        xdr_encode_u64(&p, st.st_ino);          /* fileid */
-        xdr_encode_u64(&p, st.st_atime);        /* atime */
-        xdr_encode_u32(&p, 0);                  /* atime nsec */
-        xdr_encode_u64(&p, st.st_mtime);        /* mtime */
-        xdr_encode_u32(&p, 0);                  /* mtime nsec */
-        xdr_encode_u64(&p, st.st_ctime);        /* ctime */
-        xdr_encode_u32(&p, 0);                  /* ctime nsec */
-        
-        stats.user_processed++;
+    char real[PATH_MAX], *p;
+
+    if (!realpath(env.export_root, real))
+        return -errno;
+    for (p = real; *p; p++) {
+        if (*p == '/')
+            *p = '_';
     }
-    
-    /* Send response */
-    sendto(client_sock, response, p - response, 0, 
-           (struct sockaddr *)client_addr, sizeof(*client_addr));
+    snprintf(out, len, "%s/%s", NFS_PIN_ROOT, real[1] ? real + 1 : "_");
+    return 0;
 }
 
-/* Handle NFS READ request */
-static void handle_nfs_read(int client_sock, struct sockaddr_in *client_addr,
-                           char *request, int req_len, uint32_t xid)
+/* Whether the layout stamp in @dir matches this build */
+static bool pin_layout_matches(const char *dir)
 {
-    char response[4096];
-    char *p = response;
-    char filename[MAX_FILENAME_LEN];
-    char filepath[512];
+    char path[PATH_MAX];
+    __u32 zero = 0, version = 0;
     int fd;
-    ssize_t bytes_read;
-    uint32_t offset = 0, count = 1024; /* Simplified - would parse from request */
-    
-    /* For demonstration */
-    strcpy(filename, "test.txt");
-    snprintf(filepath, sizeof(filepath), "%s/%s", env.export_root, filename);
-    
-    /* Encode RPC reply header */
-    xdr_encode_u32(&p, xid);                    /* XID */
-    xdr_encode_u32(&p, 1);                      /* REPLY */
-    xdr_encode_u32(&p, 0);                      /* MSG_ACCEPTED */
-    xdr_encode_u32(&p, 0);                      /* AUTH_NULL */
-    xdr_encode_u32(&p, 0);                      /* Auth length */
-    xdr_encode_u32(&p, 0);                      /* ACCEPT_STAT = SUCCESS */
-    
-    fd = open(filepath, O_RDONLY);
-    if (fd < 0) {
-        xdr_encode_u32(&p, 2);                  /* NFS3ERR_NOENT */
-    } else {
-        lseek(fd, offset, SEEK_SET);
-        bytes_read = read(fd, p + 12, count);   /* Reserve space for NFS header */
-        close(fd);
-        
-        if (bytes_read < 0) {
-            xdr_encode_u32(&p, 5);              /* NFS3ERR_IO */
-        } else {
-            xdr_encode_u32(&p, 0);              /* NFS3_OK */
-            xdr_encode_u32(&p, bytes_read);     /* count */
-            xdr_encode_u32(&p, bytes_read < count ? 1 : 0); /* eof */
-            xdr_encode_u32(&p, bytes_read);     /* data length */
-            p += bytes_read;                    /* Skip over data */
-            
-            stats.user_processed++;
-        }
-    }
-    
-    /* Send response */
-    sendto(client_sock, response, p - response, 0,
-           (struct sockaddr *)client_addr, sizeof(*client_addr));
+
+    snprintf(path, sizeof(path), "%s/layout", dir);
+    fd = bpf_obj_get(path);
+    if (fd < 0)
+        return false;
+    if (bpf_map_lookup_elem(fd, &zero, &version))
+        version = 0;
+    close(fd);
+    return version == NFS_PIN_LAYOUT_VERSION;
 }
 
-/* Process NFS request in user space */
-static void process_nfs_request(int client_sock, struct sockaddr_in *client_addr,
-                               char *buffer, int len)
+/* Whether a pinned map can stand in for the skeleton's definition */
+static bool pin_map_compatible(int fd, const struct bpf_map *map)
 {
-    char *p = buffer;
-    uint32_t xid, msg_type, rpc_vers, prog, vers, proc;
-    
-    if (len < 24) /* Minimum RPC header size */
-        return;
-    
-    /* Decode RPC header */
-    xid = xdr_decode_u32(&p);
-    msg_type = xdr_decode_u32(&p);
-    rpc_vers = xdr_decode_u32(&p);
-    prog = xdr_decode_u32(&p);
-    vers = xdr_decode_u32(&p);
-    proc = xdr_decode_u32(&p);
-    
-    if (msg_type != 0 || rpc_vers != 2 || prog != RPC_PROGRAM_NFS || vers != NFS_VERSION_3)
-        return;
+    struct bpf_map_info info = {};
+    __u32 len = sizeof(info);
+
+    if (bpf_map_get_info_by_fd(fd, &info, &len))
+        return false;
+    return info.type == bpf_map__type(map) &&
+           info.key_size == bpf_map__key_size(map) &&
+           info.value_size == bpf_map__value_size(map) &&
+           info.max_entries == bpf_map__max_entries(map) &&
+           info.map_flags == bpf_map__map_flags(map) &&
+           info.map_extra == bpf_map__map_extra(map);
+}
+
+/* The first PIN_CACHE_MAPS of pin_maps_prepare()'s maps make up the
+ * cache: entries hold offsets into the arena and the handle table names
+ * their files, so they are reused together or not at all */
+#define PIN_CACHE_MAPS 3
+
+/* Point the long-lived maps at @dir before load. libbpf then reuses
+ * whatever is pinned there and pins what it creates; pins from an
+ * incompatible build, or a cache missing one of its maps, are removed
+ * first so that start is cold instead of failing. Returns how many maps
+ * will be reused and sets @warm_cache when the cache is among them. */
+static int pin_maps_prepare(struct nfs_server_bpf *skel, const char *dir, bool *warm_cache)
+{
+    struct bpf_map *maps[] = {
+        skel->maps.nfs_file_cache, skel->maps.nfs_arena, skel->maps.fh_to_name,
+        skel->maps.client_track, skel->maps.nfs_stats,
+    };
+    const int n_maps = sizeof(maps) / sizeof(maps[0]);
+    bool layout_ok = pin_layout_matches(dir), usable[n_maps], pinned[n_maps];
+    bool cache_ok = true, cache_any = false;
+    char path[PATH_MAX];
+    int reused = 0;
+
+    if ((mkdir(NFS_PIN_ROOT, 0700) && errno != EEXIST) ||
+        (mkdir(dir, 0700) && errno != EEXIST))
+        return -errno;
+
+    for (int i = 0; i < n_maps; i++) {
+        int fd;
+
+        snprintf(path, sizeof(path), "%s/%s", dir, bpf_map__name(maps[i]));
+        fd = bpf_obj_get(path);
+        pinned[i] = fd >= 0;
+        usable[i] = pinned[i] && layout_ok && pin_map_compatible(fd, maps[i]);
+        if (pinned[i] && !usable[i])
+            fprintf(stderr, "Pinned %s has a different layout, starting it empty\n",
+                    bpf_map__name(maps[i]));
+        if (fd >= 0)
+            close(fd);
+        if (i < PIN_CACHE_MAPS) {
+            cache_ok &= usable[i];
+            cache_any |= usable[i];
+        }
+    }
+    if (cache_any && !cache_ok)
+        fprintf(stderr, "Pinned cache is incomplete, starting it cold\n");
+
+    for (int i = 0; i < n_maps; i++) {
+        snprintf(path, sizeof(path), "%s/%s", dir, bpf_map__name(maps[i]));
+        if (i < PIN_CACHE_MAPS ? cache_ok : usable[i])
+            reused++;
+        else if (pinned[i])
+            unlink(path);
+        if (bpf_map__set_pin_path(maps[i], path))
+            return -errno;
+    }
+    *warm_cache = cache_ok;
+    return reused;
+}
+
+/* Record the layout the maps in @dir were created with */
+static int pin_layout_stamp(const char *dir)
+{
+    char path[PATH_MAX];
+    __u32 zero = 0, version = NFS_PIN_LAYOUT_VERSION;
+    int fd, err = 0;
+
+    if (pin_layout_matches(dir))
+        return 0;
+    snprintf(path, sizeof(path), "%s/layout", dir);
+    unlink(path);
+    fd = bpf_map_create(BPF_MAP_TYPE_ARRAY, "nfs_pin_layout", sizeof(zero),
+                        sizeof(version), 1, NULL);
+    if (fd < 0)
+        return -errno;
+    if (bpf_map_update_elem(fd, &zero, &version, BPF_ANY) || bpf_obj_pin(fd, path))
+        err = -errno;
+    close(fd);
+    return err;
+}
+
+/* After a warm start: relearn the handles the kernel knows and recheck
+ * every cached file, since the export may have changed while we were
+ * down. Changed files are cached again, vanished ones dropped. */
+static void pin_maps_revalidate(struct nfs_server_bpf *skel)
+{
+    static struct nfs_file_cache_entry entry;
+    int cache_fd = bpf_map__fd(skel->maps.nfs_file_cache);
+    int fh_fd = bpf_map__fd(skel->maps.fh_to_name);
+    __u32 cap = bpf_map__max_entries(skel->maps.nfs_file_cache);
+    char (*stale)[MAX_FILENAME_LEN];
+    char name[MAX_FILENAME_LEN], key[MAX_FILENAME_LEN];
+    struct nfs_fh fh, *prev_fh = NULL;
+    int n_stale = 0, kept = 0, recached = 0;
+    void *prev = NULL;
+
+    while (!bpf_map_get_next_key(fh_fd, prev_fh, &fh)) {
+        if (!bpf_map_lookup_elem(fh_fd, &fh, name))
+            fh_table_insert(&fh, name);
+        prev_fh = &fh;
+    }
+
+    stale = calloc(cap, sizeof(*stale));
+    if (!stale)
+        return;
+    while (n_stale < cap && !bpf_map_get_next_key(cache_fd, prev, key)) {
+        char filepath[PATH_MAX];
+        struct stat st;
+
+        prev = key;
+        if (bpf_map_lookup_elem(cache_fd, key, &entry))
+            continue;
+        nfs_full_path(key, filepath, sizeof(filepath));
+        if (env.enable_kernel_cache && !stat(filepath, &st) && st.st_ino == entry.attr.fileid &&
+            st.st_size == entry.attr.size &&
+            st.st_mtim.tv_sec == entry.attr.mtime_sec &&
+            st.st_mtim.tv_nsec == entry.attr.mtime_nsec &&
+            st.st_ctim.tv_sec == entry.attr.ctime_sec &&
+            st.st_ctim.tv_nsec == entry.attr.ctime_nsec)
+            kept++;
+        else
+            memcpy(stale[n_stale++], key, MAX_FILENAME_LEN);
+    }
+
+    for (int i = 0; i < n_stale; i++) {
+        cache_evict(stale[i]);
+        if (env.enable_kernel_cache && !cache_file_in_kernel(skel, stale[i]))
+            recached++;
+    }
+    free(stale);
+    printf("Warm cache: %d file(s) still valid, %d refreshed, %d dropped\n",
+           kept, recached, n_stale - recached);
+}
+
+/* Attach a fast-path program through a bpf_link. With -P the link is
+ * pinned as @dir/@name and outlives us: after the old server stops, its
+ * programs keep answering from the pinned cache until the next start
+ * swaps its own in atomically, so kernel hits never fall off the fast
+ * path across an upgrade. The upgrade is stop-then-start; both servers
+ * cannot hold the port at once. A swapped link's previous program is
+ * returned in @old_prog (-1 otherwise) for fastpath_abort(). */
+static struct bpf_link *fastpath_attach(struct bpf_program *prog, const char *dir,
+                                        const char *name, int ifindex, int *old_prog)
+{
+    char path[PATH_MAX];
+    struct bpf_link *link;
+    int err;
+
+    *old_prog = -1;
+    if (dir) {
+        snprintf(path, sizeof(path), "%s/%s", dir, name);
+        link = bpf_link__open(path);
+        if (link) {
+            struct bpf_link_info info = {};
+            __u32 len = sizeof(info);
+
+            /* Only reuse it if it is hooked where we want to be */
+            err = bpf_link_get_info_by_fd(bpf_link__fd(link), &info, &len);
+            if (!err && (bpf_program__type(prog) == BPF_PROG_TYPE_XDP ?
+                         info.xdp.ifindex : info.tcx.ifindex) == ifindex) {
+                *old_prog = bpf_prog_get_fd_by_id(info.prog_id);
+                if (!bpf_link__update_program(link, prog))
+                    return link;
+                if (*old_prog >= 0)
+                    close(*old_prog);
+                *old_prog = -1;
+            }
+            bpf_link__unpin(link);
+            bpf_link__destroy(link);
+        }
+    }
+
+    if (bpf_program__type(prog) == BPF_PROG_TYPE_XDP)
+        link = bpf_program__attach_xdp(prog, ifindex);
+    else
+        link = bpf_program__attach_tcx(prog, ifindex, NULL);
+    if (!link)
+        return NULL;
+    if (dir && bpf_link__pin(link, path)) {
+        err = -errno;
+        bpf_link__destroy(link);
+        errno = -err;
+        return NULL;
+    }
+    return link;
+}
+
+/* Undo fastpath_attach() for a start that failed: a link taken over
+ * from a predecessor gets its program back, one we created is unpinned
+ * so it goes away with us */
+static void fastpath_abort(struct bpf_link *link, int old_prog)
+{
+    if (!link)
+        return;
+    if (old_prog >= 0)
+        bpf_link_update(bpf_link__fd(link), old_prog, NULL);
+    else
+        bpf_link__unpin(link);
+}
+
+/* Detach a pinned fast-path link this start does not want any more */
+static void fastpath_unpin(const char *dir, const char *name)
+{
+    char path[PATH_MAX];
+    struct bpf_link *link;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    link = bpf_link__open(path);
+    if (!link)
+        return;
+    bpf_link__unpin(link);
+    bpf_link__destroy(link);
+}
+
+/* Cache snapshot (-C): the hot set as it stood at the last write, so a
+ * reboot does not start cold. Only references are kept; file data is
+ * read again from the export on restore. */
+#define NFS_SNAP_MAGIC 0x4e465343    /* "NFSC" */
+#define NFS_SNAP_VERSION 1
+#define NFS_SNAP_INTERVAL 60         /* Seconds between periodic snapshots */
+#define NFS_SNAP_MAX_THREADS 8
+
+struct nfs_snap_header {
+    __u32 magic;
+    __u32 version;
+    __u32 record_size;
+    __u32 count;
+};
+
+/* Records are sorted hottest first */
+struct nfs_snap_record {
+    char filename[MAX_FILENAME_LEN];
+    struct nfs_fh fh;
+    struct nfs_fattr attr;      /* As cached, to revalidate against */
+    __u32 data_size;            /* Bytes of the file held in the cache */
+    __u32 cache_hits;
+};
+
+static int snap_record_cmp(const void *a, const void *b)
+{
+    const struct nfs_snap_record *ra = a, *rb = b;
+
+    return ra->cache_hits < rb->cache_hits ? 1 : ra->cache_hits > rb->cache_hits ? -1 : 0;
+}
+
+/* Write the kernel cache to @path, replacing it atomically */
+static int snapshot_write(const char *path)
+{
+    static struct nfs_file_cache_entry entry;
+    int cache_fd = bpf_map__fd(skel->maps.nfs_file_cache);
+    __u32 cap = bpf_map__max_entries(skel->maps.nfs_file_cache);
+    struct nfs_snap_header hdr = {
+        .magic = NFS_SNAP_MAGIC,
+        .version = NFS_SNAP_VERSION,
+        .record_size = sizeof(struct nfs_snap_record),
+    };
+    struct nfs_snap_record *recs;
+    char key[MAX_FILENAME_LEN], tmp[PATH_MAX];
+    void *prev = NULL;
+    FILE *f;
+    int err = 0;
+
+    recs = calloc(cap, sizeof(*recs));
+    if (!recs)
+        return -ENOMEM;
+    while (hdr.count < cap && !bpf_map_get_next_key(cache_fd, prev, key)) {
+        struct nfs_snap_record *r = &recs[hdr.count];
+
+        prev = key;
+        if (bpf_map_lookup_elem(cache_fd, key, &entry) || !entry.valid)
+            continue;
+        memcpy(r->filename, key, MAX_FILENAME_LEN);
+        r->fh = entry.fh;
+        r->attr = entry.attr;
+        r->data_size = entry.data_size;
+        r->cache_hits = entry.cache_hits;
+        hdr.count++;
+    }
+    qsort(recs, hdr.count, sizeof(*recs), snap_record_cmp);
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    f = fopen(tmp, "w");
+    if (!f) {
+        err = -errno;
+        goto out;
+    }
+    if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+        fwrite(recs, sizeof(*recs), hdr.count, f) != hdr.count ||
+        fflush(f) || fsync(fileno(f)))
+        err = -errno ?: -EIO;
+    if (fclose(f) && !err)
+        err = -errno;
+    if (!err && rename(tmp, path))
+        err = -errno;
+    if (err)
+        unlink(tmp);
+out:
+    free(recs);
+    return err;
+}
+
+static void snapshot_tick(const char *path)
+{
+    static uint64_t last;
+    uint64_t now = now_ns();
+    int err;
+
+    if (!last)
+        last = now;
+    if (now - last < NFS_SNAP_INTERVAL * 1000000000ULL)
+        return;
+    last = now;
+    err = snapshot_write(path);
+    if (err)
+        fprintf(stderr, "Failed to write cache snapshot %s: %s\n", path, strerror(-err));
+}
+
+struct snap_restore_ctx {
+    const struct nfs_snap_record *recs;
+    struct nfs_file_cache_entry *entries;
+    __u32 *data_off;
+    bool *valid;
+    int n, stride;
+};
+
+struct snap_restore_worker {
+    struct snap_restore_ctx *ctx;
+    int first;
+};
+
+/* statx every record in this worker's stripe; those unchanged since the
+ * snapshot are read back into the arena chunk set aside for them */
+static void *snapshot_restore_worker(void *arg)
+{
+    struct snap_restore_worker *w = arg;
+    struct snap_restore_ctx *ctx = w->ctx;
+
+    for (int i = w->first; i < ctx->n; i += ctx->stride) {
+        const struct nfs_snap_record *r = &ctx->recs[i];
+        struct nfs_file_cache_entry *e = &ctx->entries[i];
+        char filepath[PATH_MAX];
+        struct statx stx;
+
+        nfs_full_path(r->filename, filepath, sizeof(filepath));
+        if (statx(AT_FDCWD, filepath, 0, STATX_BASIC_STATS, &stx) ||
+            stx.stx_ino != r->attr.fileid || stx.stx_size != r->attr.size ||
+            stx.stx_mtime.tv_sec != r->attr.mtime_sec ||
+            stx.stx_mtime.tv_nsec != r->attr.mtime_nsec ||
+            stx.stx_ctime.tv_sec != r->attr.ctime_sec ||
+            stx.stx_ctime.tv_nsec != r->attr.ctime_nsec)
+            continue;
+        /* The file may change between statx and the read */
+        if (!ctx->data_off[i] ||
+            cache_entry_build(r->filename, e, arena_base + ctx->data_off[i], r->data_size) ||
+            e->attr.mtime_sec != r->attr.mtime_sec ||
+            e->attr.mtime_nsec != r->attr.mtime_nsec || e->attr.size != r->attr.size)
+            continue;
+        e->data_off = ctx->data_off[i];
+        e->cache_hits = r->cache_hits;
+        ctx->valid[i] = true;
+    }
+    return NULL;
+}
+
+/* Map the snapshot at @path, revalidate its entries in parallel and
+ * bulk-load the survivors into the kernel cache */
+static int snapshot_restore(struct nfs_server_bpf *skel, const char *path)
+{
+    int cache_fd = bpf_map__fd(skel->maps.nfs_file_cache);
+    int fh_fd = bpf_map__fd(skel->maps.fh_to_name);
+    __u32 cap = bpf_map__max_entries(skel->maps.nfs_file_cache);
+    struct snap_restore_worker workers[NFS_SNAP_MAX_THREADS];
+    pthread_t tids[NFS_SNAP_MAX_THREADS];
+    struct snap_restore_ctx ctx = {};
+    const struct nfs_snap_header *hdr;
+    char (*names)[MAX_FILENAME_LEN] = NULL;
+    struct nfs_fh *fhs = NULL;
+    uint64_t start = now_ns();
+    struct stat st;
+    void *mem;
+    __u32 n = 0;
+    int fd, err = 0;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return errno == ENOENT ? 0 : -errno;
+    if (fstat(fd, &st) || st.st_size < sizeof(*hdr)) {
+        close(fd);
+        return -EINVAL;
+    }
+    mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED)
+        return -errno;
+
+    hdr = mem;
+    if (hdr->magic != NFS_SNAP_MAGIC || hdr->version != NFS_SNAP_VERSION ||
+        hdr->record_size != sizeof(struct nfs_snap_record) ||
+        hdr->count > (st.st_size - sizeof(*hdr)) / sizeof(struct nfs_snap_record)) {
+        err = -EINVAL;
+        goto out;
+    }
+
+    ctx.recs = (const struct nfs_snap_record *)(hdr + 1);
+    ctx.n = hdr->count < cap ? hdr->count : cap;
+    ctx.stride = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ctx.stride > NFS_SNAP_MAX_THREADS)
+        ctx.stride = NFS_SNAP_MAX_THREADS;
+    if (ctx.stride > ctx.n)
+        ctx.stride = ctx.n;
+    ctx.entries = calloc(ctx.n, sizeof(*ctx.entries));
+    ctx.data_off = calloc(ctx.n, sizeof(*ctx.data_off));
+    ctx.valid = calloc(ctx.n, sizeof(*ctx.valid));
+    names = calloc(ctx.n, sizeof(*names));
+    fhs = calloc(ctx.n, sizeof(*fhs));
+    if (ctx.n && (!ctx.entries || !ctx.data_off || !ctx.valid || !names || !fhs)) {
+        err = -ENOMEM;
+        goto out;
+    }
+    
+    /* The allocator is not thread safe: set the chunks aside up front */
+    for (int i = 0; i < ctx.n; i++) {
+        if (ctx.recs[i].data_size <= MAX_NFS_DATA_SIZE)
+            ctx.data_off[i] = arena_alloc(ctx.recs[i].data_size);
+    }
+
+    for (int i = 0; i < ctx.stride; i++) {
+        workers[i] = (struct snap_restore_worker){ .ctx = &ctx, .first = i };
+        if (pthread_create(&tids[i], NULL, snapshot_restore_worker, &workers[i])) {
+            /* Finish this stripe here rather than lose it */
+            snapshot_restore_worker(&workers[i]);
+            tids[i] = 0;
+        }
+    }
+    for (int i = 0; i < ctx.stride; i++) {
+        if (tids[i])
+            pthread_join(tids[i], NULL);
+    }
+
+    /* Pack the survivors, hottest first, for the batch updates */
+    for (int i = 0; i < ctx.n; i++) {
+        if (!ctx.valid[i]) {
+            if (ctx.data_off[i])
+                arena_release(ctx.data_off[i], ctx.recs[i].data_size);
+            continue;
+        }
+        if (n != i)
+            ctx.entries[n] = ctx.entries[i];
+        memcpy(names[n], ctx.entries[n].filename, MAX_FILENAME_LEN);
+        fhs[n] = ctx.entries[n].fh;
+        fh_table_insert(&fhs[n], names[n]);
+        n++;
+    }
+
+    if (n) {
+        __u32 count = n;
+
+        if (bpf_map_update_batch(cache_fd, names, ctx.entries, &count, NULL) ||
+            (count = n, bpf_map_update_batch(fh_fd, fhs, names, &count, NULL))) {
+            /* No batch support: one element at a time */
+            for (__u32 i = 0; i < n; i++) {
+                bpf_map_update_elem(cache_fd, names[i], &ctx.entries[i], BPF_ANY);
+                bpf_map_update_elem(fh_fd, &fhs[i], names[i], BPF_ANY);
+            }
+        }
+    }
+    printf("Cache snapshot: restored %u of %u file(s) from %s in %.1f ms\n",
+           n, hdr->count, path, (now_ns() - start) / 1e6);
+out:
+    free(fhs);
+    free(names);
+    free(ctx.valid);
+    free(ctx.data_off);
+    free(ctx.entries);
+    munmap(mem, st.st_size);
+    return err;
+}
+
+/* Run interface ioctl @req for @ifname */
+static int if_ioctl(const char *ifname, unsigned long req, struct ifreq *ifr)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM, 0), err = 0;
+
+    if (fd < 0)
+        return -errno;
+    snprintf(ifr->ifr_name, sizeof(ifr->ifr_name), "%s", ifname);
+    if (ioctl(fd, req, ifr) < 0)
+        err = -errno;
+    close(fd);
+    return err;
+}
+
+/* MTU of @ifname, 0 if unknown */
+static int if_mtu(const char *ifname)
+{
+    struct ifreq ifr = {0};
+
+    return if_ioctl(ifname, SIOCGIFMTU, &ifr) ? 0 : ifr.ifr_mtu;
+}
+
+/* AF_XDP (-X): one socket per RX queue, each with its own UMEM. The
+ * first half of the frames cycles through the fill and RX rings with
+ * calls, the second through the TX and completion rings with replies. */
+#define XSK_FRAME_SIZE 4096
+#define XSK_NUM_FRAMES 2048
+#define XSK_RING_SIZE (XSK_NUM_FRAMES / 2)
+
+/* Room in front of a reply for its Ethernet, VLAN, IP and UDP headers */
+#define XSK_REPLY_HEADROOM 128
+
+#define XSK_NO_FRAME UINT64_MAX
+
+/* A single-producer, single-consumer ring shared with the kernel */
+struct xsk_ring {
+    __u32 *producer;
+    __u32 *consumer;
+    __u32 *flags;
+    void *descs;
+    __u32 mask;
+    void *map;
+    size_t map_len;
+};
+
+struct nfs_xsk {
+    int fd;
+    __u32 queue;
+    bool zerocopy;
+    bool kick;                      /* Replies queued since the last wakeup */
+    __u8 *umem;
+    struct xsk_ring fill, comp, rx, tx;
+    __u64 free[XSK_NUM_FRAMES / 2]; /* Reply frames not in flight */
+    __u32 n_free;
+    __u64 spare;                    /* Reply frame taken but not sent, or XSK_NO_FRAME */
+};
+
+static struct nfs_xsk *xsks;
+static int n_xsks;
+
+/* Largest reply sent from a frame: the MTU less IPv6 and UDP headers.
+ * Bigger ones need IP fragmentation and take the UDP socket. */
+static uint32_t xsk_payload_max;
+
+static __u32 ring_load(const __u32 *p)
+{
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static void ring_store(__u32 *p, __u32 val)
+{
+    __atomic_store_n(p, val, __ATOMIC_RELEASE);
+}
+
+/* Take back the reply frames the kernel is done sending */
+static void xsk_reap(struct nfs_xsk *xsk)
+{
+    __u32 cons = *xsk->comp.consumer, prod = ring_load(xsk->comp.producer);
+    __u64 *addrs = xsk->comp.descs;
+
+    for (; cons != prod; cons++)
+        xsk->free[xsk->n_free++] = addrs[cons & xsk->comp.mask] & ~(__u64)(XSK_FRAME_SIZE - 1);
+    ring_store(xsk->comp.consumer, cons);
+}
+
+/* Where @xprt's reply of @len bytes goes in its frame, or NULL if the
+ * call did not come over AF_XDP or the reply needs the UDP socket. The
+ * frame stays reserved until a reply is sent from it. */
+static __u8 *xsk_reply_frame(const struct nfs_xprt *xprt, uint32_t len)
+{
+    struct nfs_xsk *xsk = xprt->xsk;
+
+    if (!xsk || len > xsk_payload_max)
+        return NULL;
+    if (xsk->spare == XSK_NO_FRAME) {
+        if (!xsk->n_free)
+            xsk_reap(xsk);
+        if (!xsk->n_free)
+            return NULL;
+        xsk->spare = xsk->free[--xsk->n_free];
+    }
+    return xsk->umem + xsk->spare + XSK_REPLY_HEADROOM;
+}
+
+/* One's complement sum of @len bytes in network order */
+static uint32_t csum_add(uint32_t sum, const void *buf, size_t len)
+{
+    const __u8 *p = buf;
+
+    for (; len > 1; p += 2, len -= 2)
+        sum += (p[0] << 8) | p[1];
+    if (len)
+        sum += p[0] << 8;
+    return sum;
+}
+
+static __u16 csum_fold(uint32_t sum)
+{
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return htons(~sum & 0xffff);
+}
+
+/* Send @xprt's reply from a TX frame, building the headers in front of
+ * it; the payload is copied in unless it was encoded there. Returns -1
+ * if it has to take the UDP socket instead. */
+static int xsk_send_reply(const struct nfs_xprt *xprt, const void *reply, size_t len)
+{
+    const struct nfs_xsk_route *rt = &xprt->route;
+    struct nfs_xsk *xsk = xprt->xsk;
+    __u8 *payload = xsk_reply_frame(xprt, len), *frame;
+    uint32_t hdr_len = rt->l2_len + sizeof(struct udphdr) +
+                       (rt->ipv6 ? sizeof(struct ip6_hdr) : sizeof(struct iphdr));
+    struct xdp_desc *desc;
+    struct udphdr *udp;
+    uint32_t sum;
+    __u32 prod;
+
+    if (!payload)
+        return -1;
+    if (payload != reply)
+        memcpy(payload, reply, len);
+
+    frame = payload - hdr_len;
+    memcpy(frame, rt->l2, rt->l2_len);
+    udp = (struct udphdr *)(payload - sizeof(*udp));
+    udp->source = rt->local_port;
+    udp->dest = xprt->addr.sin6_port;
+    udp->len = htons(sizeof(*udp) + len);
+    udp->check = 0;
+
+    if (rt->ipv6) {
+        struct ip6_hdr *ip6 = (struct ip6_hdr *)(frame + rt->l2_len);
+
+        ip6->ip6_flow = htonl(6 << 28);
+        ip6->ip6_plen = udp->len;
+        ip6->ip6_nxt = IPPROTO_UDP;
+        ip6->ip6_hlim = 64;
+        ip6->ip6_src = rt->local;
+        ip6->ip6_dst = xprt->addr.sin6_addr;
+
+        /* Mandatory over IPv6: pseudo-header, UDP header and payload */
+        sum = csum_add(IPPROTO_UDP + sizeof(*udp) + len, &ip6->ip6_src, 32);
+        udp->check = csum_fold(csum_add(sum, udp, sizeof(*udp) + len)) ?: 0xffff;
+    } else {
+        struct iphdr *ip = (struct iphdr *)(frame + rt->l2_len);
+
+        memset(ip, 0, sizeof(*ip));
+        ip->version = 4;
+        ip->ihl = 5;
+        ip->tot_len = htons(sizeof(*ip) + sizeof(*udp) + len);
+        ip->frag_off = htons(IP_DF);
+        ip->ttl = 64;
+        ip->protocol = IPPROTO_UDP;
+        ip->saddr = rt->local.s6_addr32[3];
+        ip->daddr = xprt->addr.sin6_addr.s6_addr32[3];
+        ip->check = csum_fold(csum_add(0, ip, sizeof(*ip)));
+    }
+
+    prod = *xsk->tx.producer;
+    desc = &((struct xdp_desc *)xsk->tx.descs)[prod & xsk->tx.mask];
+    desc->addr = frame - xsk->umem;
+    desc->len = hdr_len + len;
+    desc->options = 0;
+    ring_store(xsk->tx.producer, prod + 1);
+
+    xsk->spare = XSK_NO_FRAME;
+    xsk->kick = true;
+    stats.xsk_replies++;
+    return 0;
+}
+
+/* Wake the kernel for the replies put on TX rings this round. Copy mode
+ * transmits in the syscall; zero-copy only when the driver asks. */
+static void xsk_flush(void)
+{
+    for (int i = 0; i < n_xsks; i++) {
+        struct nfs_xsk *xsk = &xsks[i];
+
+        if (!xsk->kick)
+            continue;
+        xsk->kick = false;
+        if (!xsk->zerocopy || (ring_load(xsk->tx.flags) & XDP_RING_NEED_WAKEUP))
+            sendto(xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+        xsk_reap(xsk);
+    }
+}
+
+static int xsk_ring_map(struct nfs_xsk *xsk, struct xsk_ring *ring,
+                        const struct xdp_ring_offset *off, size_t desc_size, off_t pgoff)
+{
+    ring->map_len = off->desc + XSK_RING_SIZE * desc_size;
+    ring->map = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     xsk->fd, pgoff);
+    if (ring->map == MAP_FAILED) {
+        ring->map = NULL;
+        return -errno;
+    }
+    ring->producer = (__u32 *)((char *)ring->map + off->producer);
+    ring->consumer = (__u32 *)((char *)ring->map + off->consumer);
+    ring->flags = (__u32 *)((char *)ring->map + off->flags);
+    ring->descs = (char *)ring->map + off->desc;
+    ring->mask = XSK_RING_SIZE - 1;
+    return 0;
+}
+
+/* Open the AF_XDP socket for RX queue @queue of @ifindex, zero-copy if
+ * the driver supports it, and enter it in nfs_xsks under @map_fd */
+static int xsk_open(struct nfs_xsk *xsk, int ifindex, __u32 queue, int map_fd)
+{
+    struct xdp_umem_reg reg = {
+        .len = (__u64)XSK_NUM_FRAMES * XSK_FRAME_SIZE,
+        .chunk_size = XSK_FRAME_SIZE,
+    };
+    struct sockaddr_xdp sxdp = {
+        .sxdp_family = AF_XDP,
+        .sxdp_ifindex = ifindex,
+        .sxdp_queue_id = queue,
+        .sxdp_flags = XDP_ZEROCOPY | XDP_USE_NEED_WAKEUP,
+    };
+    struct xdp_mmap_offsets off;
+    socklen_t optlen = sizeof(off);
+    int ring_size = XSK_RING_SIZE, err;
+    __u64 *fill;
+
+    memset(xsk, 0, sizeof(*xsk));
+    xsk->queue = queue;
+    xsk->spare = XSK_NO_FRAME;
+    xsk->fd = socket(AF_XDP, SOCK_RAW, 0);
+    if (xsk->fd < 0)
+        return -errno;
+
+    xsk->umem = mmap(NULL, reg.len, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (xsk->umem == MAP_FAILED) {
+        xsk->umem = NULL;
+        return -errno;
+    }
+    reg.addr = (__u64)(uintptr_t)xsk->umem;
+
+    if (setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) < 0 ||
+        setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_FILL_RING, &ring_size, sizeof(ring_size)) < 0 ||
+        setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &ring_size, sizeof(ring_size)) < 0 ||
+        setsockopt(xsk->fd, SOL_XDP, XDP_RX_RING, &ring_size, sizeof(ring_size)) < 0 ||
+        setsockopt(xsk->fd, SOL_XDP, XDP_TX_RING, &ring_size, sizeof(ring_size)) < 0 ||
+        getsockopt(xsk->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen) < 0)
+        return -errno;
+
+    err = xsk_ring_map(xsk, &xsk->fill, &off.fr, sizeof(__u64), XDP_UMEM_PGOFF_FILL_RING);
+    if (!err)
+        err = xsk_ring_map(xsk, &xsk->comp, &off.cr, sizeof(__u64),
+                           XDP_UMEM_PGOFF_COMPLETION_RING);
+    if (!err)
+        err = xsk_ring_map(xsk, &xsk->rx, &off.rx, sizeof(struct xdp_desc), XDP_PGOFF_RX_RING);
+    if (!err)
+        err = xsk_ring_map(xsk, &xsk->tx, &off.tx, sizeof(struct xdp_desc), XDP_PGOFF_TX_RING);
+    if (err)
+        return err;
+
+    fill = xsk->fill.descs;
+    for (__u32 i = 0; i < XSK_RING_SIZE; i++)
+        fill[i] = (__u64)i * XSK_FRAME_SIZE;
+    ring_store(xsk->fill.producer, XSK_RING_SIZE);
+    for (__u32 i = 0; i < XSK_NUM_FRAMES / 2; i++)
+        xsk->free[xsk->n_free++] = (__u64)(XSK_RING_SIZE + i) * XSK_FRAME_SIZE;
+
+    xsk->zerocopy = true;
+    if (bind(xsk->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) < 0) {
+        sxdp.sxdp_flags = XDP_COPY | XDP_USE_NEED_WAKEUP;
+        xsk->zerocopy = false;
+        if (bind(xsk->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) < 0)
+            return -errno;
+    }
+
+    if (bpf_map_update_elem(map_fd, &queue, &xsk->fd, BPF_ANY))
+        return -errno;
+    return 0;
+}
+
+static void xsk_close(struct nfs_xsk *xsk)
+{
+    struct xsk_ring *rings[] = { &xsk->fill, &xsk->comp, &xsk->rx, &xsk->tx };
+
+    for (int i = 0; i < 4; i++) {
+        if (rings[i]->map)
+            munmap(rings[i]->map, rings[i]->map_len);
+    }
+    if (xsk->fd >= 0)
+        close(xsk->fd);
+    if (xsk->umem)
+        munmap(xsk->umem, (size_t)XSK_NUM_FRAMES * XSK_FRAME_SIZE);
+}
+
+/* Open an AF_XDP socket on each RX queue of @ifname, as many as ethtool
+ * reports channels (one without ethtool support) */
+static int xsk_setup(struct nfs_server_bpf *skel, const char *ifname, int ifindex)
+{
+    struct ethtool_channels ch = { .cmd = ETHTOOL_GCHANNELS };
+    struct ifreq ifr = { .ifr_data = (void *)&ch };
+    int map_fd = bpf_map__fd(skel->maps.nfs_xsks);
+    int mtu = if_mtu(ifname), n = 1, err;
+
+    if (!if_ioctl(ifname, SIOCETHTOOL, &ifr) && ch.combined_count + ch.rx_count > 0)
+        n = ch.combined_count + ch.rx_count;
+    if (n > NFS_XSK_MAX_QUEUES)
+        n = NFS_XSK_MAX_QUEUES;
+
+    xsk_payload_max = XSK_FRAME_SIZE - XSK_REPLY_HEADROOM;
+    if (mtu > 40 + 8 && (uint32_t)mtu - 40 - 8 < xsk_payload_max)
+        xsk_payload_max = mtu - 40 - 8;
+
+    xsks = calloc(n, sizeof(*xsks));
+    if (!xsks)
+        return -ENOMEM;
+    for (int q = 0; q < n; q++) {
+        err = xsk_open(&xsks[q], ifindex, q, map_fd);
+        if (err) {
+            xsk_close(&xsks[q]);
+            return err;
+        }
+        n_xsks++;
+    }
+    return 0;
+}
+
+/* Point the cpumap at the cores given with -R and list them in
+ * nfs_steer_cpus. Each entry runs nfs_server_xdp_cpu on its core; if
+ * the kernel refuses the program on an entry, the entries go in bare and
+ * the XDP stage stays on the RX core. */
+static int steer_setup(struct nfs_server_bpf *skel)
+{
+    struct bpf_cpumap_val val = {
+        .qsize = 2048,
+        .bpf_prog.fd = bpf_program__fd(skel->progs.nfs_server_xdp_cpu),
+    };
+    int cpumap_fd = bpf_map__fd(skel->maps.nfs_cpumap);
+    int cpus_fd = bpf_map__fd(skel->maps.nfs_steer_cpus);
+    int ncpus = libbpf_num_possible_cpus();
+
+    for (__u32 i = 0; i < (__u32)env.n_steer; i++) {
+        __u32 cpu = env.steer_cpus[i];
+
+        if (ncpus > 0 && cpu >= (__u32)ncpus)
+            return -EINVAL;
+        if (bpf_map_update_elem(cpumap_fd, &cpu, &val, BPF_ANY)) {
+            /* All or none of the entries run the program */
+            if (!val.bpf_prog.fd || i)
+                return -errno;
+            val.bpf_prog.fd = 0;
+            if (bpf_map_update_elem(cpumap_fd, &cpu, &val, BPF_ANY))
+                return -errno;
+        }
+        if (bpf_map_update_elem(cpus_fd, &i, &cpu, BPF_ANY))
+            return -errno;
+    }
+    skel->data->nfs_config.steer_remote = val.bpf_prog.fd != 0;
+    skel->data->nfs_config.steer_cpus = env.n_steer;
+    return 0;
+}
+
+/* A UDP reply waiting in udp_tx_buf */
+struct nfs_udp_tx {
+    struct sockaddr_in6 addr;
+    int sock;
+    uint32_t off;
+    uint32_t len;
+};
+
+static struct nfs_udp_tx udp_tx[UDP_TX_QUEUE];
+static unsigned int n_udp_tx;
+static uint32_t udp_tx_used;
+static __u8 udp_tx_buf[UDP_TX_BUF_SIZE];
+
+/* Largest reply sent as a GSO segment: the interface MTU less IPv6 and
+ * UDP headers. 0 without UDP_SEGMENT, or once the kernel refused it. */
+static uint32_t udp_gso_size;
+
+static bool udp_same_peer(const struct nfs_udp_tx *a, const struct nfs_udp_tx *b)
+{
+    return a->sock == b->sock && a->addr.sin6_port == b->addr.sin6_port &&
+           !memcmp(&a->addr.sin6_addr, &b->addr.sin6_addr, sizeof(a->addr.sin6_addr));
+}
+
+/* Send @n queued replies starting at @first, contiguous in udp_tx_buf,
+ * as one datagram per @first->len bytes */
+static int udp_send_gso(const struct nfs_udp_tx *first, unsigned int n, size_t total)
+{
+    char control[CMSG_SPACE(sizeof(uint16_t))] = {0};
+    uint16_t gso_size = first->len;
+    struct iovec iov = { .iov_base = udp_tx_buf + first->off, .iov_len = total };
+    struct msghdr msg = {
+        .msg_name = (void *)&first->addr,
+        .msg_namelen = sizeof(first->addr),
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+    };
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+
+    cm->cmsg_level = SOL_UDP;
+    cm->cmsg_type = UDP_SEGMENT;
+    cm->cmsg_len = CMSG_LEN(sizeof(gso_size));
+    memcpy(CMSG_DATA(cm), &gso_size, sizeof(gso_size));
+
+    if (sendmsg(first->sock, &msg, 0) < 0)
+        return -errno;
+    stats.gso_sends++;
+    stats.gso_replies += n;
+    return 0;
+}
+
+/* Send the queued UDP replies. A run to one client of same-size replies,
+ * the last possibly shorter, goes out in one sendmsg that the NIC or
+ * the stack cuts back into datagrams; everything else one by one. */
+static void udp_tx_flush(void)
+{
+    unsigned int i = 0;
+
+    while (i < n_udp_tx) {
+        struct nfs_udp_tx *first = &udp_tx[i];
+        size_t total = first->len;
+        unsigned int n = 1;
+
+        if (first->len <= udp_gso_size) {
+            while (i + n < n_udp_tx && n < UDP_GSO_MAX_SEGS) {
+                struct nfs_udp_tx *t = &udp_tx[i + n];
+
+                if (!udp_same_peer(first, t) || t->len > first->len ||
+                    total + t->len > UDP_GSO_MAX_BYTES)
+                    break;
+                total += t->len;
+                n++;
+                if (t->len < first->len)
+                    break;
+            }
+        }
+
+        if (n > 1) {
+            int err = udp_send_gso(first, n, total);
+
+            if (!err) {
+                i += n;
+                continue;
+            }
+            /* No segmentation offload behind this route or device;
+             * the kernel says so the same way every time */
+            if (err == -EIO || err == -EINVAL || err == -ENOPROTOOPT) {
+                fprintf(stderr, "UDP GSO send failed: %s, sending replies singly\n",
+                        strerror(-err));
+                udp_gso_size = 0;
+            }
+        }
+
+        for (unsigned int j = i; j < i + n; j++)
+            sendto(udp_tx[j].sock, udp_tx_buf + udp_tx[j].off, udp_tx[j].len, 0,
+                   (struct sockaddr *)&udp_tx[j].addr, sizeof(udp_tx[j].addr));
+        i += n;
+    }
+
+    n_udp_tx = 0;
+    udp_tx_used = 0;
+}
+
+/* glibc's struct tcp_info ends before the kernel's byte counters */
+struct tcp_info_bytes {
+    struct tcp_info info;
+    __u64 tcpi_pacing_rate;
+    __u64 tcpi_max_pacing_rate;
+    __u64 tcpi_bytes_acked;
+};
+
+/* Bytes ever handed to TCP on a socket: acked plus still queued */
+static int tcp_send_pos(int fd, __u64 *pos)
+{
+    struct tcp_info_bytes ti;
+    socklen_t len = sizeof(ti);
+    int outq;
+
+    memset(&ti, 0, sizeof(ti));
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len) < 0 ||
+        len < sizeof(ti) || ioctl(fd, SIOCOUTQ, &outq) < 0)
+        return -1;
+    *pos = ti.tcpi_bytes_acked + outq;
+    return 0;
+}
+
+/* The verdict's replies go out later from the psock backlog worker.
+ * Wait until every one it queued ahead of this call is in the TCP send
+ * queue, so a reply written now lands after them and not inside one. */
+static int tcp_wait_kernel_replies(struct nfs_tcp_conn *conn)
+{
+    size_t slot = conn - tcp_conns;
+    uint64_t deadline = 0;
+    __u64 pos, want;
+
+    for (;;) {
+        want = __atomic_load_n(&tcp_order[slot].kernel_bytes, __ATOMIC_ACQUIRE) +
+               conn->user_bytes;
+        if (tcp_send_pos(conn->fd, &pos) < 0)
+            return -1;
+        if (pos - conn->tcp_base >= want)
+            return 0;
+        if (!deadline)
+            deadline = now_ns() + TCP_ORDER_WAIT_NS;
+        else if (now_ns() > deadline)
+            return -1;
+        usleep(20);
+    }
+}
+
+/* Send an encoded RPC reply, adding the record mark on TCP. UDP replies
+ * that could share a GSO send are queued until udp_tx_flush(). */
+static void nfs_send_reply(struct nfs_xprt *xprt, const void *reply, size_t len)
+{
+    struct nfs_udp_tx *t;
+
+    /* AF_XDP replies that do not fit a frame go out on the UDP socket,
+     * where the stack fragments them */
+    if (xprt->xsk) {
+        if (!xsk_send_reply(xprt, reply, len))
+            return;
+        stats.xsk_fallbacks++;
+    }
+
+    if (xprt->is_tcp) {
+        uint32_t mark = htonl(RPC_LAST_FRAG | len);
+        struct iovec iov[2] = {
+            { .iov_base = &mark, .iov_len = sizeof(mark) },
+            { .iov_base = (void *)reply, .iov_len = len },
+        };
+
+        struct nfs_tcp_conn *conn = xprt->conn;
+        ssize_t n;
+
+        /* Closed since the call was read */
+        if (conn && conn->fd != xprt->sock)
+            return;
+        if (conn && conn->fastpath && tcp_wait_kernel_replies(conn) < 0) {
+            /* The stream can no longer be kept in order; the next
+             * read sees the shutdown and closes the connection */
+            fprintf(stderr, "TCP replies to %s stuck, closing\n",
+                    addr_ntoa(&conn->addr.sin6_addr));
+            shutdown(conn->fd, SHUT_RDWR);
+            return;
+        }
+        n = writev(xprt->sock, iov, 2);
+        if (n < 0) {
+            if (env.verbose)
+                fprintf(stderr, "TCP reply failed: %s\n", strerror(errno));
+        } else if (conn) {
+            conn->user_bytes += n;
+        }
+        return;
+    }
+
+    if (len > udp_gso_size) {
+        sendto(xprt->sock, reply, len, 0,
+               (struct sockaddr *)&xprt->addr, sizeof(xprt->addr));
+        return;
+    }
+
+    if (n_udp_tx == UDP_TX_QUEUE || udp_tx_used + len > UDP_TX_BUF_SIZE)
+        udp_tx_flush();
+    t = &udp_tx[n_udp_tx++];
+    t->addr = xprt->addr;
+    t->sock = xprt->sock;
+    t->off = udp_tx_used;
+    t->len = len;
+    memcpy(udp_tx_buf + udp_tx_used, reply, len);
+    udp_tx_used += len;
+}
+
+static void nfs_drc_key_of(const struct nfs_call_ctx *ctx, struct nfs_drc_key *key)
+{
+    memset(key, 0, sizeof(*key));
+    memcpy(&key->client_addr, &ctx->xprt->addr.sin6_addr, sizeof(key->client_addr));
+    key->client_port = ctx->xprt->addr.sin6_port;
+    key->xid = ctx->xid;
+}
+
+/* Find @key's slot, or with @insert the slot to reuse for it */
+static struct nfs_drc_slot *drc_slot(const struct nfs_drc_key *key, bool insert)
+{
+    const __u32 *a = key->client_addr.a32;
+    uint32_t hash = key->xid * 2654435761U ^ a[0] ^ a[1] ^ a[2] ^ a[3] ^ key->client_port;
+    struct nfs_drc_slot *set = drc_cache[hash % DRC_SETS], *victim = &set[0];
+
+    for (int i = 0; i < DRC_WAYS; i++) {
+        if (set[i].len && !memcmp(&set[i].key, key, sizeof(*key)))
+            return &set[i];
+        if (set[i].last_used < victim->last_used)
+            victim = &set[i];
+    }
+    return insert ? victim : NULL;
+}
+
+/* Resend the stored reply if this call is a retransmit of a
+ * non-idempotent one we already executed */
+static bool nfs_drc_replay(struct nfs_call_ctx *ctx)
+{
+    struct nfs_drc_key key;
+    struct nfs_drc_slot *slot;
+
+    if (!nfs3_proc_needs_drc(ctx->proc))
+        return false;
+
+    nfs_drc_key_of(ctx, &key);
+    slot = drc_slot(&key, false);
+    if (!slot || slot->proc != ctx->proc)
+        return false;
+
+    slot->last_used = now_ns();
+    nfs_send_reply(ctx->xprt, slot->reply, slot->len);
+    stats.drc_replays++;
+    return true;
+}
+
+/* Record a sent reply. Non-idempotent ones are kept for replay, here and
+ * in the kernel DRC; one too large to keep has its in-progress marker
+ * dropped so a retransmit is served again. Idempotent calls are never
+ * marked, so they cost no map update. */
+static void nfs_drc_complete(struct nfs_call_ctx *ctx, const void *reply, uint32_t len)
+{
+    int map_fd = bpf_map__fd(skel->maps.nfs_drc);
+    bool keep = len <= NFS_DRC_MAX_REPLY;
+    struct nfs_drc_key key;
+
+    if (!nfs3_proc_needs_drc(ctx->proc))
+        return;
+
+    nfs_drc_key_of(ctx, &key);
+    if (keep) {
+        struct nfs_drc_slot *slot = drc_slot(&key, true);
+
+        slot->key = key;
+        slot->proc = ctx->proc;
+        slot->len = len;
+        slot->last_used = now_ns();
+        memcpy(slot->reply, reply, len);
+    }
+
+    /* Only UDP calls pass the TC program; AF_XDP ones leave at XDP, so
+     * their retransmits come back here and the kernel never marks them */
+    if (ctx->xprt->is_tcp || ctx->xprt->xsk)
+        return;
+
+    if (keep) {
+        struct nfs_drc_entry entry = {
+            .state = NFS_DRC_DONE,
+            .procedure = ctx->proc,
+            .timestamp = now_ns(),
+            .reply_len = len,
+        };
+
+        memcpy(entry.reply, reply, len);
+        bpf_map_update_elem(map_fd, &key, &entry, BPF_ANY);
+    } else {
+        bpf_map_delete_elem(map_fd, &key);
+    }
+}
+
+/* Start an accepted, successful reply with @var_len bytes of variable
+ * data on top of the procedure's fixed size. This is the one length
+ * check for the message. */
+static int nfs_reply_begin(struct nfs_call_ctx *ctx, struct xdr_buf *x, uint32_t var_len)
+{
+    uint32_t need = nfs3_reply_size(ctx->proc, var_len);
+
+    ctx->encode_start = now_ns();
+    /* Over AF_XDP the reply is encoded straight into its frame */
+    ctx->reply = xsk_reply_frame(ctx->xprt, need);
+    if (ctx->reply) {
+        xdr_enc_reserve(x, ctx->reply, need, need);
+    } else {
+        ctx->reply = reply_buf;
+        if (xdr_enc_reserve(x, reply_buf, sizeof(reply_buf), need) < 0)
+            return -1;
+    }
+    xdr_encode_reply_hdr(x, ctx->xid, RPC_SUCCESS);
+    return 0;
+}
+
+/* Account the encoding cost and send the reply */
+static void nfs_reply_send(struct nfs_call_ctx *ctx, struct xdr_buf *x)
+{
+    uint32_t len = xdr_enc_len(x, ctx->reply);
+    struct nfs_proc_stats *ps = &proc_stats[ctx->proc];
+
+    ps->calls++;
+    ps->encode_ns += now_ns() - ctx->encode_start;
+    ps->encode_bytes += len;
+
+    nfs_send_reply(ctx->xprt, ctx->reply, len);
+    nfs_drc_complete(ctx, ctx->reply, len);
+}
+
+/* Reply with an RPC-level error (no NFS result body) */
+static void nfs_reply_rpc_error(struct nfs_call_ctx *ctx, uint32_t accept_stat)
+{
+    struct xdr_buf x;
+
+    xdr_enc_reserve(&x, reply_buf, sizeof(reply_buf), XDR_RPC_REPLY_HDR_SIZE);
+    xdr_encode_reply_hdr(&x, ctx->xid, accept_stat);
+    nfs_send_reply(ctx->xprt, reply_buf, xdr_enc_len(&x, reply_buf));
+    nfs_drc_complete(ctx, reply_buf, xdr_enc_len(&x, reply_buf));
+    stats.errors++;
+}
+
+/* Encode the nfsstat3 of a result and account it */
+static void nfs_encode_status(struct xdr_buf *x, uint32_t status)
+{
+    xdr_encode_u32(x, status);
+    if (status == NFS3_OK)
+        stats.user_processed++;
+    else if (status == NFS3ERR_NOENT)
+        stats.file_not_found++;
+    else if (status == NFS3ERR_ACCES || status == NFS3ERR_PERM)
+        stats.access_denied++;
+    else
+        stats.errors++;
+}
+
+/* Decode a lone nfs_fh3 argument; replies GARBAGE_ARGS on failure */
+static int nfs_decode_fh_args(struct nfs_call_ctx *ctx, struct nfs_fh *fh)
+{
+    xdr_decode_fh3(&ctx->args, fh);
+    if (ctx->args.err) {
+        nfs_reply_rpc_error(ctx, RPC_GARBAGE_ARGS);
+        return -1;
+    }
+    return 0;
+}
+
+/* Record [start, end) as unsynced, merging it with ranges it touches.
+ * Appends keep extending a single range. */
+static void dirty_range_add(struct nfs_open_file *f, uint64_t start, uint64_t end)
+{
+    for (int i = 0; i < f->ndirty; ) {
+        struct nfs_dirty_range *r = &f->dirty[i];
+
+        if (r->end < start || r->start > end) {
+            i++;
+            continue;
+        }
+        if (r->start < start)
+            start = r->start;
+        if (r->end > end)
+            end = r->end;
+        *r = f->dirty[--f->ndirty];
+    }
+
+    /* Out of slots: fold everything into one covering range */
+    if (f->ndirty == MAX_DIRTY_RANGES) {
+        for (int i = 0; i < f->ndirty; i++) {
+            if (f->dirty[i].start < start)
+                start = f->dirty[i].start;
+            if (f->dirty[i].end > end)
+                end = f->dirty[i].end;
+        }
+        f->ndirty = 0;
+    }
+
+    f->dirty[f->ndirty].start = start;
+    f->dirty[f->ndirty].end = end;
+    f->ndirty++;
+}
+
+static bool dirty_range_overlaps(const struct nfs_open_file *f, uint64_t start, uint64_t end)
+{
+    for (int i = 0; i < f->ndirty; i++) {
+        if (f->dirty[i].start < end && f->dirty[i].end > start)
+            return true;
+    }
+    return false;
+}
+
+/* A new write verifier: the current time, so it differs from any
+ * earlier one */
+static void write_verf_new(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    memcpy(write_verf, &now.tv_sec, 4);
+    memcpy(write_verf + 4, &now.tv_nsec, 4);
+}
+
+/* Flush a file's data (and metadata for FILE_SYNC). Returns an errno.
+ * A failed flush changes the write verifier: the kernel clears the
+ * writeback error once reported, so a retry would succeed without the
+ * lost data, and a file evicted meanwhile has no ranges left for a
+ * COMMIT to find. Clients resend whatever they have not committed. */
+static int nfs_file_sync(struct nfs_open_file *f, bool file_sync)
+{
+    if ((file_sync ? fsync(f->fd) : fdatasync(f->fd)) != 0) {
+        int err = errno;
+
+        write_verf_new();
+        return err;
+    }
+    f->ndirty = 0;
+    stats.syncs++;
+    return 0;
+}
+
+static void nfs_file_close(struct nfs_open_file *f)
+{
+    int err = f->ndirty ? nfs_file_sync(f, false) : 0;
+
+    if (err)
+        fprintf(stderr, "Writeback failed on close: %s\n", strerror(err));
+    close(f->fd);
+    f->fd = -1;
+}
+
+static struct nfs_open_file *nfs_file_find(const struct nfs_fh *fh)
+{
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        struct nfs_open_file *f = &open_files[i];
+
+        if (f->fd >= 0 && f->fh.len == fh->len && !memcmp(f->fh.data, fh->data, fh->len))
+            return f;
+    }
+    return NULL;
+}
+
+static void nfs_flush_syncs(void);
+
+/* Get the open file for a handle, opening it and evicting the least
+ * recently used idle file if needed. Sets @status on failure. */
+static struct nfs_open_file *nfs_file_get(const struct nfs_fh *fh, const char *rel,
+                                          const char *path, uint32_t *status)
+{
+    struct nfs_open_file *f = nfs_file_find(fh), *victim = NULL;
+    int fd;
+
+    if (f) {
+        f->last_used = now_ns();
+        return f;
+    }
+
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        f = &open_files[i];
+        if (f->fd < 0) {
+            victim = f;
+            break;
+        }
+        if (!f->sync_queued && (!victim || f->last_used < victim->last_used))
+            victim = f;
+    }
+    if (!victim) {
+        /* Every open file has a reply waiting on it; sync them now */
+        nfs_flush_syncs();
+        return nfs_file_get(fh, rel, path, status);
+    }
+
+    fd = open(path, O_WRONLY);
+    if (fd < 0) {
+        *status = nfs3_errno_stat(errno);
+        return NULL;
+    }
+    if (victim->fd >= 0)
+        nfs_file_close(victim);
+
+    /* Cached data would go stale with the first write */
+    uncache_file_in_kernel(rel);
+
+    memset(victim, 0, sizeof(*victim));
+    victim->fd = fd;
+    victim->fh = *fh;
+    victim->last_used = now_ns();
+    return victim;
+}
+
+/* Hold a stable WRITE or COMMIT reply until the next group sync */
+static void nfs_queue_sync(struct nfs_call_ctx *ctx, struct nfs_open_file *f,
+                           const struct nfs_wcc_attr *before, uint32_t count,
+                           uint32_t committed)
+{
+    struct nfs_pending_sync *p;
+
+    if (n_pending_syncs == MAX_PENDING_SYNCS)
+        nfs_flush_syncs();
+
+    p = &pending_syncs[n_pending_syncs++];
+    p->xprt = *ctx->xprt;
+    p->xid = ctx->xid;
+    p->proc = ctx->proc;
+    p->file = f;
+    p->before = *before;
+    p->count = count;
+    p->committed = committed;
+
+    f->sync_queued = true;
+    if (committed == NFS3_FILE_SYNC)
+        f->file_sync = true;
+}
+
+/* Group commit: sync each file with waiting replies once, however many
+ * clients asked, then answer all of them */
+static void nfs_flush_syncs(void)
+{
+    int n = n_pending_syncs;
+
+    n_pending_syncs = 0;
+    for (int i = 0; i < n; i++) {
+        struct nfs_open_file *f = pending_syncs[i].file;
+
+        if (!f->sync_queued)
+            continue;
+        f->sync_err = nfs_file_sync(f, f->file_sync);
+        f->sync_queued = false;
+        f->file_sync = false;
+    }
+
+    for (int i = 0; i < n; i++) {
+        struct nfs_pending_sync *p = &pending_syncs[i];
+        struct nfs_call_ctx ctx = { .xprt = &p->xprt, .xid = p->xid, .proc = p->proc };
+        struct nfs_wcc_data wcc = { .before_valid = 1, .before = p->before };
+        uint32_t status = nfs3_errno_stat(p->file->sync_err);
+        struct stat st;
+        struct xdr_buf x;
+
+        if (fstat(p->file->fd, &st) == 0) {
+            stat_to_fattr(&st, &wcc.after);
+            wcc.after_valid = 1;
+        }
+
+        nfs_reply_begin(&ctx, &x, 0);
+        nfs_encode_status(&x, status);
+        xdr_encode_wcc_data(&x, &wcc);
+        if (status == NFS3_OK) {
+            if (p->proc == NFSPROC3_WRITE) {
+                xdr_encode_u32(&x, p->count);
+                xdr_encode_u32(&x, p->committed);
+            }
+            xdr_encode_fixed(&x, write_verf, NFS3_WRITEVERFSIZE);
+        }
+        nfs_reply_send(&ctx, &x);
+        stats.sync_waiters++;
+    }
+}
+
+/* Export-relative path of @name inside @dir_rel. ".." of the export
+ * root is the root itself. Returns an nfsstat3. */
+static uint32_t nfs_child_rel(const char *dir_rel, const char *name, char *out, size_t len)
+{
+    if (!strcmp(name, ".")) {
+        snprintf(out, len, "%s", dir_rel);
+    } else if (!strcmp(name, "..")) {
+        const char *slash = strrchr(dir_rel, '/');
+
+        snprintf(out, len, "%.*s", slash ? (int)(slash - dir_rel) : 0, dir_rel);
+    } else if (!name[0] || strchr(name, '/')) {
+        return NFS3ERR_NOENT;
+    } else if (snprintf(out, len, "%s%s%s", dir_rel, dir_rel[0] ? "/" : "", name) >= len) {
+        return NFS3ERR_NAMETOOLONG;
+    }
+    return NFS3_OK;
+}
+
+/* Handle NFS NULL request (ping operation) */
+static void handle_nfs_null(struct nfs_call_ctx *ctx)
+{
+    struct xdr_buf x;
+    
+    /* NULL operation has no arguments and a void result */
+    nfs_reply_begin(ctx, &x, 0);
+    nfs_reply_send(ctx, &x);
+    
+    stats.user_processed++;
+    
+    if (env.verbose) {
+        printf("NULL operation processed for client %s:%u\n",
+               addr_ntoa(&ctx->xprt->addr.sin6_addr), ntohs(ctx->xprt->addr.sin6_port));
+    }
+}
+
+/* Handle NFS GETATTR request */
+static void handle_nfs_getattr(struct nfs_call_ctx *ctx)
+{
+    char path[PATH_MAX];
+    const char *rel;
+    struct nfs_fattr attr;
+    struct nfs_fh fh;
+    struct xdr_buf x;
+    struct stat st;
+    uint32_t status;
+
+    if (nfs_decode_fh_args(ctx, &fh) < 0)
+        return;
+
+    status = nfs_resolve_fh(&fh, &rel, path, sizeof(path), &st);
+    if (status == NFS3_OK)
+        stat_to_fattr(&st, &attr);
+
+    nfs_reply_begin(ctx, &x, 0);
+    nfs_encode_status(&x, status);
+    if (status == NFS3_OK)
+        xdr_encode_fattr3(&x, &attr);
+    nfs_reply_send(ctx, &x);
+}
+
+/* Handle NFS LOOKUP request */
+static void handle_nfs_lookup(struct nfs_call_ctx *ctx)
+{
+    char path[PATH_MAX], child_rel[MAX_FILENAME_LEN], name[MAX_FILENAME_LEN];
+    const char *dir_rel;
+    struct nfs_fattr dir_attr, attr;
+    struct nfs_fh fh, child_fh;
+    struct stat st;
+    struct xdr_buf x;
+    uint32_t status;
+    bool have_dir = false;
+
+    xdr_decode_fh3(&ctx->args, &fh);
+    xdr_decode_string(&ctx->args, name, MAX_FILENAME_LEN - 1);
+    if (ctx->args.err) {
+        nfs_reply_rpc_error(ctx, RPC_GARBAGE_ARGS);
+        return;
+    }
+
+    status = nfs_resolve_fh(&fh, &dir_rel, path, sizeof(path), &st);
+    if (status == NFS3_OK) {
+        stat_to_fattr(&st, &dir_attr);
+        have_dir = true;
+        if (!S_ISDIR(st.st_mode))
+            status = NFS3ERR_NOTDIR;
+    }
+
+    if (status == NFS3_OK)
+        status = nfs_child_rel(dir_rel, name, child_rel, sizeof(child_rel));
+
+    if (status == NFS3_OK) {
+        nfs_full_path(child_rel, path, sizeof(path));
+        if (lstat(path, &st) != 0) {
+            status = nfs3_errno_stat(errno);
+        } else {
+            stat_to_fattr(&st, &attr);
+            generate_nfs_file_handle(child_rel, &child_fh);
+            fh_table_insert(&child_fh, child_rel);
+        }
+    }
+
+    nfs_reply_begin(ctx, &x, 0);
+    nfs_encode_status(&x, status);
+    if (status == NFS3_OK) {
+        xdr_encode_fh3(&x, &child_fh);
+        xdr_encode_post_op_attr(&x, &attr);
+    }
+    xdr_encode_post_op_attr(&x, have_dir ? &dir_attr : NULL);
+    nfs_reply_send(ctx, &x);
+}
+
+/* Handle NFS ACCESS request */
+static void handle_nfs_access(struct nfs_call_ctx *ctx)
+{
+    char path[PATH_MAX];
+    const char *rel;
+    struct nfs_fattr attr;
+    struct nfs_fh fh;
+    struct stat st;
+    struct xdr_buf x;
+    uint32_t status, requested;
+
+    xdr_decode_fh3(&ctx->args, &fh);
+    requested = xdr_decode_u32(&ctx->args);
+    if (ctx->args.err) {
+        nfs_reply_rpc_error(ctx, RPC_GARBAGE_ARGS);
+        return;
+    }
+
+    status = nfs_resolve_fh(&fh, &rel, path, sizeof(path), &st);
+    if (status == NFS3_OK)
+        stat_to_fattr(&st, &attr);
+
+    nfs_reply_begin(ctx, &x, 0);
+    nfs_encode_status(&x, status);
+    xdr_encode_post_op_attr(&x, status == NFS3_OK ? &attr : NULL);
+    if (status == NFS3_OK)
+        xdr_encode_u32(&x, nfs3_access_granted(ctx->uid, ctx->gid, &attr, requested));
+    nfs_reply_send(ctx, &x);
+}
+
+/* Handle NFS READLINK request */
+static void handle_nfs_readlink(struct nfs_call_ctx *ctx)
+{
+    char path[PATH_MAX], target[PATH_MAX];
+    const char *rel;
+    struct nfs_fattr attr;
+    struct nfs_fh fh;
+    struct stat st;
+    struct xdr_buf x;
+    uint32_t status;
+    ssize_t len = 0;
+    bool have_attr = false;
+
+    if (nfs_decode_fh_args(ctx, &fh) < 0)
+        return;
+
+    status = nfs_resolve_fh(&fh, &rel, path, sizeof(path), &st);
+    if (status == NFS3_OK) {
+        stat_to_fattr(&st, &attr);
+        have_attr = true;
+        if (!S_ISLNK(st.st_mode)) {
+            status = NFS3ERR_INVAL;
+        } else {
+            len = readlink(path, target, sizeof(target));
+            if (len < 0)
+                status = nfs3_errno_stat(errno);
+        }
+    }
+
+    if (nfs_reply_begin(ctx, &x, status == NFS3_OK ? XDR_PADLEN(len) : 0) < 0) {
+        nfs_reply_rpc_error(ctx, RPC_SYSTEM_ERR);
+        return;
+    }
+    nfs_encode_status(&x, status);
+    xdr_encode_post_op_attr(&x, have_attr ? &attr : NULL);
+    if (status == NFS3_OK)
+        xdr_encode_string(&x, target, len);
+    nfs_reply_send(ctx, &x);
+}
+
+/* Handle NFS READ request */
+static void handle_nfs_read(struct nfs_call_ctx *ctx)
+{
+    char path[PATH_MAX];
+    const char *rel;
+    struct nfs_fattr attr;
+    struct nfs_fh fh;
+    struct stat st;
+    struct xdr_buf x;
+    uint64_t offset;
+    uint32_t count, status;
+    ssize_t bytes_read = 0;
+    bool have_attr = false;
+    int fd;
+
+    xdr_decode_fh3(&ctx->args, &fh);
+    offset = xdr_decode_u64(&ctx->args);
+    count = xdr_decode_u32(&ctx->args);
+    if (ctx->args.err) {
+        nfs_reply_rpc_error(ctx, RPC_GARBAGE_ARGS);
+        return;
+    }
+    if (count > sizeof(read_buf))
+        count = sizeof(read_buf);
+
+    status = nfs_resolve_fh(&fh, &rel, path, sizeof(path), &st);
+    have_attr = status == NFS3_OK;
+    if (status == NFS3_OK && !S_ISREG(st.st_mode))
+        status = S_ISDIR(st.st_mode) ? NFS3ERR_ISDIR : NFS3ERR_INVAL;
+    if (status == NFS3_OK) {
+        fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            status = nfs3_errno_stat(errno);
+        } else {
+            bytes_read = pread(fd, read_buf, count, offset);
+            if (bytes_read < 0)
+                status = nfs3_errno_stat(errno);
+            else
+                fstat(fd, &st);
+            close(fd);
+        }
+    }
+    if (have_attr)
+        stat_to_fattr(&st, &attr);
+
+    nfs_reply_begin(ctx, &x, status == NFS3_OK ? XDR_PADLEN(bytes_read) : 0);
+    nfs_encode_status(&x, status);
+    xdr_encode_post_op_attr(&x, have_attr ? &attr : NULL);
+    if (status == NFS3_OK) {
+        xdr_encode_u32(&x, bytes_read);                                 /* count */
+        xdr_encode_bool(&x, offset + bytes_read >= (uint64_t)st.st_size); /* eof */
+        xdr_encode_opaque(&x, read_buf, bytes_read);                    /* data */
+    }
+    nfs_reply_send(ctx, &x);
+}
+
+/* Handle NFS WRITE request. UNSTABLE data is written and answered at
+ * once; stable writes wait for the group sync in nfs_flush_syncs(). */
+static void handle_nfs_write(struct nfs_call_ctx *ctx)
+{
+    char path[PATH_MAX];
+    const char *rel;
+    struct nfs_open_file *f = NULL;
+    struct nfs_wcc_data wcc = {0};
+    struct nfs_fh fh;
+    struct stat st;
+    struct xdr_buf x;
+    struct iovec iov;
+    const __u8 *data;
+    uint64_t offset;
+    uint32_t count, stable, data_len, status;
+    ssize_t written = 0;
+
+    xdr_decode_fh3(&ctx->args, &fh);
+    offset = xdr_decode_u64(&ctx->args);
+    count = xdr_decode_u32(&ctx->args);
+    stable = xdr_decode_u32(&ctx->args);
+    data = xdr_decode_opaque(&ctx->args, &data_len, NFS_MAX_IO_SIZE);
+    if (ctx->args.err || count != data_len || stable > NFS3_FILE_SYNC) {
+        nfs_reply_rpc_error(ctx, RPC_GARBAGE_ARGS);
+        return;
+    }
+
+    status = nfs_resolve_fh(&fh, &rel, path, sizeof(path), &st);
+    if (status == NFS3_OK) {
+        stat_to_wcc_attr(&st, &wcc.before);
+        stat_to_fattr(&st, &wcc.after);
+        wcc.before_valid = 1;
+        wcc.after_valid = 1;
+        if (!S_ISREG(st.st_mode))
+            status = S_ISDIR(st.st_mode) ? NFS3ERR_ISDIR : NFS3ERR_INVAL;
+        else if (!nfs3_access_granted(ctx->uid, ctx->gid, &wcc.after, NFS3_ACCESS_MODIFY))
+            status = NFS3ERR_ACCES;
+    }
+    if (status == NFS3_OK)
+        f = nfs_file_get(&fh, rel, path, &status);
+
+    if (f) {
+        iov.iov_base = (void *)data;
+        iov.iov_len = count;
+        written = pwritev(f->fd, &iov, 1, offset);
+        if (written < 0) {
+            status = nfs3_errno_stat(errno);
+        } else {
+            dirty_range_add(f, offset, offset + written);
+            stats.bytes_written += written;
+        }
+    }
+
+    if (status == NFS3_OK && stable != NFS3_UNSTABLE) {
+        nfs_queue_sync(ctx, f, &wcc.before, written, stable);
+        return;
+    }
+
+    if (f && fstat(f->fd, &st) == 0)
+        stat_to_fattr(&st, &wcc.after);
+
+    nfs_reply_begin(ctx, &x, 0);
+    nfs_encode_status(&x, status);
+    xdr_encode_wcc_data(&x, &wcc);
+    if (status == NFS3_OK) {
+        xdr_encode_u32(&x, written);                            /* count */
+        xdr_encode_u32(&x, NFS3_UNSTABLE);                      /* committed */
+        xdr_encode_fixed(&x, write_verf, NFS3_WRITEVERFSIZE);   /* verf */
+    }
+    nfs_reply_send(ctx, &x);
+}
+
+/* Handle NFS COMMIT request. Only waits for a sync when the range
+ * still has unsynced data. */
+static void handle_nfs_commit(struct nfs_call_ctx *ctx)
+{
+    char path[PATH_MAX];
+    const char *rel;
+    struct nfs_open_file *f;
+    struct nfs_wcc_data wcc = {0};
+    struct nfs_fh fh;
+    struct stat st;
+    struct xdr_buf x;
+    uint64_t offset, end;
+    uint32_t count, status;
+
+    xdr_decode_fh3(&ctx->args, &fh);
+    offset = xdr_decode_u64(&ctx->args);
+    count = xdr_decode_u32(&ctx->args);
+    if (ctx->args.err) {
+        nfs_reply_rpc_error(ctx, RPC_GARBAGE_ARGS);
+        return;
+    }
+
+    /* A count of 0 means through the end of the file */
+    end = count && offset + count > offset ? offset + count : UINT64_MAX;
+
+    status = nfs_resolve_fh(&fh, &rel, path, sizeof(path), &st);
+    if (status == NFS3_OK) {
+        stat_to_wcc_attr(&st, &wcc.before);
+        stat_to_fattr(&st, &wcc.after);
+        wcc.before_valid = 1;
+        wcc.after_valid = 1;
+        if (!S_ISREG(st.st_mode))
+            status = S_ISDIR(st.st_mode) ? NFS3ERR_ISDIR : NFS3ERR_INVAL;
+    }
+
+    if (status == NFS3_OK) {
+        f = nfs_file_find(&fh);
+        if (f && dirty_range_overlaps(f, offset, end)) {
+            nfs_queue_sync(ctx, f, &wcc.before, 0, NFS3_UNSTABLE);
+            return;
+        }
+    }
+
+    nfs_reply_begin(ctx, &x, 0);
+    nfs_encode_status(&x, status);
+    xdr_encode_wcc_data(&x, &wcc);
+    if (status == NFS3_OK)
+        xdr_encode_fixed(&x, write_verf, NFS3_WRITEVERFSIZE);
+    nfs_reply_send(ctx, &x);
+}
+
+/* A directory's change time; when it moves, old cookies are invalid */
+static uint64_t dir_cookieverf(const struct stat *st)
+{
+    return (uint64_t)st->st_ctim.tv_sec * 1000000000ULL + st->st_ctim.tv_nsec;
+}
+
+static int dirent_cmp(const void *a, const void *b, void *names)
+{
+    const struct nfs_dirent *ea = a, *eb = b;
+
+    return strcmp((char *)names + ea->name_off, (char *)names + eb->name_off);
+}
+
+static void dir_snapshot_free(struct nfs_dir_snapshot *snap)
+{
+    free(snap->ents);
+    free(snap->names);
+    memset(snap, 0, sizeof(*snap));
+}
+
+/* Read a whole directory into @snap, sorted by name so a rebuild of an
+ * unchanged directory hands out the same cookies. Returns an errno. */
+static int dir_snapshot_build(struct nfs_dir_snapshot *snap, const char *path)
+{
+    size_t cap = 64, names_cap = 4096, names_len = 0;
+    struct nfs_dirent *ents = malloc(cap * sizeof(*ents));
+    char *names = malloc(names_cap);
+    uint32_t count = 0;
+    struct dirent *de;
+    DIR *dir;
+
+    if (!ents || !names) {
+        free(ents);
+        free(names);
+        return ENOMEM;
+    }
+
+    dir = opendir(path);
+    if (!dir) {
+        int err = errno;
+
+        free(ents);
+        free(names);
+        return err;
+    }
+
+    while ((de = readdir(dir))) {
+        size_t len = strlen(de->d_name);
+
+        if (count == cap) {
+            void *p = realloc(ents, cap * 2 * sizeof(*ents));
+
+            if (!p)
+                goto nomem;
+            ents = p;
+            cap *= 2;
+        }
+        if (names_len + len + 1 > names_cap) {
+            void *p = realloc(names, names_cap * 2 + len);
+
+            if (!p)
+                goto nomem;
+            names = p;
+            names_cap = names_cap * 2 + len;
+        }
+        memcpy(names + names_len, de->d_name, len + 1);
+        ents[count].fileid = de->d_ino;
+        ents[count].name_off = names_len;
+        ents[count].name_len = len;
+        names_len += len + 1;
+        count++;
+    }
+    closedir(dir);
+
+    qsort_r(ents, count, sizeof(*ents), dirent_cmp, names);
+    snap->ents = ents;
+    snap->names = names;
+    snap->count = count;
+    return 0;
+
+nomem:
+    closedir(dir);
+    free(ents);
+    free(names);
+    return ENOMEM;
+}
+
+/* Snapshot of a directory, rebuilt only when its change time moved */
+static struct nfs_dir_snapshot *dir_snapshot_get(const struct nfs_fh *fh, const char *path,
+                                                 const struct stat *st, uint32_t *status)
+{
+    struct nfs_dir_snapshot *snap = NULL, *victim = &dir_snaps[0];
+    uint64_t verf = dir_cookieverf(st);
+    int err;
+
+    for (int i = 0; i < DIR_SNAP_CACHE_SIZE; i++) {
+        struct nfs_dir_snapshot *e = &dir_snaps[i];
+
+        if (e->fh.len == fh->len && !memcmp(e->fh.data, fh->data, fh->len)) {
+            snap = e;
+            break;
+        }
+        if (e->last_used < victim->last_used)
+            victim = e;
+    }
+
+    if (snap && snap->verf == verf) {
+        snap->last_used = now_ns();
+        return snap;
+    }
+    if (!snap)
+        snap = victim;
+
+    dir_snapshot_free(snap);
+    err = dir_snapshot_build(snap, path);
+    if (err) {
+        *status = nfs3_errno_stat(err);
+        return NULL;
+    }
+    snap->fh = *fh;
+    snap->verf = verf;
+    snap->last_used = now_ns();
+    return snap;
+}
+
+/* Shared body of READDIR and READDIRPLUS. A page is served straight from
+ * the snapshot: the cookie is the index to resume at. READDIRPLUS
+ * attributes are fetched for the page only, with statx relative to one
+ * directory fd. */
+static void nfs_readdir(struct nfs_call_ctx *ctx, bool plus)
+{
+    char path[PATH_MAX], child_rel[MAX_FILENAME_LEN];
+    const char *rel;
+    struct nfs_dir_snapshot *snap = NULL;
+    struct nfs_fattr dir_attr, attr;
+    struct nfs_fh fh, child_fh;
+    struct statx stx;
+    struct stat st;
+    struct xdr_buf x;
+    uint64_t cookie, verf, end = 0;
+    uint32_t dircount, maxcount, status, fixed, room;
+    uint32_t used = 0, dir_used = 0;
+    bool have_dir = false;
+    int dirfd = -1;
+
+    xdr_decode_fh3(&ctx->args, &fh);
+    cookie = xdr_decode_u64(&ctx->args);
+    verf = xdr_decode_u64(&ctx->args);
+    dircount = xdr_decode_u32(&ctx->args);
+    maxcount = plus ? xdr_decode_u32(&ctx->args) : dircount;
+    if (ctx->args.err) {
+        nfs_reply_rpc_error(ctx, RPC_GARBAGE_ARGS);
+        return;
+    }
+
+    status = nfs_resolve_fh(&fh, &rel, path, sizeof(path), &st);
+    if (status == NFS3_OK) {
+        stat_to_fattr(&st, &dir_attr);
+        have_dir = true;
+        if (!S_ISDIR(st.st_mode))
+            status = NFS3ERR_NOTDIR;
+    }
+    if (status == NFS3_OK)
+        snap = dir_snapshot_get(&fh, path, &st, &status);
+
+    /* A zero verifier is accepted with any cookie, as some clients
+     * never echo it back */
+    if (snap && ((cookie && verf && verf != snap->verf) || cookie > snap->count))
+        status = NFS3ERR_BAD_COOKIE;
+
+    /* Take entries while they fit the client's limits and our buffer */
+    fixed = nfs3_reply_fixed_size[ctx->proc];
+    room = sizeof(reply_buf) - nfs3_reply_size(ctx->proc, 0);
+    if (maxcount < fixed)
+        room = 0;
+    else if (maxcount - fixed < room)
+        room = maxcount - fixed;
+
+    if (status == NFS3_OK) {
+        for (end = cookie; end < snap->count; end++) {
+            uint32_t name_len = snap->ents[end].name_len;
+            uint32_t size = plus ? xdr_entryplus3_size(name_len) : xdr_entry3_size(name_len);
+
+            if (used + size > room)
+                break;
+            if (plus && dir_used + xdr_entry3_size(name_len) > dircount)
+                break;
+            used += size;
+            dir_used += xdr_entry3_size(name_len);
+        }
+        if (end == cookie && end < snap->count)
+            status = NFS3ERR_TOOSMALL;
+    }
+
+    if (status == NFS3_OK && plus)
+        dirfd = open(path, O_RDONLY | O_DIRECTORY);
+
+    nfs_reply_begin(ctx, &x, status == NFS3_OK ? used : 0);
+    nfs_encode_status(&x, status);
+    xdr_encode_post_op_attr(&x, have_dir ? &dir_attr : NULL);
+    if (status == NFS3_OK) {
+        xdr_encode_u64(&x, snap->verf);                 /* cookieverf */
+        for (uint64_t i = cookie; i < end; i++) {
+            const struct nfs_dirent *e = &snap->ents[i];
+            const char *name = snap->names + e->name_off;
+            bool have_attr, have_fh;
+
+            if (!plus) {
+                xdr_encode_entry3(&x, e->fileid, name, e->name_len, i + 1);
+                continue;
+            }
+
+            have_attr = dirfd >= 0 &&
+                        statx(dirfd, name, AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS, &stx) == 0;
+            if (have_attr)
+                statx_to_fattr(&stx, &attr);
+            have_fh = nfs_child_rel(rel, name, child_rel, sizeof(child_rel)) == NFS3_OK;
+            if (have_fh) {
+                generate_nfs_file_handle(child_rel, &child_fh);
+                fh_table_insert(&child_fh, child_rel);
+            }
+            xdr_encode_entryplus3(&x, e->fileid, name, e->name_len, i + 1,
+                                  have_attr ? &attr : NULL, have_fh ? &child_fh : NULL);
+        }
+        xdr_encode_dirlist_end(&x, end == snap->count);
+    }
+    nfs_reply_send(ctx, &x);
+
+    if (dirfd >= 0)
+        close(dirfd);
+}
+
+/* Handle NFS READDIR request */
+static void handle_nfs_readdir(struct nfs_call_ctx *ctx)
+{
+    nfs_readdir(ctx, false);
+}
+
+/* Handle NFS READDIRPLUS request */
+static void handle_nfs_readdirplus(struct nfs_call_ctx *ctx)
+{
+    nfs_readdir(ctx, true);
+}
+
+/* Handle NFS FSSTAT request */
+static void handle_nfs_fsstat(struct nfs_call_ctx *ctx)
+{
+    char path[PATH_MAX];
+    const char *rel;
+    struct nfs_fattr attr;
+    struct nfs_fsstat fs = {0};
+    struct statvfs vfs;
+    struct nfs_fh fh;
+    struct stat st;
+    struct xdr_buf x;
+    uint32_t status;
+    bool have_attr = false;
+
+    if (nfs_decode_fh_args(ctx, &fh) < 0)
+        return;
+
+    status = nfs_resolve_fh(&fh, &rel, path, sizeof(path), &st);
+    if (status == NFS3_OK) {
+        stat_to_fattr(&st, &attr);
+        have_attr = true;
+        if (statvfs(path, &vfs) != 0) {
+            status = nfs3_errno_stat(errno);
+        } else {
+            fs.tbytes = (uint64_t)vfs.f_blocks * vfs.f_frsize;
+            fs.fbytes = (uint64_t)vfs.f_bfree * vfs.f_frsize;
+            fs.abytes = (uint64_t)vfs.f_bavail * vfs.f_frsize;
+            fs.tfiles = vfs.f_files;
+            fs.ffiles = vfs.f_ffree;
+            fs.afiles = vfs.f_favail;
+        }
+    }
+
+    nfs_reply_begin(ctx, &x, 0);
+    nfs_encode_status(&x, status);
+    xdr_encode_post_op_attr(&x, have_attr ? &attr : NULL);
+    if (status == NFS3_OK)
+        xdr_encode_fsstat(&x, &fs);
+    nfs_reply_send(ctx, &x);
+}
+
+/* Handle NFS FSINFO request */
+static void handle_nfs_fsinfo(struct nfs_call_ctx *ctx)
+{
+    char path[PATH_MAX];
+    const char *rel;
+    struct nfs_fattr attr;
+    struct nfs_fh fh;
+    struct stat st;
+    struct xdr_buf x;
+    uint32_t status;
+    const struct nfs_fsinfo fs = {
+        .rtmax = NFS_MAX_IO_SIZE,
+        .rtpref = NFS_MAX_IO_SIZE,
+        .rtmult = 4096,
+        .wtmax = NFS_MAX_IO_SIZE,
+        .wtpref = NFS_MAX_IO_SIZE,
+        .wtmult = 4096,
+        .dtpref = 8192,
+        .maxfilesize = INT64_MAX,
+        .time_delta_sec = 0,
+        .time_delta_nsec = 1,
+        .properties = FSF3_LINK | FSF3_SYMLINK | FSF3_HOMOGENEOUS | FSF3_CANSETTIME,
+    };
+
+    if (nfs_decode_fh_args(ctx, &fh) < 0)
+        return;
+
+    status = nfs_resolve_fh(&fh, &rel, path, sizeof(path), &st);
+    if (status == NFS3_OK)
+        stat_to_fattr(&st, &attr);
+
+    nfs_reply_begin(ctx, &x, 0);
+    nfs_encode_status(&x, status);
+    xdr_encode_post_op_attr(&x, status == NFS3_OK ? &attr : NULL);
+    if (status == NFS3_OK)
+        xdr_encode_fsinfo(&x, &fs);
+    nfs_reply_send(ctx, &x);
+}
+
+/* Handle NFS PATHCONF request */
+static void handle_nfs_pathconf(struct nfs_call_ctx *ctx)
+{
+    char path[PATH_MAX];
+    const char *rel;
+    struct nfs_fattr attr;
+    struct nfs_fh fh;
+    struct stat st;
+    struct xdr_buf x;
+    uint32_t status;
+    struct nfs_pathconf pc = {
+        .no_trunc = 1,
+        .chown_restricted = 1,
+        .case_insensitive = 0,
+        .case_preserving = 1,
+    };
+
+    if (nfs_decode_fh_args(ctx, &fh) < 0)
+        return;
+
+    status = nfs_resolve_fh(&fh, &rel, path, sizeof(path), &st);
+    if (status == NFS3_OK) {
+        long v;
+
+        stat_to_fattr(&st, &attr);
+        v = pathconf(path, _PC_LINK_MAX);
+        pc.linkmax = v > 0 ? v : 1;
+        v = pathconf(path, _PC_NAME_MAX);
+        pc.name_max = v > 0 ? v : MAX_FILENAME_LEN - 1;
+    }
+
+    nfs_reply_begin(ctx, &x, 0);
+    nfs_encode_status(&x, status);
+    xdr_encode_post_op_attr(&x, status == NFS3_OK ? &attr : NULL);
+    if (status == NFS3_OK)
+        xdr_encode_pathconf(&x, &pc);
+    nfs_reply_send(ctx, &x);
+}
+
+/* NFSv3 procedure dispatch table; NULL handlers reply PROC_UNAVAIL */
+static const struct nfs_proc_desc {
+    const char *name;
+    void (*handle)(struct nfs_call_ctx *ctx);
+} nfs_procs[NFS3_NPROCS] = {
+    [NFSPROC3_NULL]        = { "NULL",        handle_nfs_null },
+    [NFSPROC3_GETATTR]     = { "GETATTR",     handle_nfs_getattr },
+    [NFSPROC3_SETATTR]     = { "SETATTR",     NULL },
+    [NFSPROC3_LOOKUP]      = { "LOOKUP",      handle_nfs_lookup },
+    [NFSPROC3_ACCESS]      = { "ACCESS",      handle_nfs_access },
+    [NFSPROC3_READLINK]    = { "READLINK",    handle_nfs_readlink },
+    [NFSPROC3_READ]        = { "READ",        handle_nfs_read },
+    [NFSPROC3_WRITE]       = { "WRITE",       handle_nfs_write },
+    [NFSPROC3_CREATE]      = { "CREATE",      NULL },
+    [NFSPROC3_MKDIR]       = { "MKDIR",       NULL },
+    [NFSPROC3_SYMLINK]     = { "SYMLINK",     NULL },
+    [NFSPROC3_MKNOD]       = { "MKNOD",       NULL },
+    [NFSPROC3_REMOVE]      = { "REMOVE",      NULL },
+    [NFSPROC3_RMDIR]       = { "RMDIR",       NULL },
+    [NFSPROC3_RENAME]      = { "RENAME",      NULL },
+    [NFSPROC3_LINK]        = { "LINK",        NULL },
+    [NFSPROC3_READDIR]     = { "READDIR",     handle_nfs_readdir },
+    [NFSPROC3_READDIRPLUS] = { "READDIRPLUS", handle_nfs_readdirplus },
+    [NFSPROC3_FSSTAT]      = { "FSSTAT",      handle_nfs_fsstat },
+    [NFSPROC3_FSINFO]      = { "FSINFO",      handle_nfs_fsinfo },
+    [NFSPROC3_PATHCONF]    = { "PATHCONF",    handle_nfs_pathconf },
+    [NFSPROC3_COMMIT]      = { "COMMIT",      handle_nfs_commit },
+};
+
+/* Process NFS request in user space */
+static void process_nfs_request(struct nfs_xprt *xprt, char *buffer, int len)
+{
+    struct nfs_call_ctx ctx = { .xprt = xprt, .uid = 65534, .gid = 65534 };
+    struct xdr_dec *d = &ctx.args;
+    uint32_t msg_type, rpc_vers, prog, vers, flavor, cred_len, verf_len;
+    const __u8 *cred;
+    
+    xdr_dec_init(d, buffer, len);
+    
+    /* Decode RPC header */
+    ctx.xid = xdr_decode_u32(d);
+    msg_type = xdr_decode_u32(d);
+    rpc_vers = xdr_decode_u32(d);
+    prog = xdr_decode_u32(d);
+    vers = xdr_decode_u32(d);
+    ctx.proc = xdr_decode_u32(d);
+    
+    /* Credentials; AUTH_UNIX carries the caller's uid/gid */
+    flavor = xdr_decode_u32(d);
+    cred = xdr_decode_opaque(d, &cred_len, 400);
+    if (cred && flavor == RPC_AUTH_UNIX) {
+        struct xdr_dec cd;
+        uint32_t name_len;
+        
+        xdr_dec_init(&cd, cred, cred_len);
+        xdr_decode_u32(&cd);                    /* stamp */
+        xdr_decode_opaque(&cd, &name_len, 255); /* machinename */
+        ctx.uid = xdr_decode_u32(&cd);
+        ctx.gid = xdr_decode_u32(&cd);
+        if (cd.err) {
+            ctx.uid = 65534;
+            ctx.gid = 65534;
+        }
+    }
+    
+    /* Verifier */
+    xdr_decode_u32(d);
+    xdr_decode_opaque(d, &verf_len, 400);
+    
+    if (d->err)
+        return;
+    
+    if (msg_type != RPC_CALL || rpc_vers != 2 || prog != RPC_PROGRAM_NFS || vers != NFS_VERSION_3)
+        return;
     
     stats.total_requests++;
     
-    switch (proc) {
-        case NFSPROC3_NULL:
-            handle_nfs_null(client_sock, client_addr, xid);
+    if (nfs_drc_replay(&ctx))
+        return;
+    
+    if (ctx.proc >= NFS3_NPROCS || !nfs_procs[ctx.proc].handle) {
+        if (env.verbose)
+            printf("Unsupported NFS procedure: %u\n", ctx.proc);
+        nfs_reply_rpc_error(&ctx, RPC_PROC_UNAVAIL);
+        return;
+    }
+    
+    nfs_procs[ctx.proc].handle(&ctx);
+}
+
+/* Read up to UDP_BATCH receives from the UDP socket. With UDP_GRO one
+ * receive can hold a train of calls from one client, each gso_size
+ * bytes but the last; they are split back up and served one by one. */
+static void udp_handle_readable(int sock)
+{
+    static char buffer[UDP_RECV_SIZE];
+    char control[CMSG_SPACE(sizeof(int))];
+
+    for (int i = 0; i < UDP_BATCH; i++) {
+        struct nfs_xprt xprt = { .sock = sock };
+        struct iovec iov = { .iov_base = buffer, .iov_len = sizeof(buffer) };
+        struct msghdr msg = {
+            .msg_name = &xprt.addr,
+            .msg_namelen = sizeof(xprt.addr),
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+            .msg_control = control,
+            .msg_controllen = sizeof(control),
+        };
+        struct cmsghdr *cm;
+        ssize_t len = recvmsg(sock, &msg, 0);
+        int seg = 0;
+
+        if (len <= 0)
             break;
-        case NFSPROC3_GETATTR:
-            handle_nfs_getattr(client_sock, client_addr, buffer, len, xid);
+
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO)
+                memcpy(&seg, CMSG_DATA(cm), sizeof(seg));
+        }
+        if (seg <= 0 || seg >= len) {
+            process_nfs_request(&xprt, buffer, len);
+            continue;
+        }
+
+        stats.gro_trains++;
+        for (ssize_t off = 0; off < len; off += seg) {
+            stats.gro_calls++;
+            process_nfs_request(&xprt, buffer + off, len - off < seg ? len - off : seg);
+        }
+    }
+}
+
+/* Serve the calls on @xsk's RX ring and hand their frames back to the
+ * fill ring. nfs_server_xdp left its parse in front of each frame, so
+ * only the addresses are read here; @udp_sock takes oversized replies. */
+static void xsk_handle_readable(struct nfs_xsk *xsk, int udp_sock)
+{
+    const struct xdp_desc *descs = xsk->rx.descs;
+    __u32 cons = *xsk->rx.consumer, prod = ring_load(xsk->rx.producer);
+    __u32 fill_prod = *xsk->fill.producer;
+    __u64 *fill = xsk->fill.descs;
+
+    for (int n = 0; cons != prod && n < UDP_BATCH; cons++, n++) {
+        const struct xdp_desc *desc = &descs[cons & xsk->rx.mask];
+        __u8 *frame = xsk->umem + desc->addr;
+        struct nfs_xprt xprt = { .sock = udp_sock, .xsk = xsk };
+        struct nfs_xsk_route *rt = &xprt.route;
+        struct nfs_xsk_meta meta;
+        struct udphdr *udp;
+        uint32_t len;
+
+        memcpy(&meta, frame - sizeof(meta), sizeof(meta));
+        if (meta.l3_off < 14 || meta.l3_off > XSK_MAX_L2 ||
+            meta.l4_off < meta.l3_off + (meta.ipv6 ? sizeof(struct ip6_hdr) : sizeof(struct iphdr)) ||
+            meta.l4_off + sizeof(*udp) > desc->len) {
+            stats.errors++;
+            goto next;
+        }
+
+        memcpy(rt->l2, frame + 6, 6);
+        memcpy(rt->l2 + 6, frame, 6);
+        memcpy(rt->l2 + 12, frame + 12, meta.l3_off - 12);
+        rt->l2_len = meta.l3_off;
+        rt->ipv6 = meta.ipv6;
+        xprt.addr.sin6_family = AF_INET6;
+        if (meta.ipv6) {
+            const struct ip6_hdr *ip6 = (const void *)(frame + meta.l3_off);
+
+            xprt.addr.sin6_addr = ip6->ip6_src;
+            rt->local = ip6->ip6_dst;
+        } else {
+            const struct iphdr *ip = (const void *)(frame + meta.l3_off);
+
+            xprt.addr.sin6_addr.s6_addr16[5] = 0xffff;
+            xprt.addr.sin6_addr.s6_addr32[3] = ip->saddr;
+            rt->local.s6_addr16[5] = 0xffff;
+            rt->local.s6_addr32[3] = ip->daddr;
+        }
+
+        udp = (struct udphdr *)(frame + meta.l4_off);
+        xprt.addr.sin6_port = udp->source;
+        rt->local_port = udp->dest;
+        len = desc->len - meta.l4_off - sizeof(*udp);
+        if (ntohs(udp->len) >= sizeof(*udp) && ntohs(udp->len) - sizeof(*udp) < len)
+            len = ntohs(udp->len) - sizeof(*udp);
+
+        stats.xsk_calls++;
+        process_nfs_request(&xprt, (char *)(udp + 1), len);
+next:
+        fill[fill_prod++ & xsk->fill.mask] = desc->addr & ~(__u64)(XSK_FRAME_SIZE - 1);
+    }
+
+    ring_store(xsk->rx.consumer, cons);
+    ring_store(xsk->fill.producer, fill_prod);
+}
+
+/* Set up segmentation offload on the UDP socket: GRO on receive with -G, and
+ * the GSO segment size for sends from the MTU of @ifname */
+static void udp_setup_offload(int sock, const char *ifname)
+{
+    int one = 1, gso = 0, mtu;
+    socklen_t optlen = sizeof(gso);
+
+    /* Off by default: TC passes a GRO train to user space whole, so
+     * calls the kernel could have answered would miss the fast path */
+    if (env.udp_gro && setsockopt(sock, SOL_UDP, UDP_GRO, &one, sizeof(one)) < 0)
+        fprintf(stderr, "UDP GRO unavailable: %s\n", strerror(errno));
+
+    /* The option reads back where the kernel knows UDP_SEGMENT */
+    if (getsockopt(sock, SOL_UDP, UDP_SEGMENT, &gso, &optlen) < 0) {
+        fprintf(stderr, "UDP GSO unavailable: %s\n", strerror(errno));
+        return;
+    }
+
+    mtu = if_mtu(ifname);
+    if (mtu > 40 + 8)
+        udp_gso_size = mtu - 40 - 8;
+}
+
+/* Accept a TCP connection and hand it to the sk_skb fast path */
+static void tcp_accept_conn(struct nfs_server_bpf *skel, int listen_sock)
+{
+    struct nfs_tcp_conn *conn = NULL;
+    struct sockaddr_in6 addr;
+    socklen_t addr_len = sizeof(addr);
+    int fd, one = 1;
+
+    fd = accept(listen_sock, (struct sockaddr *)&addr, &addr_len);
+    if (fd < 0)
+        return;
+
+    for (int i = 0; i < MAX_TCP_CONNS; i++) {
+        if (tcp_conns[i].fd < 0) {
+            conn = &tcp_conns[i];
             break;
-        case NFSPROC3_READ:
-            handle_nfs_read(client_sock, client_addr, buffer, len, xid);
+        }
+    }
+    if (!conn) {
+        fprintf(stderr, "Too many TCP connections, rejecting %s\n",
+                addr_ntoa(&addr.sin6_addr));
+        close(fd);
+        return;
+    }
+
+    conn->buf = malloc(NFS_MAX_RECORD_SIZE + 4);
+    conn->rec = malloc(NFS_MAX_RECORD_SIZE);
+    if (!conn->buf || !conn->rec) {
+        free(conn->buf);
+        free(conn->rec);
+        close(fd);
+        return;
+    }
+    conn->fd = fd;
+    conn->addr = addr;
+    conn->buf_len = 0;
+    conn->rec_len = 0;
+    conn->fastpath = false;
+    conn->user_bytes = 0;
+    conn->frags = 0;
+    conn->frags_done = 0;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    /* Once in the sockhash, cached requests are answered by the
+     * stream verdict program and never reach read() below */
+    if (env.enable_kernel_cache) {
+        struct nfs_sock_key key = {
+            .remote_port = ntohs(addr.sin6_port),
+            .local_port = env.nfs_port,
+        };
+        __u32 sock_fd = fd;
+        __u32 slot = conn - tcp_conns;
+        socklen_t len = sizeof(conn->cookie);
+
+        /* The verdict finds the connection's nfs_tcp_order slot by
+         * socket cookie; without one it must not answer anything */
+        memset(&tcp_order[slot], 0, sizeof(tcp_order[slot]));
+        if (getsockopt(fd, SOL_SOCKET, SO_COOKIE, &conn->cookie, &len) < 0 ||
+            tcp_send_pos(fd, &conn->tcp_base) < 0 ||
+            bpf_map_update_elem(bpf_map__fd(skel->maps.nfs_tcp_slots), &conn->cookie,
+                                &slot, BPF_ANY) != 0) {
+            fprintf(stderr, "Failed to set up TCP reply ordering: %s\n", strerror(errno));
+            goto out;
+        }
+        memcpy(&key.remote_addr, &addr.sin6_addr, sizeof(key.remote_addr));
+        if (bpf_map_update_elem(bpf_map__fd(skel->maps.nfs_sock_hash), &key,
+                                &sock_fd, BPF_NOEXIST) != 0) {
+            fprintf(stderr, "Failed to add TCP socket to sockhash: %s\n", strerror(errno));
+            bpf_map_delete_elem(bpf_map__fd(skel->maps.nfs_tcp_slots), &conn->cookie);
+            goto out;
+        }
+        conn->fastpath = true;
+    }
+
+out:
+
+    if (env.verbose)
+        printf("TCP connection from %s:%u\n",
+               addr_ntoa(&addr.sin6_addr), ntohs(addr.sin6_port));
+}
+
+static void tcp_close_conn(struct nfs_tcp_conn *conn)
+{
+    /* Closing the socket also removes it from the sockhash */
+    if (conn->fastpath)
+        bpf_map_delete_elem(bpf_map__fd(skel->maps.nfs_tcp_slots), &conn->cookie);
+    close(conn->fd);
+    free(conn->buf);
+    free(conn->rec);
+    conn->fd = -1;
+    conn->buf = NULL;
+    conn->rec = NULL;
+}
+
+/* Read from a TCP connection and process every complete record */
+static void tcp_handle_readable(struct nfs_tcp_conn *conn)
+{
+    struct nfs_xprt xprt = {
+        .sock = conn->fd, .is_tcp = true, .addr = conn->addr, .conn = conn,
+    };
+    ssize_t n;
+
+    n = read(conn->fd, conn->buf + conn->buf_len, NFS_MAX_RECORD_SIZE + 4 - conn->buf_len);
+    if (n <= 0) {
+        if (env.verbose)
+            printf("TCP connection from %s:%u closed\n",
+                   addr_ntoa(&conn->addr.sin6_addr), ntohs(conn->addr.sin6_port));
+        tcp_close_conn(conn);
+        return;
+    }
+    conn->buf_len += n;
+
+    while (conn->buf_len >= 4) {
+        uint32_t mark = ntohl(*(uint32_t *)conn->buf);
+        uint32_t frag_len = mark & RPC_FRAG_LEN_MASK;
+
+        if (conn->rec_len + frag_len > NFS_MAX_RECORD_SIZE) {
+            fprintf(stderr, "Oversized RPC record from %s, closing\n",
+                    addr_ntoa(&conn->addr.sin6_addr));
+            tcp_close_conn(conn);
+            return;
+        }
+        if (conn->buf_len < 4 + frag_len)
             break;
-        default:
-            if (env.verbose)
-                printf("Unsupported NFS procedure: %u\n", proc);
+
+        memcpy(conn->rec + conn->rec_len, conn->buf + 4, frag_len);
+        conn->rec_len += frag_len;
+        conn->buf_len -= 4 + frag_len;
+        memmove(conn->buf, conn->buf + 4 + frag_len, conn->buf_len);
+        conn->frags++;
+
+        if (mark & RPC_LAST_FRAG) {
+            process_nfs_request(&xprt, conn->rec, conn->rec_len);
+            conn->rec_len = 0;
+            conn->frags_done = conn->frags;
+        }
+    }
+}
+
+/* Tell the verdict how far each connection is answered; it answers
+ * from the cache again once user space owes no replies. Runs after
+ * nfs_flush_syncs(), when held stable-write replies are out. */
+static void tcp_publish_done(void)
+{
+    for (int i = 0; i < MAX_TCP_CONNS; i++) {
+        if (tcp_conns[i].fd >= 0 && tcp_conns[i].fastpath)
+            __atomic_store_n(&tcp_order[i].user_done, tcp_conns[i].frags_done,
+                             __ATOMIC_RELEASE);
+    }
+}
+
+static int tcp_order_open(struct nfs_server_bpf *skel)
+{
+    long page = sysconf(_SC_PAGE_SIZE);
+    size_t len = (MAX_TCP_CONNS * sizeof(struct nfs_tcp_order) + page - 1) & ~(page - 1);
+    void *mem;
+
+    mem = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED,
+               bpf_map__fd(skel->maps.nfs_tcp_order), 0);
+    if (mem == MAP_FAILED)
+        return -errno;
+    tcp_order = mem;
+    return 0;
+}
+
+static const char *const nfs_outcome_names[NFS_NOUTCOMES] = {
+    [NFS_OUT_KERNEL_HIT] = "hit",
+    [NFS_OUT_MISS_NO_HANDLE] = "no-handle",
+    [NFS_OUT_MISS_NOT_CACHED] = "not-cached",
+    [NFS_OUT_MISS_EXPIRED] = "expired",
+    [NFS_OUT_MISS_RANGE] = "range",
+    [NFS_OUT_MISS_REPLY] = "reply",
+    [NFS_OUT_FORWARDED] = "forwarded",
+    [NFS_OUT_DRC_DROP] = "drc-drop",
+    [NFS_OUT_DRC_REPLAY] = "drc-replay",
+    [NFS_OUT_QOS_DROP] = "qos-drop",
+    [NFS_OUT_QOS_JUKEBOX] = "jukebox",
+    [NFS_OUT_ERROR] = "error",
+};
+
+/* Event handler for the per-CPU event rings. Counters come from
+ * nfs_stats; events are a sample for looking at individual calls. */
+static int handle_event(void *ctx, void *data, size_t data_sz)
+{
+    const struct nfs_event *ev = data;
+
+    if (data_sz < sizeof(*ev) || ev->type != NFS_EV_CALL)
+        return 0;
+    if (env.verbose && ev->procedure < NFS3_NPROCS && ev->outcome < NFS_NOUTCOMES) {
+        printf("NFS call: client=%s:%u xid=%u proc=%s outcome=%s offset=%llu count=%u size=%u\n",
+               addr_ntoa(&ev->client_addr), ntohs(ev->client_port),
+               ev->xid, nfs_procs[ev->procedure].name, nfs_outcome_names[ev->outcome],
+               (unsigned long long)ev->offset, ev->count, ev->file_size);
+    }
+    return 0;
+}
+
+/* Create a ring per possible CPU for nfs_events and one ring_buffer
+ * reading them all */
+static struct ring_buffer *open_event_rings(void)
+{
+    int outer_fd = bpf_map__fd(skel->maps.nfs_events);
+    int ncpus = libbpf_num_possible_cpus();
+    struct ring_buffer *rb = NULL;
+
+    if (ncpus <= 0)
+        return NULL;
+    for (int cpu = 0; cpu < ncpus && cpu < NFS_EVENT_MAX_CPUS; cpu++) {
+        __u32 key = cpu;
+        int fd = bpf_map_create(BPF_MAP_TYPE_RINGBUF, NULL, 0, 0, NFS_EVENT_RB_SIZE, NULL);
+
+        if (fd < 0 || bpf_map_update_elem(outer_fd, &key, &fd, BPF_ANY) < 0 ||
+            (rb ? ring_buffer__add(rb, fd, handle_event, NULL) :
+                  !(rb = ring_buffer__new(fd, handle_event, NULL, NULL)))) {
+            if (fd >= 0)
+                close(fd);
+            ring_buffer__free(rb);
+            return NULL;
+        }
+        /* The outer map and the ring_buffer hold their own references */
+        close(fd);
+    }
+    return rb;
+}
+
+/* Number of busiest clients listed by print_stats() */
+#define TOP_CLIENTS 10
+
+static int client_cmp(const void *a, const void *b)
+{
+    const struct nfs_client_state *ca = a, *cb = b;
+
+    if (ca->request_count != cb->request_count)
+        return ca->request_count < cb->request_count ? 1 : -1;
+    return 0;
+}
+
+/* Sum each client's per-CPU counters in client_track and list the
+ * busiest ones */
+static void print_client_stats(void)
+{
+    int map_fd = bpf_map__fd(skel->maps.client_track);
+    int ncpus = libbpf_num_possible_cpus();
+    __u32 cap = bpf_map__max_entries(skel->maps.client_track);
+    struct nfs_client_state *percpu = NULL, *clients = NULL;
+    struct nfs_addr key, next;
+    __u32 n = 0;
+    void *prev = NULL;
+
+    if (ncpus <= 0 || !cap)
+        return;
+    percpu = calloc(ncpus, sizeof(*percpu));
+    clients = calloc(cap, sizeof(*clients));
+    if (!percpu || !clients)
+        goto out;
+
+    while (n < cap && bpf_map_get_next_key(map_fd, prev, &next) == 0) {
+        struct nfs_client_state *c = &clients[n];
+
+        key = next;
+        prev = &key;
+        if (bpf_map_lookup_elem(map_fd, &key, percpu) != 0)
+            continue;
+
+        c->client_addr = key;
+        for (int cpu = 0; cpu < ncpus; cpu++) {
+            c->request_count += percpu[cpu].request_count;
+            c->kernel_processed += percpu[cpu].kernel_processed;
+            c->user_forwarded += percpu[cpu].user_forwarded;
+            if (percpu[cpu].last_request_time > c->last_request_time)
+                c->last_request_time = percpu[cpu].last_request_time;
+        }
+        n++;
+    }
+
+    qsort(clients, n, sizeof(*clients), client_cmp);
+    printf("\n--- Clients (%u tracked in kernel) ---\n", n);
+    printf("%-39s %12s %12s %12s\n", "Client", "Requests", "Kernel", "Forwarded");
+    for (__u32 i = 0; i < n && i < TOP_CLIENTS; i++) {
+        const struct nfs_client_state *c = &clients[i];
+
+        printf("%-39s %12llu %12llu %12llu\n", addr_ntoa(&c->client_addr),
+               (unsigned long long)c->request_count,
+               (unsigned long long)c->kernel_processed,
+               (unsigned long long)c->user_forwarded);
+    }
+
+out:
+    free(percpu);
+    free(clients);
+}
+
+/* Verifier statistics per program, from a BPF_LOG_STATS log kept at
+ * load. Skipped with -v so a failed load still shows libbpf's full
+ * verifier log. */
+#define BPF_LOG_STATS 4
+#define MAX_PROGS 16
+#define VERIFIER_LOG_SIZE 1024
+
+static char verifier_logs[MAX_PROGS][VERIFIER_LOG_SIZE];
+
+static void verifier_stats_request(struct nfs_server_bpf *skel)
+{
+    struct bpf_program *prog;
+    int i = 0;
+
+    if (env.verbose)
+        return;
+    bpf_object__for_each_program(prog, skel->obj) {
+        if (i == MAX_PROGS)
             break;
+        bpf_program__set_log_level(prog, BPF_LOG_STATS);
+        bpf_program__set_log_buf(prog, verifier_logs[i++], VERIFIER_LOG_SIZE);
+    }
+}
+
+/* Instruction counts and verification time of every loaded program,
+ * so a growing handler shows up long before the 1M-instruction limit */
+static void print_verifier_stats(struct nfs_server_bpf *skel)
+{
+    struct bpf_program *prog;
+    int i = 0;
+
+    printf("%-24s %8s %10s %10s\n", "Program", "Insns", "Verified", "Verify us");
+    bpf_object__for_each_program(prog, skel->obj) {
+        struct bpf_prog_info info = {};
+        __u32 len = sizeof(info);
+        const char *log = i < MAX_PROGS ? verifier_logs[i] : "";
+        const char *p = strstr(log, "verification time ");
+        unsigned int us;
+
+        i++;
+        if (bpf_program__fd(prog) < 0 ||
+            bpf_prog_get_info_by_fd(bpf_program__fd(prog), &info, &len))
+            continue;
+        printf("%-24s %8u %10u ", bpf_program__name(prog), info.xlated_prog_len / 8,
+               info.verified_insns);
+        if (p && sscanf(p, "verification time %u usec", &us) == 1)
+            printf("%10u\n", us);
+        else
+            printf("%10s\n", "-");
+    }
+}
+
+/* Counters of struct nfs_stats, all __u64 */
+#define NFS_STATS_WORDS (sizeof(struct nfs_stats) / sizeof(__u64))
+
+/* nfs_stats mapped read-only, one slot per possible CPU */
+static const struct nfs_stats *stats_slots;
+static int stats_ncpus;
+
+static int stats_open(struct nfs_server_bpf *skel)
+{
+    long page = sysconf(_SC_PAGE_SIZE);
+    size_t len = (stats_ncpus * sizeof(struct nfs_stats) + page - 1) & ~(page - 1);
+    void *mem;
+
+    mem = mmap(NULL, len, PROT_READ, MAP_SHARED, bpf_map__fd(skel->maps.nfs_stats), 0);
+    if (mem == MAP_FAILED)
+        return -errno;
+    stats_slots = mem;
+    return 0;
+}
+
+/* Sum the per-CPU slots with plain loads; no syscalls, so the exporter
+ * and live stats can poll as often as they like */
+static int read_kernel_stats(struct nfs_stats *total)
+{
+    __u64 *dst = (__u64 *)total;
+
+    memset(total, 0, sizeof(*total));
+    if (!stats_slots)
+        return -1;
+    for (int cpu = 0; cpu < stats_ncpus; cpu++) {
+        const volatile __u64 *src = (const volatile __u64 *)&stats_slots[cpu];
+
+        for (size_t i = 0; i < NFS_STATS_WORDS; i++)
+            dst[i] += src[i];
     }
+    return 0;
 }
 
-/* Event handler for eBPF events */
-static int handle_event(void *ctx, void *data, size_t data_sz)
+/* Upper bound in ns of the bucket holding the @pct percentile */
+static __u64 hist_percentile(const __u64 *hist, __u64 n, int pct)
+{
+    __u64 seen = 0, want = (n * pct + 99) / 100;
+
+    for (int b = 0; b < NFS_LAT_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen >= want)
+            return 2ULL << b;
+    }
+    return 2ULL << (NFS_LAT_BUCKETS - 1);
+}
+
+/* Print the kernel's per-procedure outcomes and processing time. With
+ * @prev only what changed since then is shown. */
+static void print_kernel_stats(const struct nfs_stats *cur, const struct nfs_stats *prev)
 {
-    if (data_sz == sizeof(struct nfs_request)) {
-        const struct nfs_request *req = data;
-        if (env.verbose) {
-            printf("NFS Request: client=%s:%u xid=%u proc=%u kernel=%d file='%s'\n",
-                   inet_ntoa((struct in_addr){req->client_addr}), 
-                   ntohs(req->client_port), req->xid, req->procedure,
-                   req->processed_in_kernel, req->filename);
-        }
-    } else if (data_sz == sizeof(struct nfs_event)) {
-        const struct nfs_event *event = data;
-        if (env.verbose) {
-            printf("NFS Event: client=%s:%u xid=%u proc=%u result=%u forward=%d cache=%d file='%s'\n",
-                   inet_ntoa((struct in_addr){event->client_addr}),
-                   ntohs(event->client_port), event->xid, event->procedure,
-                   event->result, event->forwarded_to_user, event->from_cache, event->filename);
+    struct nfs_stats d = *cur;
+    int printed_e2e = 0;
+
+    if (prev) {
+        const __u64 *p = (const __u64 *)prev;
+        __u64 *w = (__u64 *)&d;
+
+        for (size_t i = 0; i < NFS_STATS_WORDS; i++)
+            w[i] -= p[i];
+    }
+
+    printf("\n--- Kernel (XDP packets %llu, fs events %llu, event drops %llu) ---\n",
+           (unsigned long long)d.xdp_packets, (unsigned long long)d.fs_events,
+           (unsigned long long)d.event_drops);
+    printf("%-12s %10s %10s %10s  %s\n", "Procedure", "Calls", "p50 ns", "p99 ns", "Outcomes");
+    for (int i = 0; i < NFS3_NPROCS; i++) {
+        __u64 calls = 0, timed = 0;
+
+        for (int o = 0; o < NFS_NOUTCOMES; o++)
+            calls += d.calls[i][o];
+        for (int b = 0; b < NFS_LAT_BUCKETS; b++)
+            timed += d.kernel_ns[i][b];
+        if (!calls)
+            continue;
+
+        printf("%-12s %10llu", nfs_procs[i].name, (unsigned long long)calls);
+        if (timed)
+            printf(" %10llu %10llu ",
+                   (unsigned long long)hist_percentile(d.kernel_ns[i], timed, 50),
+                   (unsigned long long)hist_percentile(d.kernel_ns[i], timed, 99));
+        else
+            printf(" %10s %10s ", "-", "-");
+        for (int o = 0; o < NFS_NOUTCOMES; o++) {
+            if (d.calls[i][o])
+                printf(" %s=%llu", nfs_outcome_names[o], (unsigned long long)d.calls[i][o]);
         }
-        
-        /* Update statistics based on event */
-        if (event->from_cache) {
-            stats.cache_hits++;
-        } else if (event->forwarded_to_user) {
-            stats.cache_misses++;
+        printf("\n");
+    }
+
+    for (int i = 0; i < NFS3_NPROCS; i++) {
+        __u64 n[NFS_NPATHS] = {};
+
+        for (int path = 0; path < NFS_NPATHS; path++) {
+            for (int b = 0; b < NFS_LAT_BUCKETS; b++)
+                n[path] += d.e2e_ns[path][i][b];
         }
-        
-        if (event->result == NFS_OP_SUCCESS && !event->forwarded_to_user) {
-            stats.kernel_processed++;
+        if (!n[NFS_PATH_KERNEL] && !n[NFS_PATH_USER])
+            continue;
+        if (!printed_e2e++)
+            printf("\n--- End-to-end latency (ingress to reply) ---\n"
+                   "%-12s %10s %10s %10s %10s %10s %10s\n", "Procedure",
+                   "Kernel", "p50 ns", "p99 ns", "User", "p50 ns", "p99 ns");
+        printf("%-12s", nfs_procs[i].name);
+        for (int path = 0; path < NFS_NPATHS; path++) {
+            if (n[path])
+                printf(" %10llu %10llu %10llu", (unsigned long long)n[path],
+                       (unsigned long long)hist_percentile(d.e2e_ns[path][i], n[path], 50),
+                       (unsigned long long)hist_percentile(d.e2e_ns[path][i], n[path], 99));
+            else
+                printf(" %10s %10s %10s", "0", "-", "-");
         }
+        printf("\n");
     }
-    
-    return 0;
 }
 
 /* Print statistics */
 static void print_stats(void)
 {
+    struct nfs_stats kstats;
+    __u64 hits = 0, misses = 0;
+
     printf("\n=== NFS Server Statistics ===\n");
+    if (read_kernel_stats(&kstats) < 0)
+        memset(&kstats, 0, sizeof(kstats));
+    for (int i = 0; i < NFS3_NPROCS; i++) {
+        hits += kstats.calls[i][NFS_OUT_KERNEL_HIT];
+        for (int o = NFS_OUT_MISS_NO_HANDLE; o <= NFS_OUT_MISS_REPLY; o++)
+            misses += kstats.calls[i][o];
+    }
+    
     printf("Total requests:      %lu\n", stats.total_requests);
-    printf("Kernel processed:    %lu\n", stats.kernel_processed);
+    printf("Kernel processed:    %llu\n", (unsigned long long)hits);
     printf("User processed:      %lu\n", stats.user_processed);
-    printf("Cache hits:          %lu\n", stats.cache_hits);
-    printf("Cache misses:        %lu\n", stats.cache_misses);
+    printf("Cache misses:        %llu\n", (unsigned long long)misses);
     printf("File not found:      %lu\n", stats.file_not_found);
     printf("Access denied:       %lu\n", stats.access_denied);
     printf("Errors:              %lu\n", stats.errors);
+    printf("Bytes written:       %lu\n", stats.bytes_written);
+    printf("Group syncs:         %lu for %lu stable WRITE/COMMIT\n",
+           stats.syncs, stats.sync_waiters);
+    printf("DRC replays (user):  %lu\n", stats.drc_replays);
+    printf("UDP GSO sends:       %lu for %lu replies\n", stats.gso_sends, stats.gso_replies);
+    printf("UDP GRO receives:    %lu for %lu calls\n", stats.gro_trains, stats.gro_calls);
+    if (n_xsks)
+        printf("AF_XDP:              %lu calls, %lu replies from UMEM, %lu over UDP\n",
+               stats.xsk_calls, stats.xsk_replies, stats.xsk_fallbacks);
+    printf("\n--- Reply encoding (user space) ---\n");
+    printf("%-12s %10s %10s %12s\n", "Procedure", "Calls", "Avg ns", "Avg bytes");
+    for (int i = 0; i < NFS3_NPROCS; i++) {
+        const struct nfs_proc_stats *ps = &proc_stats[i];
+        
+        if (!ps->calls)
+            continue;
+        printf("%-12s %10lu %10lu %12lu\n", nfs_procs[i].name, ps->calls,
+               ps->encode_ns / ps->calls, ps->encode_bytes / ps->calls);
+    }
+    print_kernel_stats(&kstats, NULL);
+    print_client_stats();
     printf("==============================\n");
 }
 
+/* Entries currently in @map, found by walking its keys */
+static long map_count_entries(struct bpf_map *map)
+{
+    int fd = bpf_map__fd(map);
+    __u32 key_size = bpf_map__key_size(map);
+    char *key = malloc(key_size), *next = malloc(key_size);
+    long n = 0;
+
+    if (key && next) {
+        void *prev = NULL;
+
+        while (bpf_map_get_next_key(fd, prev, next) == 0) {
+            memcpy(key, next, key_size);
+            prev = key;
+            n++;
+        }
+    }
+    free(key);
+    free(next);
+    return n;
+}
+
+static const char *const nfs_path_names[NFS_NPATHS] = {
+    [NFS_PATH_KERNEL] = "kernel",
+    [NFS_PATH_USER] = "user",
+};
+
+/* One log2 histogram in OpenMetrics form, bucket bounds in seconds.
+ * Empty ones are left out to keep scrapes small. */
+static void metrics_histogram(FILE *f, const char *name, const char *labels, const __u64 *hist)
+{
+    __u64 cum = 0;
+
+    for (int b = 0; b < NFS_LAT_BUCKETS; b++)
+        cum += hist[b];
+    if (!cum)
+        return;
+
+    cum = 0;
+    for (int b = 0; b < NFS_LAT_BUCKETS; b++) {
+        cum += hist[b];
+        fprintf(f, "%s_bucket{%s,le=\"%g\"} %llu\n", name, labels,
+                (double)(2ULL << b) / 1e9, (unsigned long long)cum);
+    }
+    fprintf(f, "%s_bucket{%s,le=\"+Inf\"} %llu\n", name, labels, (unsigned long long)cum);
+    fprintf(f, "%s_count{%s} %llu\n", name, labels, (unsigned long long)cum);
+}
+
+/* Everything we count, in OpenMetrics text format. Maps are read with
+ * plain lookups, so a scrape never stalls the data path. */
+static void write_metrics(FILE *f)
+{
+    struct nfs_stats k;
+    __u64 hits = 0, misses = 0;
+    char labels[96];
+
+    if (read_kernel_stats(&k) < 0)
+        memset(&k, 0, sizeof(k));
+
+    fprintf(f, "# TYPE nfs_calls counter\n"
+               "# HELP nfs_calls Calls seen by TC/sk_skb/XDP by procedure and outcome.\n");
+    for (int i = 0; i < NFS3_NPROCS; i++) {
+        for (int o = 0; o < NFS_NOUTCOMES; o++) {
+            if (o == NFS_OUT_KERNEL_HIT)
+                hits += k.calls[i][o];
+            else if (o <= NFS_OUT_MISS_REPLY)
+                misses += k.calls[i][o];
+            if (k.calls[i][o])
+                fprintf(f, "nfs_calls_total{proc=\"%s\",outcome=\"%s\"} %llu\n",
+                        nfs_procs[i].name, nfs_outcome_names[o],
+                        (unsigned long long)k.calls[i][o]);
+        }
+    }
+
+    fprintf(f, "# TYPE nfs_cache_hit_ratio gauge\n"
+               "# HELP nfs_cache_hit_ratio Kernel hits over calls the fast path tried.\n"
+               "nfs_cache_hit_ratio %g\n", hits + misses ? (double)hits / (hits + misses) : 0.0);
+    fprintf(f, "# TYPE nfs_cache_entries gauge\n"
+               "nfs_cache_entries{map=\"nfs_file_cache\"} %ld\n"
+               "nfs_cache_entries{map=\"fh_to_name\"} %ld\n",
+            map_count_entries(skel->maps.nfs_file_cache),
+            map_count_entries(skel->maps.fh_to_name));
+    fprintf(f, "# TYPE nfs_cache_capacity gauge\n"
+               "nfs_cache_capacity{map=\"nfs_file_cache\"} %u\n"
+               "nfs_cache_capacity{map=\"fh_to_name\"} %u\n",
+            bpf_map__max_entries(skel->maps.nfs_file_cache),
+            bpf_map__max_entries(skel->maps.fh_to_name));
+
+    fprintf(f, "# TYPE nfs_xdp_packets counter\nnfs_xdp_packets_total %llu\n",
+            (unsigned long long)k.xdp_packets);
+    fprintf(f, "# TYPE nfs_fs_events counter\nnfs_fs_events_total %llu\n",
+            (unsigned long long)k.fs_events);
+    fprintf(f, "# TYPE nfs_ringbuf_drops counter\n"
+               "# HELP nfs_ringbuf_drops Events lost to a full ring buffer.\n"
+               "nfs_ringbuf_drops_total %llu\n", (unsigned long long)k.event_drops);
+
+    /* User space counters; the main thread updates them unlocked and a
+     * scrape may be a request behind */
+    fprintf(f, "# TYPE nfs_user counter\n"
+               "nfs_user_total{counter=\"requests\"} %lu\n"
+               "nfs_user_total{counter=\"processed\"} %lu\n"
+               "nfs_user_total{counter=\"not_found\"} %lu\n"
+               "nfs_user_total{counter=\"access_denied\"} %lu\n"
+               "nfs_user_total{counter=\"errors\"} %lu\n"
+               "nfs_user_total{counter=\"drc_replays\"} %lu\n"
+               "nfs_user_total{counter=\"syncs\"} %lu\n"
+               "nfs_user_total{counter=\"sync_waiters\"} %lu\n",
+            stats.total_requests, stats.user_processed, stats.file_not_found,
+            stats.access_denied, stats.errors, stats.drc_replays, stats.syncs,
+            stats.sync_waiters);
+    fprintf(f, "# TYPE nfs_written_bytes counter\nnfs_written_bytes_total %lu\n",
+            stats.bytes_written);
+
+    fprintf(f, "# TYPE nfs_kernel_processing_seconds histogram\n");
+    for (int i = 0; i < NFS3_NPROCS; i++) {
+        snprintf(labels, sizeof(labels), "proc=\"%s\"", nfs_procs[i].name);
+        metrics_histogram(f, "nfs_kernel_processing_seconds", labels, k.kernel_ns[i]);
+    }
+    if (env.trace_latency) {
+        fprintf(f, "# TYPE nfs_request_latency_seconds histogram\n");
+        for (int path = 0; path < NFS_NPATHS; path++) {
+            for (int i = 0; i < NFS3_NPROCS; i++) {
+                snprintf(labels, sizeof(labels), "proc=\"%s\",path=\"%s\"",
+                         nfs_procs[i].name, nfs_path_names[path]);
+                metrics_histogram(f, "nfs_request_latency_seconds", labels, k.e2e_ns[path][i]);
+            }
+        }
+    }
+    fprintf(f, "# EOF\n");
+}
+
+static void http_reply(int fd, const char *status, const char *type, const char *body, size_t len)
+{
+    char hdr[256];
+    int n;
+
+    n = snprintf(hdr, sizeof(hdr), "HTTP/1.0 %s\r\nContent-Type: %s\r\n"
+                 "Content-Length: %zu\r\nConnection: close\r\n\r\n", status, type, len);
+    if (write(fd, hdr, n) == n && len)
+        write(fd, body, len);
+}
+
+/* Static file under --www-root for any path but /metrics */
+static void http_serve_file(int fd, const char *path)
+{
+    char full[PATH_MAX], real[PATH_MAX], root[PATH_MAX], *body = NULL;
+    struct stat st;
+    size_t root_len;
+    int file = -1;
+
+    if (!env.www_root || path[0] != '/' || strstr(path, "..")) {
+        http_reply(fd, "404 Not Found", "text/plain", "not found\n", 10);
+        return;
+    }
+    snprintf(full, sizeof(full), "%s%s", env.www_root, strcmp(path, "/") ? path : "/index.html");
+
+    /* Only files that resolve, symlinks included, to inside the root */
+    if (realpath(env.www_root, root) && realpath(full, real)) {
+        root_len = strcmp(root, "/") ? strlen(root) : 0;
+        if (!strncmp(real, root, root_len) && real[root_len] == '/')
+            file = open(real, O_RDONLY | O_NOFOLLOW);
+    }
+    if (file < 0 || fstat(file, &st) < 0 || !S_ISREG(st.st_mode) ||
+        !(body = malloc(st.st_size ? st.st_size : 1)) ||
+        read(file, body, st.st_size) != st.st_size) {
+        http_reply(fd, "404 Not Found", "text/plain", "not found\n", 10);
+    } else {
+        const char *dot = strrchr(full, '.');
+
+        http_reply(fd, "200 OK", dot && !strcmp(dot, ".html") ? "text/html" : "application/octet-stream",
+                   body, st.st_size);
+    }
+    free(body);
+    if (file >= 0)
+        close(file);
+}
+
+static void http_handle(int fd)
+{
+    struct timeval tv = { 1, 0 };
+    char req[2048], path[1024];
+    ssize_t len;
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    len = read(fd, req, sizeof(req) - 1);
+    if (len <= 0)
+        return;
+    req[len] = '\0';
+    if (sscanf(req, "GET %1023s", path) != 1) {
+        http_reply(fd, "405 Method Not Allowed", "text/plain", "GET only\n", 9);
+        return;
+    }
+
+    if (!strcmp(path, "/metrics")) {
+        char *body = NULL;
+        size_t body_len = 0;
+        FILE *f = open_memstream(&body, &body_len);
+
+        if (!f)
+            return;
+        write_metrics(f);
+        fclose(f);
+        http_reply(fd, "200 OK", "application/openmetrics-text; version=1.0.0; charset=utf-8",
+                   body, body_len);
+        free(body);
+    } else {
+        http_serve_file(fd, path);
+    }
+}
+
+/* Metrics exporter: a thread of its own so scrapes never wait on, or
+ * delay, NFS requests. Exits once the server is stopping. */
+static void *metrics_thread(void *arg)
+{
+    int sock = (int)(long)arg;
+    struct pollfd pfd = { .fd = sock, .events = POLLIN };
+
+    while (!exiting) {
+        int fd;
+
+        if (poll(&pfd, 1, 200) <= 0)
+            continue;
+        fd = accept(sock, NULL, NULL);
+        if (fd < 0)
+            continue;
+        http_handle(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+static int start_metrics_server(pthread_t *thread)
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(env.metrics_port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    int sock, one = 1;
+
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0)
+        return -errno;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, 16) < 0) {
+        int err = -errno;
+
+        close(sock);
+        return err;
+    }
+    if (pthread_create(thread, NULL, metrics_thread, (void *)(long)sock) != 0) {
+        close(sock);
+        return -EAGAIN;
+    }
+    return sock;
+}
+
+/* Control socket (-c): one command per connection, answered with
+ * "ok" or "error: ..." after any output. Served from a thread of its
+ * own, like the metrics exporter, so a slow client never holds up NFS
+ * requests.
+ *   show
+ *   set kernel_procs all|none|PROC[,PROC]...
+ *   set cache_ttl SECS | max_cached_size BYTES | sample_rate N | events on|off
+ *   qos add RULE | qos del CIDR
+ * e.g. echo "set cache_ttl 60" | socat - UNIX-CONNECT:/run/nfs_server.sock */
+static bool qos_active;
+
+static int control_open(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -ENAMETOOLONG;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -errno;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        chmod(path, 0600) < 0 || listen(fd, 8) < 0) {
+        int err = -errno;
+
+        close(fd);
+        return err;
+    }
+    return fd;
+}
+
+static int parse_kernel_procs(char *arg, __u32 *mask)
+{
+    char *tok, *save;
+
+    *mask = 0;
+    if (!strcmp(arg, "all")) {
+        *mask = NFS_KERNEL_PROCS_ALL;
+        return 0;
+    }
+    if (!strcmp(arg, "none"))
+        return 0;
+    for (tok = strtok_r(arg, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        int proc;
+
+        for (proc = 0; proc < NFS3_NPROCS; proc++) {
+            if (!strcasecmp(tok, nfs_procs[proc].name))
+                break;
+        }
+        if (proc == NFS3_NPROCS || !(NFS_KERNEL_PROCS_ALL & (1U << proc)))
+            return -1;
+        *mask |= 1U << proc;
+    }
+    return 0;
+}
+
+static void control_show(FILE *f)
+{
+    volatile struct nfs_config *cfg = &skel->data->nfs_config;
+
+    fprintf(f, "kernel_procs ");
+    for (int proc = 0, n = 0; proc < NFS3_NPROCS; proc++) {
+        if (cfg->kernel_procs & (1U << proc))
+            fprintf(f, "%s%s", n++ ? "," : "", nfs_procs[proc].name);
+    }
+    fprintf(f, "%s\n", cfg->kernel_procs ? "" : "none");
+    fprintf(f, "cache_ttl %u\n", cfg->cache_ttl_seconds);
+    fprintf(f, "max_cached_size %u\n", cfg->max_cached_file_size);
+    fprintf(f, "sample_rate %u\n", cfg->event_sample_rate);
+    fprintf(f, "events %s\n", cfg->events_enabled ? "on" : "off");
+    fprintf(f, "qos %s\n", qos_active ? "on" : "off");
+    fprintf(f, "steer_cpus %u\n", cfg->steer_cpus);
+}
+
+/* Run one command line; returns NULL or what went wrong */
+static const char *control_run(char *line, FILE *f)
+{
+    volatile struct nfs_config *cfg = &skel->data->nfs_config;
+    char *cmd, *what, *arg, *save;
+    unsigned long val;
+
+    cmd = strtok_r(line, " \t\r\n", &save);
+    what = strtok_r(NULL, " \t\r\n", &save);
+    arg = strtok_r(NULL, " \t\r\n", &save);
+    if (!cmd)
+        return "empty command";
+
+    if (!strcmp(cmd, "show")) {
+        control_show(f);
+        return NULL;
+    }
+
+    if (!strcmp(cmd, "set") && what && arg) {
+        __u32 mask;
+
+        if (!strcmp(what, "kernel_procs")) {
+            if (parse_kernel_procs(arg, &mask))
+                return "unknown procedure (fast path serves NULL, GETATTR, ACCESS, READ)";
+            cfg->kernel_procs = mask;
+            return NULL;
+        }
+        if (!strcmp(what, "events")) {
+            if (strcmp(arg, "on") && strcmp(arg, "off"))
+                return "events is on or off";
+            cfg->events_enabled = !strcmp(arg, "on");
+            return NULL;
+        }
+        val = strtoul(arg, &arg, 10);
+        if (*arg || val > UINT32_MAX)
+            return "bad number";
+        if (!strcmp(what, "cache_ttl")) {
+            cfg->cache_ttl_seconds = val;
+        } else if (!strcmp(what, "max_cached_size")) {
+            if (val > MAX_NFS_DATA_SIZE)
+                return "larger than MAX_NFS_DATA_SIZE";
+            cfg->max_cached_file_size = val;
+        } else if (!strcmp(what, "sample_rate")) {
+            cfg->event_sample_rate = val;
+        } else {
+            return "unknown setting";
+        }
+        return NULL;
+    }
+
+    if (!strcmp(cmd, "qos") && what && arg) {
+        int rules_fd = bpf_map__fd(skel->maps.nfs_qos_rules);
+        struct nfs_qos_rule rule;
+        struct nfs_qos_key key;
+
+        if (!qos_active)
+            return "QoS is off; start with at least one -q to attach XDP";
+        if (!strcmp(what, "add")) {
+            if (parse_qos_rule(arg, &key, &rule) < 0)
+                return "invalid QoS rule";
+            if (bpf_map_update_elem(rules_fd, &key, &rule, BPF_ANY))
+                return strerror(errno);
+            return NULL;
+        }
+        if (!strcmp(what, "del")) {
+            char prefix[64];
+
+            /* Parsed as a rule without limits, only for its key */
+            snprintf(prefix, sizeof(prefix), "%s,0,0", arg);
+            if (parse_qos_rule(prefix, &key, &rule) < 0)
+                return "invalid prefix";
+            if (bpf_map_delete_elem(rules_fd, &key))
+                return strerror(errno);
+            return NULL;
+        }
+    }
+    return "unknown command";
+}
+
+/* Serve one pending control connection */
+static void control_handle(int listen_fd)
+{
+    struct timeval tv = { .tv_sec = 1 };
+    char line[512], *out = NULL;
+    size_t len = 0, out_len;
+    const char *err;
+    FILE *f;
+    int fd;
+
+    fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0)
+        return;
+    /* A stuck client only holds up the commands queued behind it */
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    while (len < sizeof(line) - 1 && !memchr(line, '\n', len)) {
+        ssize_t n = recv(fd, line + len, sizeof(line) - 1 - len, 0);
+
+        if (n <= 0)
+            break;
+        len += n;
+    }
+    line[len] = '\0';
+
+    f = open_memstream(&out, &out_len);
+    if (f) {
+        err = control_run(line, f);
+        if (err)
+            fprintf(f, "error: %s\n", err);
+        else
+            fprintf(f, "ok\n");
+        fclose(f);
+        send(fd, out, out_len, MSG_NOSIGNAL);
+        free(out);
+    }
+    close(fd);
+}
+
+static void *control_thread(void *arg)
+{
+    int sock = (int)(long)arg;
+    struct pollfd pfd = { .fd = sock, .events = POLLIN };
+
+    while (!exiting) {
+        if (poll(&pfd, 1, 200) > 0)
+            control_handle(sock);
+    }
+    return NULL;
+}
+
+/* Live view for --stats-interval: kernel statistics for the last
+ * interval, printed once it has elapsed */
+static void live_stats_tick(void)
+{
+    static struct nfs_stats prev;
+    static uint64_t last;
+    struct nfs_stats cur;
+    uint64_t now = now_ns();
+
+    if (!env.stats_interval || now - last < (uint64_t)env.stats_interval * 1000000000ULL)
+        return;
+    if (read_kernel_stats(&cur) < 0)
+        return;
+    if (last)
+        print_kernel_stats(&cur, &prev);
+    prev = cur;
+    last = now;
+}
+
 /* Main NFS server function */
 int main(int argc, char **argv)
 {
-    struct nfs_server_bpf *skel;
-    int err, server_sock;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t client_len = sizeof(client_addr);
-    char buffer[4096];
-    struct ring_buffer *rb;
-    int ifindex;
+    int err, server_sock = -1, tcp_sock = -1;
+    int sock_map_fd = -1, parser_fd, verdict_fd;
+    struct sockaddr_in6 server_addr;
+    struct ring_buffer *rb = NULL;
+    int ifindex = 0;
+    struct bpf_link *ingress_link = NULL, *egress_link = NULL, *xdp_link = NULL;
+    int ingress_old = -1, egress_old = -1, xdp_old = -1;
+    bool started = false;
+    char pin_dir[PATH_MAX];
+    int pins_reused = 0;
+    bool warm_cache = false;
+    int metrics_sock = -1;
+    int control_sock = -1;
+    pthread_t metrics_tid, control_tid;
+    
+    for (int i = 0; i < MAX_TCP_CONNS; i++)
+        tcp_conns[i].fd = -1;
+    for (int i = 0; i < MAX_OPEN_FILES; i++)
+        open_files[i].fd = -1;
+    
+    /* Write verifier: start time, so it differs on every restart */
+    write_verf_new();
     
     /* Parse command line arguments */
     err = argp_parse(&argp, argc, argv, 0, NULL, NULL);
@@ -463,6 +4422,7 @@ int main(int argc, char **argv)
     /* Set up signal handlers */
     signal(SIGINT, sig_handler);
     signal(SIGTERM, sig_handler);
+    signal(SIGUSR1, sigusr1_handler);
     
     /* Create export directory if it doesn't exist */
     mkdir(env.export_root, 0755);
@@ -483,18 +4443,76 @@ int main(int argc, char **argv)
         return 1;
     }
     
+    skel->rodata->enable_xid_trace = env.trace_latency;
+    skel->data->nfs_config.event_sample_rate = env.event_sample_rate;
+    skel->data->nfs_config.events_enabled = !env.aggregate_only;
+    bpf_map__set_max_entries(skel->maps.nfs_events, libbpf_num_possible_cpus());
+    stats_ncpus = libbpf_num_possible_cpus();
+    bpf_map__set_max_entries(skel->maps.nfs_stats, stats_ncpus);
+    bpf_map__set_max_entries(skel->maps.nfs_cpumap, libbpf_num_possible_cpus());
+    
+    /* Pick up the cache and counters left by the previous run */
+    if (env.pin_maps) {
+        err = pin_dir_path(pin_dir, sizeof(pin_dir));
+        if (!err)
+            err = pins_reused = pin_maps_prepare(skel, pin_dir, &warm_cache);
+        if (err < 0) {
+            fprintf(stderr, "Failed to set up map pinning: %s\n", strerror(-err));
+            goto cleanup;
+        }
+        err = 0;
+    }
+    
     /* Load & verify BPF programs */
+    verifier_stats_request(skel);
     err = nfs_server_bpf__load(skel);
     if (err) {
-        fprintf(stderr, "Failed to load and verify BPF skeleton\n");
+        fprintf(stderr, "Failed to load and verify BPF skeleton%s\n",
+                env.verbose ? "" : " (-v shows the verifier log)");
+        goto cleanup;
+    }
+    print_verifier_stats(skel);
+    
+    err = arena_open(skel);
+    if (err) {
+        fprintf(stderr, "Failed to map the cache arena: %s\n", strerror(-err));
+        goto cleanup;
+    }
+    err = stats_open(skel);
+    if (err) {
+        fprintf(stderr, "Failed to map statistics: %s\n", strerror(-err));
+        goto cleanup;
+    }
+    err = tcp_order_open(skel);
+    if (err) {
+        fprintf(stderr, "Failed to map TCP reply order: %s\n", strerror(-err));
         goto cleanup;
     }
     
+    if (env.pin_maps) {
+        err = pin_layout_stamp(pin_dir);
+        if (err) {
+            fprintf(stderr, "Failed to stamp pinned maps: %s\n", strerror(-err));
+            goto cleanup;
+        }
+        printf("Maps pinned in %s (%d reused)\n", pin_dir, pins_reused);
+        if (warm_cache)
+            pin_maps_revalidate(skel);
+    }
+    
+    /* Pinned maps survive restarts, the snapshot survives reboots */
+    if (env.snapshot && env.enable_kernel_cache && !warm_cache) {
+        err = snapshot_restore(skel, env.snapshot);
+        if (err)
+            fprintf(stderr, "Ignoring cache snapshot %s: %s\n", env.snapshot, strerror(-err));
+        err = 0;
+    }
+    
     /* Set up ring buffer polling */
-    rb = ring_buffer__new(bpf_map__fd(skel->maps.nfs_events), handle_event, NULL, NULL);
+    rb = open_event_rings();
     if (!rb) {
         err = -1;
-        fprintf(stderr, "Failed to create ring buffer\n");
+        fprintf(stderr, "Failed to create event ring buffers\n");
         goto cleanup;
     }
     
@@ -507,25 +4525,83 @@ int main(int argc, char **argv)
         goto cleanup;
     }
     
-    /* Attach TC program */
-    LIBBPF_OPTS(bpf_tc_hook, hook, .ifindex = ifindex, .attach_point = BPF_TC_INGRESS);
-    LIBBPF_OPTS(bpf_tc_opts, opts, .handle = 1, .priority = 1, .prog_fd = bpf_program__fd(skel->progs.nfs_server_tc));
+    if (env.metrics_port) {
+        metrics_sock = start_metrics_server(&metrics_tid);
+        if (metrics_sock < 0) {
+            err = metrics_sock;
+            fprintf(stderr, "Failed to start metrics server: %s\n", strerror(-err));
+            goto cleanup;
+        }
+        printf("Metrics at http://127.0.0.1:%d/metrics\n", env.metrics_port);
+    }
     
-    err = bpf_tc_hook_create(&hook);
-    if (err && err != -EEXIST) {
-        fprintf(stderr, "Failed to create TC hook: %s\n", strerror(-err));
-        goto cleanup;
+    /* QoS rules; the XDP program enforcing them is attached last */
+    if (env.n_qos) {
+        int rules_fd = bpf_map__fd(skel->maps.nfs_qos_rules);
+        
+        for (int i = 0; i < env.n_qos; i++) {
+            if (bpf_map_update_elem(rules_fd, &env.qos_keys[i], &env.qos_rules[i], BPF_ANY)) {
+                err = -errno;
+                fprintf(stderr, "Failed to load QoS rule %d: %s\n", i, strerror(-err));
+                goto cleanup;
+            }
+        }
+        qos_active = true;
+        printf("QoS: %d rule(s) enforced at XDP\n", env.n_qos);
     }
     
-    err = bpf_tc_attach(&hook, &opts);
-    if (err) {
-        fprintf(stderr, "Failed to attach TC program: %s\n", strerror(-err));
-        goto cleanup;
+    if (env.xsk) {
+        err = xsk_setup(skel, env.interface, ifindex);
+        if (err) {
+            fprintf(stderr, "Failed to set up AF_XDP sockets: %s\n", strerror(-err));
+            goto cleanup;
+        }
+        skel->data->nfs_config.xsk_enabled = 1;
+        printf("AF_XDP: %d queue(s), %s\n", n_xsks, xsks[0].zerocopy ? "zero-copy" : "copy mode");
+    }
+    
+    if (env.n_steer) {
+        err = steer_setup(skel);
+        if (err) {
+            fprintf(stderr, "Failed to set up CPU steering: %s\n", strerror(-err));
+            goto cleanup;
+        }
+        printf("CPU steering: %d core(s), XDP stage on the %s\n", env.n_steer,
+               skel->data->nfs_config.steer_remote ? "target cores" : "RX core");
+    }
+    
+    /* Started once QoS and steering are set up, which it reports on */
+    if (env.control_path) {
+        control_sock = control_open(env.control_path);
+        if (control_sock >= 0 &&
+            pthread_create(&control_tid, NULL, control_thread, (void *)(long)control_sock)) {
+            close(control_sock);
+            unlink(env.control_path);
+            control_sock = -EAGAIN;
+        }
+        if (control_sock < 0) {
+            err = control_sock;
+            fprintf(stderr, "Failed to open control socket %s: %s\n", env.control_path,
+                    strerror(-err));
+            goto cleanup;
+        }
+        printf("Control socket: %s\n", env.control_path);
     }
     
     printf("Successfully started NFS server on %s:%d\n", env.interface, env.nfs_port);
     printf("Export root: %s\n", env.export_root);
     printf("Kernel processing: %s\n", env.enable_kernel_cache ? "enabled" : "disabled");
+    printf("Per-call events: %s\n", !env.event_sample_rate ? "off (sample rate 0)" :
+           env.aggregate_only ? "off (SIGUSR1 to enable)" : "on");
+    
+    /* The export root is the handle clients start from */
+    struct nfs_fh root_fh;
+    generate_nfs_file_handle("", &root_fh);
+    fh_table_insert(&root_fh, "");
+    printf("Root file handle: ");
+    for (int i = 0; i < root_fh.len; i++)
+        printf("%02x", root_fh.data[i]);
+    printf("\n");
     
     /* Pre-cache some files */
     if (env.enable_kernel_cache) {
@@ -533,19 +4609,22 @@ int main(int argc, char **argv)
         printf("Pre-cached test.txt in kernel\n");
     }
     
-    /* Create UDP socket for NFS */
-    server_sock = socket(AF_INET, SOCK_DGRAM, 0);
+    /* Create UDP socket for NFS; dual-stack, so IPv4 clients show up
+     * v4-mapped, the same way the BPF programs key them */
+    server_sock = socket(AF_INET6, SOCK_DGRAM, 0);
     if (server_sock < 0) {
         err = -errno;
         fprintf(stderr, "Failed to create socket: %s\n", strerror(-err));
         goto cleanup;
     }
+    int v6only = 0;
+    setsockopt(server_sock, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
     
     /* Bind to NFS port */
     memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(env.nfs_port);
+    server_addr.sin6_family = AF_INET6;
+    server_addr.sin6_addr = in6addr_any;
+    server_addr.sin6_port = htons(env.nfs_port);
     
     if (bind(server_sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
         err = -errno;
@@ -553,46 +4632,228 @@ int main(int argc, char **argv)
         goto cleanup;
     }
     
+    /* Room for bursts of full-size WRITEs; replies that wait on a group
+     * sync are only sent after a batch has been read */
+    int rcvbuf = 4 << 20;
+    setsockopt(server_sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    fcntl(server_sock, F_SETFL, fcntl(server_sock, F_GETFL) | O_NONBLOCK);
+    udp_setup_offload(server_sock, env.interface);
+    
     printf("NFS server listening on UDP port %d\n", env.nfs_port);
     
+    /* Create TCP listener; the sk_skb programs serve cache hits on
+     * accepted connections */
+    tcp_sock = socket(AF_INET6, SOCK_STREAM, 0);
+    if (tcp_sock >= 0) {
+        int one = 1;
+        
+        setsockopt(tcp_sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        setsockopt(tcp_sock, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only));
+        if (bind(tcp_sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0 ||
+            listen(tcp_sock, 64) < 0) {
+            fprintf(stderr, "Failed to listen on TCP port %d: %s, serving UDP only\n",
+                    env.nfs_port, strerror(errno));
+            close(tcp_sock);
+            tcp_sock = -1;
+        }
+    }
+    
+    if (tcp_sock >= 0) {
+        sock_map_fd = bpf_map__fd(skel->maps.nfs_sock_hash);
+        parser_fd = bpf_program__fd(skel->progs.nfs_stream_parser);
+        verdict_fd = bpf_program__fd(skel->progs.nfs_stream_verdict);
+        
+        err = bpf_prog_attach(parser_fd, sock_map_fd, BPF_SK_SKB_STREAM_PARSER, 0);
+        if (!err)
+            err = bpf_prog_attach(verdict_fd, sock_map_fd, BPF_SK_SKB_STREAM_VERDICT, 0);
+        if (err) {
+            fprintf(stderr, "Failed to attach sk_skb programs: %s\n", strerror(errno));
+            goto cleanup;
+        }
+        printf("NFS server listening on TCP port %d\n", env.nfs_port);
+    }
+    
+    /* The fast path goes live last, once nothing else can fail: with -P
+     * attaching takes over the links of the previous start */
+    ingress_link = fastpath_attach(skel->progs.nfs_server_tc, env.pin_maps ? pin_dir : NULL,
+                                   "link_tc_ingress", ifindex, &ingress_old);
+    if (!ingress_link) {
+        err = -errno;
+        fprintf(stderr, "Failed to attach TC program: %s\n", strerror(-err));
+        goto cleanup;
+    }
+    
+    /* Replies are matched to their calls on the way out */
+    if (env.trace_latency) {
+        egress_link = fastpath_attach(skel->progs.nfs_server_tc_egress,
+                                      env.pin_maps ? pin_dir : NULL, "link_tc_egress", ifindex,
+                                      &egress_old);
+        if (!egress_link) {
+            err = -errno;
+            fprintf(stderr, "Failed to attach TC egress program: %s\n", strerror(-err));
+            goto cleanup;
+        }
+        printf("Latency tracing enabled\n");
+    }
+    
+    /* QoS, AF_XDP and CPU steering run in XDP, ahead of everything else
+     * on the interface */
+    if (env.n_qos || env.xsk || env.n_steer) {
+        xdp_link = fastpath_attach(skel->progs.nfs_server_xdp, env.pin_maps ? pin_dir : NULL,
+                                   "link_xdp", ifindex, &xdp_old);
+        if (!xdp_link) {
+            err = -errno;
+            fprintf(stderr, "Failed to attach XDP program: %s\n", strerror(-err));
+            goto cleanup;
+        }
+    }
+    
+    if (env.pin_maps && !env.trace_latency)
+        fastpath_unpin(pin_dir, "link_tc_egress");
+    if (env.pin_maps && !xdp_link)
+        fastpath_unpin(pin_dir, "link_xdp");
+    started = true;
+    
     /* Main event loop */
     while (!exiting) {
-        /* Poll eBPF events */
-        err = ring_buffer__poll(rb, 100 /* timeout_ms */);
-        if (err == -EINTR) {
-            err = 0;
-            break;
-        }
+        /* Drain eBPF events; the kernel only wakes us once a ring
+         * fills, so quiet rings are picked up here every round */
+        err = ring_buffer__consume(rb);
         if (err < 0) {
-            printf("Error polling perf buffer: %d\n", err);
+            printf("Error consuming ring buffers: %d\n", err);
             break;
         }
+        err = 0;
+        
+        live_stats_tick();
+        arena_reclaim(false);
+        if (env.snapshot)
+            snapshot_tick(env.snapshot);
+        
+        if (toggle_events) {
+            toggle_events = false;
+            skel->data->nfs_config.events_enabled = !skel->data->nfs_config.events_enabled;
+            printf("Per-call events %s\n", skel->data->nfs_config.events_enabled ? "on" : "off");
+        }
         
         /* Check for incoming NFS requests */
         fd_set readfds;
         struct timeval tv = {0, 100000}; /* 100ms timeout */
+        int max_fd = server_sock;
         
         FD_ZERO(&readfds);
         FD_SET(server_sock, &readfds);
+        FD_SET(ring_buffer__epoll_fd(rb), &readfds);
+        if (ring_buffer__epoll_fd(rb) > max_fd)
+            max_fd = ring_buffer__epoll_fd(rb);
+        if (tcp_sock >= 0) {
+            FD_SET(tcp_sock, &readfds);
+            if (tcp_sock > max_fd)
+                max_fd = tcp_sock;
+        }
+        for (int i = 0; i < MAX_TCP_CONNS; i++) {
+            if (tcp_conns[i].fd < 0)
+                continue;
+            FD_SET(tcp_conns[i].fd, &readfds);
+            if (tcp_conns[i].fd > max_fd)
+                max_fd = tcp_conns[i].fd;
+        }
+        for (int i = 0; i < n_xsks; i++) {
+            FD_SET(xsks[i].fd, &readfds);
+            if (xsks[i].fd > max_fd)
+                max_fd = xsks[i].fd;
+        }
         
-        int activity = select(server_sock + 1, &readfds, NULL, NULL, &tv);
-        if (activity > 0 && FD_ISSET(server_sock, &readfds)) {
-            ssize_t len = recvfrom(server_sock, buffer, sizeof(buffer), 0,
-                                  (struct sockaddr *)&client_addr, &client_len);
-            if (len > 0) {
-                process_nfs_request(server_sock, &client_addr, buffer, len);
-            }
+        int activity = select(max_fd + 1, &readfds, NULL, NULL, &tv);
+        if (activity <= 0)
+            continue;
+        
+        if (FD_ISSET(server_sock, &readfds))
+            udp_handle_readable(server_sock);
+        
+        for (int i = 0; i < n_xsks; i++) {
+            if (FD_ISSET(xsks[i].fd, &readfds))
+                xsk_handle_readable(&xsks[i], server_sock);
+        }
+        
+        if (tcp_sock >= 0 && FD_ISSET(tcp_sock, &readfds))
+            tcp_accept_conn(skel, tcp_sock);
+        
+        for (int i = 0; i < MAX_TCP_CONNS; i++) {
+            if (tcp_conns[i].fd >= 0 && FD_ISSET(tcp_conns[i].fd, &readfds))
+                tcp_handle_readable(&tcp_conns[i]);
         }
+        
+        /* One sync per file for everything this round made stable */
+        nfs_flush_syncs();
+        tcp_publish_done();
+        udp_tx_flush();
+        xsk_flush();
     }
     
     print_stats();
+    
+    if (env.snapshot) {
+        err = snapshot_write(env.snapshot);
+        if (err)
+            fprintf(stderr, "Failed to write cache snapshot %s: %s\n", env.snapshot, strerror(-err));
+        err = 0;
+    }
 
 cleanup:
     /* Cleanup */
+    exiting = true;
+    if (metrics_sock >= 0) {
+        pthread_join(metrics_tid, NULL);
+        close(metrics_sock);
+    }
+    if (control_sock >= 0) {
+        pthread_join(control_tid, NULL);
+        close(control_sock);
+        unlink(env.control_path);
+    }
+    nfs_flush_syncs();
+    udp_tx_flush();
+    xsk_flush();
+    for (int i = 0; i < n_xsks; i++)
+        xsk_close(&xsks[i]);
+    free(xsks);
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        if (open_files[i].fd >= 0)
+            nfs_file_close(&open_files[i]);
+    }
     if (rb)
         ring_buffer__free(rb);
     if (server_sock >= 0)
         close(server_sock);
+    for (int i = 0; i < MAX_TCP_CONNS; i++) {
+        if (tcp_conns[i].fd >= 0)
+            tcp_close_conn(&tcp_conns[i]);
+    }
+    if (tcp_sock >= 0)
+        close(tcp_sock);
+    if (!started) {
+        fastpath_abort(xdp_link, xdp_old);
+        fastpath_abort(egress_link, egress_old);
+        fastpath_abort(ingress_link, ingress_old);
+    }
+    if (ingress_old >= 0)
+        close(ingress_old);
+    if (egress_old >= 0)
+        close(egress_old);
+    if (xdp_old >= 0)
+        close(xdp_old);
+    /* Unpinned links detach here; pinned ones keep serving until the
+     * next start swaps its programs in */
+    bpf_link__destroy(xdp_link);
+    bpf_link__destroy(egress_link);
+    bpf_link__destroy(ingress_link);
+    if (sock_map_fd >= 0) {
+        bpf_prog_detach2(bpf_program__fd(skel->progs.nfs_stream_verdict), sock_map_fd,
+                         BPF_SK_SKB_STREAM_VERDICT);
+        bpf_prog_detach2(bpf_program__fd(skel->progs.nfs_stream_parser), sock_map_fd,
+                         BPF_SK_SKB_STREAM_PARSER);
+    }
     nfs_server_bpf__destroy(skel);
     return -err;
 }
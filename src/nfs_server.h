@@ -29,6 +29,7 @@ typedef long long __s64;
 #define MAX_FILENAME_LEN 256
 #define MAX_PACKET_SIZE 1500
 #define MAX_NFS_DATA_SIZE 8192
+#define NFS_MAX_IO_SIZE 32768    /* rtmax/wtmax advertised by FSINFO */
 #define NFS_PORT 2049
 #define RPC_PROGRAM_NFS 100003
 #define NFS_VERSION_3 3
@@ -59,17 +60,61 @@ enum nfs_proc {
     NFSPROC3_COMMIT = 21
 };
 
-/* NFS operation result codes */
-enum nfs_op_result {
-    NFS_OP_SUCCESS = 0,
-    NFS_OP_NOT_FOUND = 2,        /* ENOENT */
-    NFS_OP_ACCESS_DENIED = 13,   /* EACCES */
-    NFS_OP_INVALID_HANDLE = 10001,
-    NFS_OP_FORWARD_TO_USER = 10002,
-    NFS_OP_CACHE_HIT = 10003,
-    NFS_OP_ERROR = 10004
+#define NFS3_NPROCS 22
+
+/* NFSv3 status codes (RFC 1813 nfsstat3) */
+enum nfs3_stat {
+    NFS3_OK = 0,
+    NFS3ERR_PERM = 1,
+    NFS3ERR_NOENT = 2,
+    NFS3ERR_IO = 5,
+    NFS3ERR_ACCES = 13,
+    NFS3ERR_EXIST = 17,
+    NFS3ERR_XDEV = 18,
+    NFS3ERR_NODEV = 19,
+    NFS3ERR_NOTDIR = 20,
+    NFS3ERR_ISDIR = 21,
+    NFS3ERR_INVAL = 22,
+    NFS3ERR_FBIG = 27,
+    NFS3ERR_NOSPC = 28,
+    NFS3ERR_ROFS = 30,
+    NFS3ERR_MLINK = 31,
+    NFS3ERR_NAMETOOLONG = 63,
+    NFS3ERR_NOTEMPTY = 66,
+    NFS3ERR_DQUOT = 69,
+    NFS3ERR_STALE = 70,
+    NFS3ERR_BADHANDLE = 10001,
+    NFS3ERR_NOT_SYNC = 10002,
+    NFS3ERR_BAD_COOKIE = 10003,
+    NFS3ERR_NOTSUPP = 10004,
+    NFS3ERR_TOOSMALL = 10005,
+    NFS3ERR_SERVERFAULT = 10006,
+    NFS3ERR_BADTYPE = 10007,
+    NFS3ERR_JUKEBOX = 10008
 };
 
+/* ACCESS3 permission bits */
+#define NFS3_ACCESS_READ    0x0001
+#define NFS3_ACCESS_LOOKUP  0x0002
+#define NFS3_ACCESS_MODIFY  0x0004
+#define NFS3_ACCESS_EXTEND  0x0008
+#define NFS3_ACCESS_DELETE  0x0010
+#define NFS3_ACCESS_EXECUTE 0x0020
+
+/* Type tag of struct nfs_event */
+enum nfs_event_type {
+    NFS_EV_CALL = 1,             /* A sampled call and what became of it */
+};
+
+/* Per-CPU event ring buffers; user space sizes the outer array to the
+ * number of possible CPUs */
+#define NFS_EVENT_MAX_CPUS 1024
+#define NFS_EVENT_RB_SIZE (64 * 1024)
+
+/* Wake the reader once a ring holds this much; below it events wait for
+ * user space's next periodic drain */
+#define NFS_EVENT_WAKEUP_BYTES (NFS_EVENT_RB_SIZE / 4)
+
 /* RPC message types */
 enum rpc_msg_type {
     RPC_CALL = 0,
@@ -84,6 +129,17 @@ enum rpc_auth_flavor {
     RPC_AUTH_DES = 3
 };
 
+/* RPC reply status words */
+#define RPC_MSG_ACCEPTED 0
+#define RPC_ACCEPT_SUCCESS 0
+
+/* RPC over TCP record marking (RFC 5531 section 11) */
+#define RPC_LAST_FRAG 0x80000000U
+#define RPC_FRAG_LEN_MASK 0x7fffffffU
+
+/* Largest RPC record accepted over TCP (all fragments together) */
+#define NFS_MAX_RECORD_SIZE (MAX_NFS_DATA_SIZE * 8 + 1024)
+
 /* Simple RPC header structure */
 struct rpc_header {
     __u32 xid;           /* Transaction ID */
@@ -121,31 +177,72 @@ struct nfs_fattr {
     __u32 ctime_nsec;
 };
 
-/* NFS request event for userspace */
-struct nfs_request {
-    __u32 client_addr;
-    __u16 client_port;
-    __u32 xid;           /* RPC transaction ID */
-    __u32 procedure;     /* NFS procedure number */
-    __u8 processed_in_kernel;  /* 1 if handled in kernel, 0 if forwarded */
-    char filename[MAX_FILENAME_LEN];
-    __u32 offset;        /* For READ/WRITE operations */
-    __u32 count;         /* For READ/WRITE operations */
-    struct nfs_fh fh;    /* File handle */
+/* Client address as an IPv6 address, IPv4 clients as ::ffff:a.b.c.d
+ * (the form a dual-stack socket reports them in) */
+struct nfs_addr {
+    __u32 a32[4];        /* Network byte order */
 };
 
-/* NFS operation event */
+/* Event for user space, one per sampled call */
 struct nfs_event {
-    __u32 client_addr;
-    __u16 client_port;
+    __u16 type;          /* nfs_event_type */
+    __u16 outcome;       /* nfs_outcome */
+    __u16 procedure;
+    __u16 client_port;   /* Network byte order */
+    struct nfs_addr client_addr;
     __u32 xid;
-    __u32 procedure;
-    __u32 result;        /* nfs_op_result enum */
-    char filename[MAX_FILENAME_LEN];
-    __u32 file_size;
+    __u32 count;         /* READ arguments */
+    __u64 offset;
+    __u32 file_size;     /* Of a cached file */
+    __u32 pad;
     __u64 timestamp;
-    __u8 forwarded_to_user;
-    __u8 from_cache;
+};
+
+/* Fast-path tunables, read per packet and changed at run time through
+ * the mmap'ed .data section (see the control socket in nfs_server.c) */
+struct nfs_config {
+    __u32 kernel_procs;          /* 1 << proc for each procedure answered in kernel */
+    __u32 cache_ttl_seconds;
+    __u32 max_cached_file_size;  /* Larger files are neither cached nor served */
+    __u32 event_sample_rate;     /* 1 in N calls, 0 for none */
+    __u32 events_enabled;        /* Off: only the per-CPU aggregates are kept */
+    __u32 xsk_enabled;           /* XDP hands calls the kernel will not answer to nfs_xsks */
+    __u32 steer_cpus;            /* Slots used in nfs_steer_cpus, 0 to leave packets where they are */
+    __u32 steer_remote;          /* nfs_server_xdp_cpu runs the XDP stage on the target core */
+};
+
+/* Cores NFS packets can be steered to (-R) */
+#define NFS_STEER_MAX_CPUS 64
+
+/* AF_XDP sockets, one per RX queue */
+#define NFS_XSK_MAX_QUEUES 64
+
+/* What nfs_server_xdp parsed, left as XDP metadata in front of a frame
+ * it redirects to AF_XDP. The kernel allows at most 32 bytes. */
+struct nfs_xsk_meta {
+    __u16 l3_off;        /* IP header, past the Ethernet header and VLAN tags */
+    __u16 l4_off;        /* UDP header */
+    __u8 ipv6;
+    __u8 pad[3];
+};
+
+/* Everything the fast path can answer */
+#define NFS_KERNEL_PROCS_ALL ((1U << NFSPROC3_NULL) | (1U << NFSPROC3_GETATTR) | \
+                              (1U << NFSPROC3_ACCESS) | (1U << NFSPROC3_READ))
+
+/* Cached file data lives in the nfs_arena map, mapped at the same
+ * address in user space and addressed by both sides by offset */
+#define NFS_ARENA_ADDR (1ULL << 44)
+#define NFS_ARENA_PAGES 4096
+#define NFS_ARENA_MIN_CHUNK 64
+#define NFS_ARENA_NCLASSES 8         /* 64 bytes to MAX_NFS_DATA_SIZE */
+
+/* Start of the arena. User space allocates the rest in power-of-two
+ * size classes; free chunks link through their first word. BPF reads
+ * only the data. */
+struct nfs_arena_hdr {
+    __u32 top;                          /* End of what was ever handed out */
+    __u32 free[NFS_ARENA_NCLASSES];     /* Free list heads, 0 if empty */
 };
 
 /* File cache entry for NFS */
@@ -154,7 +251,7 @@ struct nfs_file_cache_entry {
     struct nfs_fh fh;           /* File handle */
     struct nfs_fattr attr;      /* File attributes */
     __u32 data_size;            /* Size of cached data */
-    __u8 data[MAX_NFS_DATA_SIZE]; /* Cached file data (for small files) */
+    __u32 data_off;             /* Arena offset of the data (for small files) */
     __u64 cache_time;           /* When this was cached */
     __u32 cache_hits;
     __u8 valid;
@@ -169,13 +266,218 @@ struct nfs_dir_entry {
     __u8 valid;
 };
 
-/* Connection state tracking */
+/* Key of an accepted NFS/TCP socket in the sockhash */
+struct nfs_sock_key {
+    struct nfs_addr remote_addr;
+    __u32 remote_port;   /* Host byte order */
+    __u32 local_port;    /* Host byte order */
+};
+
+/* Accepted NFS/TCP connections, each with a slot in nfs_tcp_order */
+#define NFS_TCP_MAX_CONNS 64
+
+/* Reply order on one NFS/TCP connection. The stream verdict's replies
+ * leave from a backlog worker, after the verdict returns; a user space
+ * reply written meanwhile could land inside one. So the verdict only
+ * answers while user space owes no reply, and user space only writes
+ * once the kernel's replies have all reached the socket. */
+struct nfs_tcp_order {
+    __u64 kernel_bytes;  /* Reply bytes the verdict queued, record marks included */
+    __u32 to_user;       /* Record fragments passed to user space */
+    __u32 user_done;     /* Of those, how many are answered (user space writes this) */
+};
+
+/* Duplicate request cache: reply blobs kept for retransmits */
+#define NFS_DRC_MAX_REPLY 512
+
+/* In-progress entries older than this are treated as lost */
+#define NFS_DRC_IN_PROGRESS_NS 2000000000ULL
+
+enum nfs_drc_state {
+    NFS_DRC_IN_PROGRESS = 1,    /* Forwarded to user space, no reply yet */
+    NFS_DRC_DONE = 2            /* Reply sent and stored in the entry */
+};
+
+/* A call as the client identifies it; zero the padding before use */
+struct nfs_drc_key {
+    struct nfs_addr client_addr;
+    __u16 client_port;   /* Network byte order */
+    __u16 pad;
+    __u32 xid;
+};
+
+struct nfs_drc_entry {
+    __u32 state;         /* nfs_drc_state */
+    __u32 procedure;
+    __u64 timestamp;     /* CLOCK_MONOTONIC ns */
+    __u32 reply_len;
+    __u8 reply[NFS_DRC_MAX_REPLY];
+};
+
+/* Procedures whose replies must be replayed, not recomputed, when a
+ * retransmit arrives: running them twice changes the result */
+static inline int nfs3_proc_needs_drc(__u32 proc)
+{
+    switch (proc) {
+    case NFSPROC3_SETATTR:
+    case NFSPROC3_WRITE:
+    case NFSPROC3_CREATE:
+    case NFSPROC3_MKDIR:
+    case NFSPROC3_SYMLINK:
+    case NFSPROC3_MKNOD:
+    case NFSPROC3_REMOVE:
+    case NFSPROC3_RMDIR:
+    case NFSPROC3_RENAME:
+    case NFSPROC3_LINK:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/* QoS classes, each with its own token buckets */
+enum nfs_qos_class {
+    NFS_QOS_META = 0,    /* Everything but READ, WRITE and COMMIT */
+    NFS_QOS_DATA = 1,
+    NFS_QOS_NCLASSES
+};
+
+/* What the XDP program does with an over-limit request */
+enum nfs_qos_action {
+    NFS_QOS_DROP = 0,
+    NFS_QOS_JUKEBOX = 1  /* Answer NFS3ERR_JUKEBOX so the client backs off */
+};
+
+/* Requests per second and bucket depth; a rate of 0 is unlimited and a
+ * burst of 0 means one second's worth */
+struct nfs_qos_limit {
+    __u32 rate;
+    __u32 burst;
+};
+
+struct nfs_token_bucket {
+    __u64 tokens;        /* In units of 1e-9 requests */
+    __u64 last_ns;
+};
+
+/* LPM trie key of a QoS rule; an IPv4 prefix /n is ::ffff:0:0/(96 + n) */
+struct nfs_qos_key {
+    __u32 prefixlen;
+    struct nfs_addr addr;
+};
+
+/* QoS rule for an address prefix: every client inside it gets buckets at
+ * the @client limits, and all of them together share the @subnet ones */
+struct nfs_qos_rule {
+    struct nfs_qos_limit client[NFS_QOS_NCLASSES];
+    struct nfs_qos_limit subnet[NFS_QOS_NCLASSES];
+    __u32 action;        /* nfs_qos_action */
+    __u32 pad;
+    struct nfs_token_bucket subnet_bucket[NFS_QOS_NCLASSES];  /* Kernel state */
+};
+
+/* Per-client QoS state */
+struct nfs_qos_client {
+    struct nfs_token_bucket bucket[NFS_QOS_NCLASSES];
+};
+
+static inline int nfs3_proc_qos_class(__u32 proc)
+{
+    return proc == NFSPROC3_READ || proc == NFSPROC3_WRITE || proc == NFSPROC3_COMMIT ?
+           NFS_QOS_DATA : NFS_QOS_META;
+}
+
+/* Per-client request accounting. Each CPU keeps its own copy; user
+ * space sums the counters and takes the latest time. */
 struct nfs_client_state {
-    __u32 client_addr;
+    struct nfs_addr client_addr;
     __u64 last_request_time;
-    __u32 request_count;
-    __u32 kernel_processed;
-    __u32 user_forwarded;
+    __u64 request_count;
+    __u64 kernel_processed;
+    __u64 user_forwarded;
+};
+
+/* What became of a call. The MISS_* outcomes are forwarded to user
+ * space too, but say why the fast path could not answer. */
+enum nfs_outcome {
+    NFS_OUT_KERNEL_HIT,
+    NFS_OUT_MISS_NO_HANDLE,      /* File handle not known to the kernel */
+    NFS_OUT_MISS_NOT_CACHED,     /* No valid attribute cache entry */
+    NFS_OUT_MISS_EXPIRED,        /* Cache entry older than its TTL */
+    NFS_OUT_MISS_RANGE,          /* READ outside the cached data */
+    NFS_OUT_MISS_REPLY,          /* Reply could not be built in place */
+    NFS_OUT_FORWARDED,           /* Procedure never served in kernel */
+    NFS_OUT_DRC_DROP,
+    NFS_OUT_DRC_REPLAY,
+    NFS_OUT_QOS_DROP,
+    NFS_OUT_QOS_JUKEBOX,
+    NFS_OUT_ERROR,               /* Packet consumed but no reply sent */
+    NFS_NOUTCOMES
+};
+
+/* log2(ns) buckets: bucket n counts times in [2^n, 2^(n+1)) */
+#define NFS_LAT_BUCKETS 32
+
+/* Who answered a call, for end-to-end latency */
+enum nfs_path {
+    NFS_PATH_KERNEL,
+    NFS_PATH_USER,
+    NFS_NPATHS
+};
+
+/* Ingress time of a UDP call forwarded to user space, keyed like the
+ * DRC by client address, port and XID */
+struct nfs_xid_stamp {
+    __u64 start_ns;
+    __u32 procedure;
+    __u32 pad;
 };
 
+/* One slot per CPU in an mmap'able array; user space sums the slots
+ * with plain loads. Cache-line aligned so neighbouring CPUs never share
+ * a line. */
+struct nfs_stats {
+    __u64 calls[NFS3_NPROCS][NFS_NOUTCOMES];
+    __u64 kernel_ns[NFS3_NPROCS][NFS_LAT_BUCKETS];  /* TC/sk_skb time */
+    __u64 e2e_ns[NFS_NPATHS][NFS3_NPROCS][NFS_LAT_BUCKETS];  /* Ingress to reply (UDP) */
+    __u64 xdp_packets;
+    __u64 fs_events;
+    __u64 event_drops;       /* Ring buffer reservations that failed */
+} __attribute__((aligned(64)));
+
+/* Layout of the maps kept in bpffs across restarts (-P). The kernel
+ * only checks sizes, so bump this whenever nfs_file_cache_entry,
+ * nfs_fh, nfs_client_state, nfs_stats or nfs_arena_hdr change shape at
+ * the same size. */
+#define NFS_PIN_LAYOUT_VERSION 4
+
+/* ACCESS3: the requested bits that @attr's mode grants to uid/gid.
+ * Shared by the BPF fast path and the user space handler. */
+static inline __u32 nfs3_access_granted(__u32 uid, __u32 gid,
+                                        const struct nfs_fattr *attr, __u32 requested)
+{
+    __u32 perm, granted = 0;
+    int is_dir = attr->type == 2;
+
+    if (uid == 0)
+        perm = 7;
+    else if (uid == attr->uid)
+        perm = (attr->mode >> 6) & 7;
+    else if (gid == attr->gid)
+        perm = (attr->mode >> 3) & 7;
+    else
+        perm = attr->mode & 7;
+
+    /* For directories x means LOOKUP and w also allows DELETE */
+    if (perm & 4)
+        granted |= NFS3_ACCESS_READ;
+    if (perm & 2)
+        granted |= NFS3_ACCESS_MODIFY | NFS3_ACCESS_EXTEND |
+                   (is_dir ? NFS3_ACCESS_DELETE : 0);
+    if (perm & 1)
+        granted |= is_dir ? NFS3_ACCESS_LOOKUP : NFS3_ACCESS_EXECUTE;
+
+    return granted & requested;
+}
+
 #endif /* __NFS_SERVER_H */
\ No newline at end of file
@@ -0,0 +1,503 @@
+// SPDX-License-Identifier: GPL-2.0 OR BSD-3-Clause
+/* Copyright (c) 2024 NFS Server Kernel Processing */
+#ifndef __NFS_XDR_H
+#define __NFS_XDR_H
+
+/*
+ * NFSv3 XDR codec (RFC 1813) shared by the BPF fast path and user space.
+ *
+ * Encoding is allocation-free and writes straight into a caller-provided
+ * buffer. A message is sized up front from nfs3_reply_fixed_size[] plus
+ * its variable part, checked once with xdr_enc_reserve(), and the
+ * xdr_encode_*() calls after that are unchecked. Decoding is bounds
+ * checked with a sticky error flag so a handler checks once at the end.
+ */
+
+#include "nfs_server.h"
+
+#ifdef __KERNEL__
+#define xdr_htonl(x) bpf_htonl(x)
+#define xdr_ntohl(x) bpf_ntohl(x)
+#else
+#define xdr_htonl(x) htonl(x)
+#define xdr_ntohl(x) ntohl(x)
+#endif
+
+#define NFS3_FHSIZE 64
+#define NFS3_COOKIEVERFSIZE 8
+#define NFS3_WRITEVERFSIZE 8
+
+#define XDR_QUADLEN(len) (((len) + 3) >> 2)
+#define XDR_PADLEN(len) (XDR_QUADLEN(len) << 2)
+
+/* Encoded sizes in bytes */
+#define XDR_RPC_REPLY_HDR_SIZE 24    /* xid, REPLY, accepted, verf, accept_stat */
+#define XDR_FATTR3_SIZE 84
+#define XDR_POST_OP_ATTR_SIZE (4 + XDR_FATTR3_SIZE)
+#define XDR_PRE_OP_ATTR_SIZE (4 + 24)
+#define XDR_WCC_DATA_SIZE (XDR_PRE_OP_ATTR_SIZE + XDR_POST_OP_ATTR_SIZE)
+#define XDR_FH3_SIZE (4 + NFS3_FHSIZE)
+#define XDR_POST_OP_FH3_SIZE (4 + XDR_FH3_SIZE)
+
+/* ftype3 */
+enum nfs3_ftype {
+    NF3REG = 1,
+    NF3DIR = 2,
+    NF3BLK = 3,
+    NF3CHR = 4,
+    NF3LNK = 5,
+    NF3SOCK = 6,
+    NF3FIFO = 7
+};
+
+/* stable_how of WRITE3args / committed field of WRITE3resok */
+enum nfs3_stable_how {
+    NFS3_UNSTABLE = 0,
+    NFS3_DATA_SYNC = 1,
+    NFS3_FILE_SYNC = 2
+};
+
+/* accept_stat of an accepted RPC reply */
+enum rpc_accept_stat {
+    RPC_SUCCESS = 0,
+    RPC_PROG_UNAVAIL = 1,
+    RPC_PROG_MISMATCH = 2,
+    RPC_PROC_UNAVAIL = 3,
+    RPC_GARBAGE_ARGS = 4,
+    RPC_SYSTEM_ERR = 5
+};
+
+/*
+ * Largest fixed part of each procedure's result (status included, RPC
+ * header excluded), taken over resok and resfail. Variable data -- READ
+ * payload, READLINK path, READDIR entries -- is added by the caller.
+ */
+static const __u16 nfs3_reply_fixed_size[NFS3_NPROCS] = {
+    [NFSPROC3_NULL]        = 0,
+    [NFSPROC3_GETATTR]     = 4 + XDR_FATTR3_SIZE,
+    [NFSPROC3_SETATTR]     = 4 + XDR_WCC_DATA_SIZE,
+    [NFSPROC3_LOOKUP]      = 4 + XDR_FH3_SIZE + 2 * XDR_POST_OP_ATTR_SIZE,
+    [NFSPROC3_ACCESS]      = 4 + XDR_POST_OP_ATTR_SIZE + 4,
+    [NFSPROC3_READLINK]    = 4 + XDR_POST_OP_ATTR_SIZE + 4,
+    [NFSPROC3_READ]        = 4 + XDR_POST_OP_ATTR_SIZE + 12,
+    [NFSPROC3_WRITE]       = 4 + XDR_WCC_DATA_SIZE + 8 + NFS3_WRITEVERFSIZE,
+    [NFSPROC3_CREATE]      = 4 + XDR_POST_OP_FH3_SIZE + XDR_POST_OP_ATTR_SIZE + XDR_WCC_DATA_SIZE,
+    [NFSPROC3_MKDIR]       = 4 + XDR_POST_OP_FH3_SIZE + XDR_POST_OP_ATTR_SIZE + XDR_WCC_DATA_SIZE,
+    [NFSPROC3_SYMLINK]     = 4 + XDR_POST_OP_FH3_SIZE + XDR_POST_OP_ATTR_SIZE + XDR_WCC_DATA_SIZE,
+    [NFSPROC3_MKNOD]       = 4 + XDR_POST_OP_FH3_SIZE + XDR_POST_OP_ATTR_SIZE + XDR_WCC_DATA_SIZE,
+    [NFSPROC3_REMOVE]      = 4 + XDR_WCC_DATA_SIZE,
+    [NFSPROC3_RMDIR]       = 4 + XDR_WCC_DATA_SIZE,
+    [NFSPROC3_RENAME]      = 4 + 2 * XDR_WCC_DATA_SIZE,
+    [NFSPROC3_LINK]        = 4 + XDR_POST_OP_ATTR_SIZE + XDR_WCC_DATA_SIZE,
+    [NFSPROC3_READDIR]     = 4 + XDR_POST_OP_ATTR_SIZE + NFS3_COOKIEVERFSIZE + 8,
+    [NFSPROC3_READDIRPLUS] = 4 + XDR_POST_OP_ATTR_SIZE + NFS3_COOKIEVERFSIZE + 8,
+    [NFSPROC3_FSSTAT]      = 4 + XDR_POST_OP_ATTR_SIZE + 6 * 8 + 4,
+    [NFSPROC3_FSINFO]      = 4 + XDR_POST_OP_ATTR_SIZE + 7 * 4 + 8 + 8 + 4,
+    [NFSPROC3_PATHCONF]    = 4 + XDR_POST_OP_ATTR_SIZE + 2 * 4 + 4 * 4,
+    [NFSPROC3_COMMIT]      = 4 + XDR_WCC_DATA_SIZE + NFS3_WRITEVERFSIZE,
+};
+
+/*
+ * Number of optional attributes (post_op_attr, or the two halves of a
+ * wcc_data) in each procedure's resfail. An error reply without
+ * attributes is the status followed by this many FALSE words.
+ */
+static const __u8 nfs3_resfail_bools[NFS3_NPROCS] = {
+    [NFSPROC3_NULL]        = 0,
+    [NFSPROC3_GETATTR]     = 0,
+    [NFSPROC3_SETATTR]     = 2,
+    [NFSPROC3_LOOKUP]      = 1,
+    [NFSPROC3_ACCESS]      = 1,
+    [NFSPROC3_READLINK]    = 1,
+    [NFSPROC3_READ]        = 1,
+    [NFSPROC3_WRITE]       = 2,
+    [NFSPROC3_CREATE]      = 2,
+    [NFSPROC3_MKDIR]       = 2,
+    [NFSPROC3_SYMLINK]     = 2,
+    [NFSPROC3_MKNOD]       = 2,
+    [NFSPROC3_REMOVE]      = 2,
+    [NFSPROC3_RMDIR]       = 2,
+    [NFSPROC3_RENAME]      = 4,
+    [NFSPROC3_LINK]        = 3,
+    [NFSPROC3_READDIR]     = 1,
+    [NFSPROC3_READDIRPLUS] = 1,
+    [NFSPROC3_FSSTAT]      = 1,
+    [NFSPROC3_FSINFO]      = 1,
+    [NFSPROC3_PATHCONF]    = 1,
+    [NFSPROC3_COMMIT]      = 2,
+};
+
+/* Worst-case size of a whole reply with @var_len bytes of variable data */
+static inline __u32 nfs3_reply_size(__u32 proc, __u32 var_len)
+{
+    if (proc >= NFS3_NPROCS)
+        return XDR_RPC_REPLY_HDR_SIZE;
+    return XDR_RPC_REPLY_HDR_SIZE + nfs3_reply_fixed_size[proc] + var_len;
+}
+
+/* Encoded size of one READDIR / READDIRPLUS directory entry */
+static inline __u32 xdr_entry3_size(__u32 name_len)
+{
+    return 4 + 8 + 4 + XDR_PADLEN(name_len) + 8;
+}
+
+static inline __u32 xdr_entryplus3_size(__u32 name_len)
+{
+    return xdr_entry3_size(name_len) + XDR_POST_OP_ATTR_SIZE + XDR_POST_OP_FH3_SIZE;
+}
+
+/* pre_op_attr / wcc_attr */
+struct nfs_wcc_attr {
+    __u64 size;
+    __u32 mtime_sec;
+    __u32 mtime_nsec;
+    __u32 ctime_sec;
+    __u32 ctime_nsec;
+};
+
+/* wcc_data: attributes before and after a modifying operation */
+struct nfs_wcc_data {
+    __u8 before_valid;
+    __u8 after_valid;
+    struct nfs_wcc_attr before;
+    struct nfs_fattr after;
+};
+
+/* FSSTAT3resok */
+struct nfs_fsstat {
+    __u64 tbytes;
+    __u64 fbytes;
+    __u64 abytes;
+    __u64 tfiles;
+    __u64 ffiles;
+    __u64 afiles;
+    __u32 invarsec;
+};
+
+/* FSINFO3resok */
+struct nfs_fsinfo {
+    __u32 rtmax;
+    __u32 rtpref;
+    __u32 rtmult;
+    __u32 wtmax;
+    __u32 wtpref;
+    __u32 wtmult;
+    __u32 dtpref;
+    __u64 maxfilesize;
+    __u32 time_delta_sec;
+    __u32 time_delta_nsec;
+    __u32 properties;
+};
+
+/* FSINFO properties */
+#define FSF3_LINK        0x0001
+#define FSF3_SYMLINK     0x0002
+#define FSF3_HOMOGENEOUS 0x0008
+#define FSF3_CANSETTIME  0x0010
+
+/* PATHCONF3resok */
+struct nfs_pathconf {
+    __u32 linkmax;
+    __u32 name_max;
+    __u8 no_trunc;
+    __u8 chown_restricted;
+    __u8 case_insensitive;
+    __u8 case_preserving;
+};
+
+/* Encoder cursor */
+struct xdr_buf {
+    __u8 *p;
+    __u8 *end;
+};
+
+/* Start a message of at most @need bytes in @buf. This is the only
+ * length check; every xdr_encode_*() after it is unchecked. */
+static inline int xdr_enc_reserve(struct xdr_buf *x, void *buf, __u32 buf_len, __u32 need)
+{
+    x->p = buf;
+    x->end = (__u8 *)buf + buf_len;
+    return need <= buf_len ? 0 : -1;
+}
+
+static inline __u32 xdr_enc_len(const struct xdr_buf *x, const void *buf)
+{
+    return x->p - (const __u8 *)buf;
+}
+
+static inline void xdr_encode_u32(struct xdr_buf *x, __u32 val)
+{
+    __u32 be = xdr_htonl(val);
+
+    __builtin_memcpy(x->p, &be, 4);
+    x->p += 4;
+}
+
+static inline void xdr_encode_u64(struct xdr_buf *x, __u64 val)
+{
+    xdr_encode_u32(x, val >> 32);
+    xdr_encode_u32(x, val);
+}
+
+static inline void xdr_encode_bool(struct xdr_buf *x, int val)
+{
+    xdr_encode_u32(x, val ? 1 : 0);
+}
+
+#ifndef __KERNEL__
+/* Variable-length opaque<>/string<>: length, bytes, zero padding */
+static inline void xdr_encode_opaque(struct xdr_buf *x, const void *data, __u32 len)
+{
+    xdr_encode_u32(x, len);
+    memcpy(x->p, data, len);
+    memset(x->p + len, 0, XDR_PADLEN(len) - len);
+    x->p += XDR_PADLEN(len);
+}
+
+/* Fixed-length opaque[] */
+static inline void xdr_encode_fixed(struct xdr_buf *x, const void *data, __u32 len)
+{
+    memcpy(x->p, data, len);
+    memset(x->p + len, 0, XDR_PADLEN(len) - len);
+    x->p += XDR_PADLEN(len);
+}
+
+static inline void xdr_encode_string(struct xdr_buf *x, const char *str, __u32 len)
+{
+    xdr_encode_opaque(x, str, len);
+}
+
+static inline void xdr_encode_fh3(struct xdr_buf *x, const struct nfs_fh *fh)
+{
+    xdr_encode_opaque(x, fh->data, fh->len);
+}
+
+static inline void xdr_encode_post_op_fh3(struct xdr_buf *x, const struct nfs_fh *fh)
+{
+    xdr_encode_bool(x, fh != NULL);
+    if (fh)
+        xdr_encode_fh3(x, fh);
+}
+#endif /* !__KERNEL__ */
+
+/* Accepted reply header; @stat is the accept_stat */
+static inline void xdr_encode_reply_hdr(struct xdr_buf *x, __u32 xid, __u32 stat)
+{
+    xdr_encode_u32(x, xid);
+    xdr_encode_u32(x, RPC_REPLY);
+    xdr_encode_u32(x, RPC_MSG_ACCEPTED);
+    xdr_encode_u32(x, RPC_AUTH_NULL);   /* Verifier flavor */
+    xdr_encode_u32(x, 0);               /* Verifier length */
+    xdr_encode_u32(x, stat);
+}
+
+/* fattr3 */
+static inline void xdr_encode_fattr3(struct xdr_buf *x, const struct nfs_fattr *attr)
+{
+    xdr_encode_u32(x, attr->type);
+    xdr_encode_u32(x, attr->mode & 07777);
+    xdr_encode_u32(x, attr->nlink);
+    xdr_encode_u32(x, attr->uid);
+    xdr_encode_u32(x, attr->gid);
+    xdr_encode_u64(x, attr->size);
+    xdr_encode_u64(x, attr->used);
+    xdr_encode_u32(x, 0);               /* rdev.specdata1 */
+    xdr_encode_u32(x, 0);               /* rdev.specdata2 */
+    xdr_encode_u64(x, attr->fsid);
+    xdr_encode_u64(x, attr->fileid);
+    xdr_encode_u32(x, attr->atime_sec);
+    xdr_encode_u32(x, attr->atime_nsec);
+    xdr_encode_u32(x, attr->mtime_sec);
+    xdr_encode_u32(x, attr->mtime_nsec);
+    xdr_encode_u32(x, attr->ctime_sec);
+    xdr_encode_u32(x, attr->ctime_nsec);
+}
+
+/* post_op_attr: NULL encodes attributes_follow = FALSE */
+static inline void xdr_encode_post_op_attr(struct xdr_buf *x, const struct nfs_fattr *attr)
+{
+    xdr_encode_bool(x, attr != NULL);
+    if (attr)
+        xdr_encode_fattr3(x, attr);
+}
+
+/* pre_op_attr: NULL encodes attributes_follow = FALSE */
+static inline void xdr_encode_pre_op_attr(struct xdr_buf *x, const struct nfs_wcc_attr *attr)
+{
+    xdr_encode_bool(x, attr != NULL);
+    if (attr) {
+        xdr_encode_u64(x, attr->size);
+        xdr_encode_u32(x, attr->mtime_sec);
+        xdr_encode_u32(x, attr->mtime_nsec);
+        xdr_encode_u32(x, attr->ctime_sec);
+        xdr_encode_u32(x, attr->ctime_nsec);
+    }
+}
+
+static inline void xdr_encode_wcc_data(struct xdr_buf *x, const struct nfs_wcc_data *wcc)
+{
+    xdr_encode_pre_op_attr(x, wcc && wcc->before_valid ? &wcc->before : NULL);
+    xdr_encode_post_op_attr(x, wcc && wcc->after_valid ? &wcc->after : NULL);
+}
+
+#ifndef __KERNEL__
+/* entry3 of a READDIR dirlist3 */
+static inline void xdr_encode_entry3(struct xdr_buf *x, __u64 fileid, const char *name,
+                                     __u32 name_len, __u64 cookie)
+{
+    xdr_encode_bool(x, 1);              /* value_follows */
+    xdr_encode_u64(x, fileid);
+    xdr_encode_string(x, name, name_len);
+    xdr_encode_u64(x, cookie);
+}
+
+/* entryplus3 of a READDIRPLUS dirlistplus3 */
+static inline void xdr_encode_entryplus3(struct xdr_buf *x, __u64 fileid, const char *name,
+                                         __u32 name_len, __u64 cookie,
+                                         const struct nfs_fattr *attr,
+                                         const struct nfs_fh *fh)
+{
+    xdr_encode_entry3(x, fileid, name, name_len, cookie);
+    xdr_encode_post_op_attr(x, attr);
+    xdr_encode_post_op_fh3(x, fh);
+}
+
+/* Terminates a dirlist3 / dirlistplus3 */
+static inline void xdr_encode_dirlist_end(struct xdr_buf *x, int eof)
+{
+    xdr_encode_bool(x, 0);              /* No more entries */
+    xdr_encode_bool(x, eof);
+}
+
+static inline void xdr_encode_fsstat(struct xdr_buf *x, const struct nfs_fsstat *fs)
+{
+    xdr_encode_u64(x, fs->tbytes);
+    xdr_encode_u64(x, fs->fbytes);
+    xdr_encode_u64(x, fs->abytes);
+    xdr_encode_u64(x, fs->tfiles);
+    xdr_encode_u64(x, fs->ffiles);
+    xdr_encode_u64(x, fs->afiles);
+    xdr_encode_u32(x, fs->invarsec);
+}
+
+static inline void xdr_encode_fsinfo(struct xdr_buf *x, const struct nfs_fsinfo *fs)
+{
+    xdr_encode_u32(x, fs->rtmax);
+    xdr_encode_u32(x, fs->rtpref);
+    xdr_encode_u32(x, fs->rtmult);
+    xdr_encode_u32(x, fs->wtmax);
+    xdr_encode_u32(x, fs->wtpref);
+    xdr_encode_u32(x, fs->wtmult);
+    xdr_encode_u32(x, fs->dtpref);
+    xdr_encode_u64(x, fs->maxfilesize);
+    xdr_encode_u32(x, fs->time_delta_sec);
+    xdr_encode_u32(x, fs->time_delta_nsec);
+    xdr_encode_u32(x, fs->properties);
+}
+
+static inline void xdr_encode_pathconf(struct xdr_buf *x, const struct nfs_pathconf *pc)
+{
+    xdr_encode_u32(x, pc->linkmax);
+    xdr_encode_u32(x, pc->name_max);
+    xdr_encode_bool(x, pc->no_trunc);
+    xdr_encode_bool(x, pc->chown_restricted);
+    xdr_encode_bool(x, pc->case_insensitive);
+    xdr_encode_bool(x, pc->case_preserving);
+}
+
+/* Decoder cursor; any overrun sets err and further reads return 0 */
+struct xdr_dec {
+    const __u8 *p;
+    const __u8 *end;
+    int err;
+};
+
+static inline void xdr_dec_init(struct xdr_dec *d, const void *buf, __u32 len)
+{
+    d->p = buf;
+    d->end = (const __u8 *)buf + len;
+    d->err = 0;
+}
+
+static inline const __u8 *xdr_dec_take(struct xdr_dec *d, __u32 len)
+{
+    const __u8 *p = d->p;
+
+    if (d->err || (__u32)(d->end - d->p) < len) {
+        d->err = 1;
+        return NULL;
+    }
+    d->p += len;
+    return p;
+}
+
+static inline __u32 xdr_decode_u32(struct xdr_dec *d)
+{
+    const __u8 *p = xdr_dec_take(d, 4);
+    __u32 be;
+
+    if (!p)
+        return 0;
+    memcpy(&be, p, 4);
+    return xdr_ntohl(be);
+}
+
+static inline __u64 xdr_decode_u64(struct xdr_dec *d)
+{
+    __u64 hi = xdr_decode_u32(d);
+
+    return (hi << 32) | xdr_decode_u32(d);
+}
+
+/* Variable-length opaque<@max>; returns a pointer into the message */
+static inline const __u8 *xdr_decode_opaque(struct xdr_dec *d, __u32 *len, __u32 max)
+{
+    *len = xdr_decode_u32(d);
+    if (*len > max) {
+        d->err = 1;
+        return NULL;
+    }
+    return xdr_dec_take(d, XDR_PADLEN(*len));
+}
+
+/* Fixed-length opaque[@len] copied out */
+static inline void xdr_decode_fixed(struct xdr_dec *d, void *out, __u32 len)
+{
+    const __u8 *p = xdr_dec_take(d, XDR_PADLEN(len));
+
+    if (p)
+        memcpy(out, p, len);
+}
+
+/* string<@max> copied out and NUL-terminated; @out holds max + 1 bytes */
+static inline __u32 xdr_decode_string(struct xdr_dec *d, char *out, __u32 max)
+{
+    __u32 len;
+    const __u8 *p = xdr_decode_opaque(d, &len, max);
+
+    if (!p) {
+        out[0] = '\0';
+        return 0;
+    }
+    memcpy(out, p, len);
+    out[len] = '\0';
+    return len;
+}
+
+/* nfs_fh3, zero-padded so it can be used as a map key */
+static inline void xdr_decode_fh3(struct xdr_dec *d, struct nfs_fh *fh)
+{
+    __u32 len;
+    const __u8 *p = xdr_decode_opaque(d, &len, NFS3_FHSIZE);
+
+    memset(fh, 0, sizeof(*fh));
+    if (!p || !len) {
+        d->err = 1;
+        return;
+    }
+    fh->len = len;
+    memcpy(fh->data, p, len);
+}
+#endif /* !__KERNEL__ */
+
+#endif /* __NFS_XDR_H */
@@ -1,13 +1,22 @@
 #!/usr/bin/env python3
 """
 Extended NFS Server Test Client
-Tests NULL, GETATTR, and READ operations
+Tests NULL, GETATTR, READ, COMMIT after an open file is evicted and
+pipelined TCP calls answered partly by the kernel
 """
 
+import os
 import socket
 import struct
+import sys
 import time
 
+# Handle of the export root: the server hashes the empty path
+ROOT_FH = struct.pack('<II', 0, 0xdeadbeef)
+
+# Files the server keeps open for WRITE (MAX_OPEN_FILES in nfs_server.c)
+MAX_OPEN_FILES = 64
+
 class NFSClient:
     def __init__(self, host='localhost', port=2049):
         self.host = host
@@ -91,6 +100,173 @@ class NFSClient:
         request = rpc_header + auth_cred + auth_verf + file_handle
         return self.send_nfs_request(request, "GETATTR", xid)
     
+    def create_auth_unix(self):
+        """Create AUTH_UNIX credentials for the caller, so WRITE is allowed"""
+        body = struct.pack('!II', 0, 0) + struct.pack('!III', os.getuid(), os.getgid(), 0)
+        return struct.pack('!II', 1, len(body)) + body
+
+    def call(self, xid, procedure, args, operation_name):
+        """Send one call with AUTH_UNIX; returns the reply body after the
+        accepted-reply header, or None"""
+        request = self.create_rpc_header(xid, procedure=procedure)
+        request += self.create_auth_unix() + self.create_auth_none() + args
+        ok, response = self.send_nfs_request(request, operation_name, xid)
+        if not ok or len(response) < 24:
+            return None
+        return response[24:]
+
+    @staticmethod
+    def opaque(data):
+        pad = (4 - len(data) % 4) % 4
+        return struct.pack('!I', len(data)) + data + b'\x00' * pad
+
+    @staticmethod
+    def skip_wcc(body, off):
+        """Skip a wcc_data: pre_op_attr then post_op_attr"""
+        if struct.unpack_from('!I', body, off)[0]:
+            off += 24
+        off += 4
+        if struct.unpack_from('!I', body, off)[0]:
+            off += 84
+        return off + 4
+
+    def lookup(self, xid, name):
+        body = self.call(xid, 3, self.opaque(ROOT_FH) + self.opaque(name.encode()), "LOOKUP")
+        if body is None or struct.unpack_from('!I', body, 0)[0] != 0:
+            return None
+        fh_len = struct.unpack_from('!I', body, 4)[0]
+        return body[8:8 + fh_len]
+
+    def write_unstable(self, xid, fh, data):
+        """WRITE @data at offset 0 as UNSTABLE; returns the verifier"""
+        args = self.opaque(fh) + struct.pack('!QII', 0, len(data), 0) + self.opaque(data)
+        body = self.call(xid, 7, args, "WRITE")
+        if body is None or struct.unpack_from('!I', body, 0)[0] != 0:
+            return None
+        off = self.skip_wcc(body, 4) + 8
+        return body[off:off + 8]
+
+    def test_commit_after_eviction(self, export_dir):
+        """Write UNSTABLE to one file, write to enough others that it is
+        evicted from the open file table, then COMMIT it. The server
+        syncs on eviction, so the COMMIT must return the verifier of the
+        WRITE only if the data reached the disk; a changed verifier
+        tells the client to send the write again."""
+        names = [f"commit_evict.{i}" for i in range(MAX_OPEN_FILES + 1)]
+        for name in names:
+            with open(os.path.join(export_dir, name), 'wb'):
+                pass
+
+        xid = 0x0c0a0000
+        fhs = []
+        for name in names:
+            xid += 1
+            fh = self.lookup(xid, name)
+            if fh is None:
+                print(f"✗ LOOKUP {name} failed")
+                return False
+            fhs.append(fh)
+
+        payload = b'evicted while dirty\n'
+        xid += 1
+        verf = self.write_unstable(xid, fhs[0], payload)
+        if verf is None:
+            print("✗ UNSTABLE WRITE failed")
+            return False
+        for fh in fhs[1:]:
+            xid += 1
+            if self.write_unstable(xid, fh, b'x') is None:
+                print("✗ UNSTABLE WRITE to evict the first file failed")
+                return False
+
+        xid += 1
+        body = self.call(xid, 21, self.opaque(fhs[0]) + struct.pack('!QI', 0, 0), "COMMIT")
+        if body is None or struct.unpack_from('!I', body, 0)[0] != 0:
+            print("✗ COMMIT failed")
+            return False
+        off = self.skip_wcc(body, 4)
+        commit_verf = body[off:off + 8]
+
+        with open(os.path.join(export_dir, names[0]), 'rb') as f:
+            on_disk = f.read()
+        if commit_verf == verf and on_disk != payload:
+            print("✗ COMMIT kept the verifier but the data is not on disk")
+            return False
+        if commit_verf != verf:
+            print("Verifier changed: writeback failed, the client resends")
+        print("✓ COMMIT after eviction is consistent with the data on disk")
+        return True
+
+    @staticmethod
+    def recv_exact(sock, n):
+        data = b''
+        while len(data) < n:
+            chunk = sock.recv(n - len(data))
+            if not chunk:
+                return None
+            data += chunk
+        return data
+
+    def test_tcp_pipelined(self, rounds=32):
+        """Pipeline calls the kernel answers (NULL, GETATTR, 8 KB READ of
+        the cached test.txt) with LOOKUPs it passes to user space, all in
+        one send on one TCP connection. Every reply must come back as a
+        whole record, in the order of the calls."""
+        fh = self.lookup(0x0e0a0000, "test.txt")
+        if fh is None:
+            print("✗ LOOKUP test.txt failed")
+            return False
+
+        cred = self.create_auth_unix() + self.create_auth_none()
+        calls = [
+            (0, b''),
+            (1, self.opaque(fh)),
+            (6, self.opaque(fh) + struct.pack('!QI', 0, 8192)),
+            (3, self.opaque(ROOT_FH) + self.opaque(b"test.txt")),
+        ]
+        xids = []
+        stream = b''
+        for i in range(rounds * len(calls)):
+            xid = 0x0e0a1000 + i
+            procedure, args = calls[i % len(calls)]
+            request = self.create_rpc_header(xid, procedure=procedure) + cred + args
+            stream += struct.pack('!I', 0x80000000 | len(request)) + request
+            xids.append(xid)
+
+        try:
+            sock = socket.create_connection((self.host, self.port), timeout=5.0)
+        except OSError as e:
+            print(f"✗ TCP connect failed: {e}")
+            return False
+        try:
+            sock.sendall(stream)
+            for i, xid in enumerate(xids):
+                mark = self.recv_exact(sock, 4)
+                if mark is None:
+                    print(f"✗ Connection closed after {i} of {len(xids)} replies")
+                    return False
+                mark = struct.unpack('!I', mark)[0]
+                length = mark & 0x7fffffff
+                if not mark & 0x80000000 or length < 24 or length > 1024 * 1024:
+                    print(f"✗ Reply {i}: bad record mark {mark:#x}")
+                    return False
+                reply = self.recv_exact(sock, length)
+                if reply is None:
+                    print(f"✗ Connection closed inside reply {i}")
+                    return False
+                got_xid, msg_type, reply_stat = struct.unpack_from('!3I', reply, 0)
+                if got_xid != xid or msg_type != 1 or reply_stat != 0:
+                    print(f"✗ Reply {i}: xid {got_xid:#x}, expected {xid:#x}")
+                    return False
+        except socket.timeout:
+            print("✗ Timed out waiting for pipelined replies")
+            return False
+        finally:
+            sock.close()
+
+        print(f"✓ {len(xids)} pipelined TCP replies intact and in order")
+        return True
+
     def test_read(self):
         """Test NFS READ operation (procedure 6)"""
         xid = 67890
@@ -114,9 +290,10 @@ def main():
     print("Extended NFS Server Test Client")
     print("=" * 40)
     
+    export_dir = sys.argv[1] if len(sys.argv) > 1 else './nfs_exports'
     client = NFSClient()
     tests_passed = 0
-    total_tests = 3
+    total_tests = 5
     
     # Test NULL operation
     success, response = client.test_null()
@@ -133,6 +310,14 @@ def main():
     if success:
         tests_passed += 1
     
+    # Test COMMIT of a file evicted with dirty ranges
+    if client.test_commit_after_eviction(export_dir):
+        tests_passed += 1
+    
+    # Test mixed kernel and user space replies on one TCP connection
+    if client.test_tcp_pipelined():
+        tests_passed += 1
+    
     print(f"\nTest Results: {tests_passed}/{total_tests} tests passed")
     if tests_passed == total_tests:
         print("✓ All tests passed!")